@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+/*
+ * Times each sample conversion kernel against its scalar reference
+ * on a period's worth of audio and checks that both give the same
+ * result.  Prints one JSON object per kernel on stdout.
+ */
+
+#include "wys-kernels.h"
+#include "wys-polyphase.h"
+#include "wys-echo.h"
+
+#include <glib.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** A 10 ms period of stereo 48 kHz audio */
+#define FRAMES      480
+#define CHANNELS    2
+#define SAMPLES     (FRAMES * CHANNELS)
+#define ITERATIONS  20000
+/** The echo canceller is much slower than the other kernels */
+#define ECHO_ITERATIONS 2000
+/** Its period in microseconds, for working out its share of a core */
+#define PERIOD_US   (FRAMES * 1000 / 48)
+/** Frequency bins in each of the echo canceller's transforms */
+#define BINS        129
+/** Butterflies in the last stage of its complex transforms */
+#define BUTTERFLIES 64
+
+
+static gint16 s16_in[SAMPLES];
+static gint32 s32_in[SAMPLES];
+static gfloat float_in[SAMPLES];
+
+static union
+{
+  gint16 s16[SAMPLES];
+  gint32 s32[SAMPLES];
+  gfloat f[SAMPLES];
+} out, ref_out;
+
+static gboolean all_match = TRUE;
+
+
+static void
+fill_input (void)
+{
+  GRand *rand = g_rand_new_with_seed (0);
+  guint i;
+
+  for (i = 0; i < SAMPLES; ++i)
+    {
+      s16_in[i] = g_rand_int_range (rand, G_MININT16, G_MAXINT16 + 1);
+      s32_in[i] = (gint32)g_rand_int (rand);
+      float_in[i] = g_rand_double_range (rand, -1.2, 1.2);
+    }
+
+  g_rand_free (rand);
+}
+
+
+/** Nanoseconds per call */
+static gdouble
+time_kernel (void (*run) (gpointer),
+             gpointer data,
+             guint    iterations)
+{
+  gint64 start;
+  guint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; ++i)
+    {
+      run (data);
+    }
+
+  return (g_get_monotonic_time () - start) * 1000.0 / iterations;
+}
+
+
+struct kernel
+{
+  const gchar *name;
+  void (*run) (gpointer);
+  void (*run_ref) (gpointer);
+  /** Relative difference allowed from the reference's float
+   * output, or 0 for an exact match */
+  gfloat tolerance;
+};
+
+
+static inline void
+reset_butterflies (gfloat *data)
+{
+  memcpy (data, float_in + FRAMES, 2 * BUTTERFLIES * sizeof (gfloat));
+  memcpy (data + FRAMES, float_in, 2 * BUTTERFLIES * sizeof (gfloat));
+}
+
+
+#define KERNEL(name, call, ref_call)                            \
+  static void run_##name (gpointer data) { call; }              \
+  static void run_##name##_ref (gpointer data) { ref_call; }
+
+KERNEL (s32_to_s16,
+        wys_kernel_s32_to_s16 (s32_in, out.s16, SAMPLES),
+        wys_kernel_s32_to_s16_ref (s32_in, ref_out.s16, SAMPLES))
+KERNEL (s16_to_s32,
+        wys_kernel_s16_to_s32 (s16_in, out.s32, SAMPLES),
+        wys_kernel_s16_to_s32_ref (s16_in, ref_out.s32, SAMPLES))
+KERNEL (float_to_s16,
+        wys_kernel_float_to_s16 (float_in, out.s16, SAMPLES),
+        wys_kernel_float_to_s16_ref (float_in, ref_out.s16, SAMPLES))
+KERNEL (s16_to_float,
+        wys_kernel_s16_to_float (s16_in, out.f, SAMPLES),
+        wys_kernel_s16_to_float_ref (s16_in, ref_out.f, SAMPLES))
+KERNEL (downmix_s16,
+        wys_kernel_downmix_s16 (s16_in, CHANNELS, out.s16, FRAMES),
+        wys_kernel_downmix_s16_ref (s16_in, CHANNELS, ref_out.s16, FRAMES))
+KERNEL (upmix_s16,
+        wys_kernel_upmix_s16 (s16_in, out.s16, CHANNELS, FRAMES),
+        wys_kernel_upmix_s16_ref (s16_in, ref_out.s16, CHANNELS, FRAMES))
+KERNEL (dot_s16,
+        out.s32[0] = wys_kernel_dot_s16 (s16_in, s16_in + FRAMES, 96),
+        ref_out.s32[0] = wys_kernel_dot_s16_ref (s16_in, s16_in + FRAMES, 96))
+KERNEL (cmac_f32,
+        wys_kernel_cmac_f32 (float_in, float_in + FRAMES, out.f, BINS),
+        wys_kernel_cmac_f32_ref (float_in, float_in + FRAMES, ref_out.f, BINS))
+KERNEL (cmac_conj_f32,
+        wys_kernel_cmac_conj_f32 (float_in, float_in + FRAMES, out.f, BINS),
+        wys_kernel_cmac_conj_f32_ref (float_in, float_in + FRAMES, ref_out.f, BINS))
+// Starts from the input each time, as the butterflies work in place
+KERNEL (butterfly_f32,
+        reset_butterflies (out.f);
+        wys_kernel_butterfly_f32 (out.f, out.f + FRAMES, float_in, BUTTERFLIES),
+        reset_butterflies (ref_out.f);
+        wys_kernel_butterfly_f32_ref (ref_out.f, ref_out.f + FRAMES, float_in,
+                                      BUTTERFLIES))
+
+#undef KERNEL
+
+static const struct kernel KERNELS[] =
+  {
+#define KERNEL(name) { #name, run_##name, run_##name##_ref, 0 }
+#define FLOAT_KERNEL(name) { #name, run_##name, run_##name##_ref, 1e-4f }
+    KERNEL (s32_to_s16),
+    KERNEL (s16_to_s32),
+    KERNEL (float_to_s16),
+    KERNEL (s16_to_float),
+    KERNEL (downmix_s16),
+    KERNEL (upmix_s16),
+    KERNEL (dot_s16),
+    FLOAT_KERNEL (cmac_f32),
+    FLOAT_KERNEL (cmac_conj_f32),
+    FLOAT_KERNEL (butterfly_f32),
+#undef FLOAT_KERNEL
+#undef KERNEL
+  };
+
+
+/** Whether the float output is close enough to the reference's,
+ * given that the SIMD versions add up in a different order */
+static gboolean
+floats_match (gfloat tolerance)
+{
+  guint i;
+
+  for (i = 0; i < SAMPLES; ++i)
+    {
+      if (fabsf (out.f[i] - ref_out.f[i])
+          > tolerance * MAX (1.0f, fabsf (ref_out.f[i])))
+        {
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+
+static void
+bench_kernel (const struct kernel *kernel)
+{
+  gdouble ns, ref_ns;
+  gboolean match;
+
+  memset (&out, 0, sizeof (out));
+  memset (&ref_out, 0, sizeof (ref_out));
+
+  ns = time_kernel (kernel->run, NULL, ITERATIONS);
+  ref_ns = time_kernel (kernel->run_ref, NULL, ITERATIONS);
+  if (kernel->tolerance > 0)
+    {
+      match = floats_match (kernel->tolerance);
+    }
+  else
+    {
+      match = memcmp (&out, &ref_out, sizeof (out)) == 0;
+    }
+  all_match = all_match && match;
+
+  printf ("{\"benchmark\": \"kernel\", \"kernel\": \"%s\", \"isa\": \"%s\","
+          " \"ns\": %.1f, \"ref_ns\": %.1f, \"matches_ref\": %s}\n",
+          kernel->name, wys_kernel_isa (), ns, ref_ns,
+          match ? "true" : "false");
+}
+
+
+static void
+run_polyphase (gpointer data)
+{
+  static gint16 wide[FRAMES];
+
+  // 8 kHz to 48 kHz and back, a period at a time
+  wys_polyphase_process (((WysPolyphase **)data)[0],
+                         s16_in, FRAMES / 6, wide);
+  wys_polyphase_process (((WysPolyphase **)data)[1],
+                         wide, FRAMES, out.s16);
+}
+
+
+static void
+bench_polyphase (void)
+{
+  WysPolyphase *filters[2];
+
+  filters[0] = wys_polyphase_new (6, 1);
+  filters[1] = wys_polyphase_new (1, 6);
+
+  printf ("{\"benchmark\": \"kernel\", \"kernel\": \"polyphase_8k_48k_8k\","
+          " \"isa\": \"%s\", \"ns\": %.1f}\n",
+          wys_kernel_isa (), time_kernel (run_polyphase, filters, ITERATIONS));
+
+  wys_polyphase_free (filters[1]);
+  wys_polyphase_free (filters[0]);
+}
+
+
+static void
+run_echo (gpointer data)
+{
+  static gint64 timeline;
+
+  // A period of far-end audio, then cancelling its echo from a
+  // period of microphone audio
+  wys_echo_write_reference (data, timeline, s16_in, FRAMES);
+  memcpy (out.s16, s16_in + FRAMES, FRAMES * sizeof (gint16));
+  wys_echo_cancel (data, timeline, out.s16, FRAMES);
+  timeline += FRAMES;
+}
+
+
+static void
+bench_echo (guint tail_ms)
+{
+  WysEcho *echo;
+  gdouble ns;
+
+  echo = wys_echo_new (48000, tail_ms);
+  ns = time_kernel (run_echo, echo, ECHO_ITERATIONS);
+
+  printf ("{\"benchmark\": \"kernel\", \"kernel\": \"echo_%ums\","
+          " \"isa\": \"%s\", \"ns\": %.1f, \"period_us\": %u,"
+          " \"load\": %.4f}\n",
+          tail_ms, wys_kernel_isa (), ns, PERIOD_US,
+          ns / 1000 / PERIOD_US);
+
+  wys_echo_free (echo);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  guint i;
+
+  fill_input ();
+
+  for (i = 0; i < G_N_ELEMENTS (KERNELS); ++i)
+    {
+      bench_kernel (&KERNELS[i]);
+    }
+  bench_polyphase ();
+  // The cost of cancelling a period's echo, for each tail length
+  bench_echo (32);
+  bench_echo (64);
+  bench_echo (128);
+
+  return all_match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
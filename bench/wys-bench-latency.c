@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+/*
+ * Measures the call audio path on snd-aloop.  Substream 0 of the
+ * loopback card's device 1 stands in for the modem and substream 1
+ * for the codec; wys loops the first to the second as it would
+ * audio from the network.  The benchmark plays into the other end
+ * of the fake modem and listens on the other end of the fake codec,
+ * with both streams linked so that their positions share a clock.
+ *
+ * Two numbers are reported, as one JSON object on stdout:
+ *
+ *   setup_us    from wys_audio_ensure_loopback() to the first sample
+ *               of a test tone arriving
+ *   latency_us  the delay of short impulses once running
+ */
+
+#include "wys-audio.h"
+#include "wys-engine.h"
+#include "enum-types.h"
+
+#include <alsa/asoundlib.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOOPBACK_CARD    "Loopback"
+#define FAKE_MODEM       "hw:" LOOPBACK_CARD ",1,0"
+#define FAKE_CODEC       "hw:" LOOPBACK_CARD ",1,1"
+#define INJECT_PCM       "hw:" LOOPBACK_CARD ",0,0"
+#define LISTEN_PCM       "hw:" LOOPBACK_CARD ",0,1"
+
+#define RATE             48000
+#define PERIOD           240
+#define LATENCY_US       20000
+#define LEVEL            16000
+#define THRESHOLD        4000
+#define TONE_HALF_PERIOD 24
+#define IMPULSE_LEN      8
+#define IMPULSE_SPACING  (RATE / 4)
+#define SETUP_TIMEOUT    (30 * RATE)
+#define SETTLE_FRAMES    (RATE / 2)
+
+/* meson treats this as a skipped test */
+#define EXIT_SKIP        77
+
+#define FRAMES_TO_US(f)  ((gdouble)(f) * G_USEC_PER_SEC / RATE)
+
+typedef enum
+{
+  SIGNAL_SILENCE,
+  SIGNAL_TONE,
+  SIGNAL_IMPULSES,
+} Signal;
+
+struct bench
+{
+  snd_pcm_t *inject;
+  snd_pcm_t *listen;
+  /** Frames played and captured so far */
+  guint64 inject_pos;
+  guint64 listen_pos;
+  /** What is being played */
+  Signal signal;
+  guint64 impulse_base;
+  /** When the last period was captured */
+  gint64 read_time;
+  gint16 buf[PERIOD];
+};
+
+
+static gboolean
+have_loopback_card (void)
+{
+  static const gchar *PROC_CARD = "/proc/asound/" LOOPBACK_CARD;
+
+  if (g_file_test (PROC_CARD, G_FILE_TEST_EXISTS))
+    {
+      return TRUE;
+    }
+
+  // Only works as root but worth a go
+  g_spawn_command_line_sync ("modprobe snd-aloop",
+                             NULL, NULL, NULL, NULL);
+
+  return g_file_test (PROC_CARD, G_FILE_TEST_EXISTS);
+}
+
+
+static snd_pcm_t *
+open_pcm (const gchar      *name,
+          snd_pcm_stream_t  stream)
+{
+  snd_pcm_t *pcm;
+  int err;
+
+  err = snd_pcm_open (&pcm, name, stream, 0);
+  if (err >= 0)
+    {
+      err = snd_pcm_set_params (pcm, SND_PCM_FORMAT_S16_LE,
+                                SND_PCM_ACCESS_RW_INTERLEAVED,
+                                1, RATE, 0, LATENCY_US);
+      if (err < 0)
+        {
+          snd_pcm_close (pcm);
+        }
+    }
+
+  if (err < 0)
+    {
+      g_printerr ("Error opening `%s': %s\n", name, snd_strerror (err));
+      return NULL;
+    }
+
+  return pcm;
+}
+
+
+static gint16
+signal_at (struct bench *self,
+           guint64       pos)
+{
+  switch (self->signal)
+    {
+    case SIGNAL_TONE:
+      return (pos / TONE_HALF_PERIOD) % 2 ? LEVEL : -LEVEL;
+    case SIGNAL_IMPULSES:
+      if (pos >= self->impulse_base
+          && (pos - self->impulse_base) % IMPULSE_SPACING < IMPULSE_LEN)
+        {
+          return LEVEL;
+        }
+      return 0;
+    default:
+      return 0;
+    }
+}
+
+
+/** Capture one period then play one.  Returns the capture position of
+ * the first sample above the threshold in the captured period, or
+ * -1. */
+static gint64
+step (struct bench *self)
+{
+  snd_pcm_sframes_t frames;
+  gint64 found = -1;
+  guint i;
+
+  frames = snd_pcm_readi (self->listen, self->buf, PERIOD);
+  if (frames < 0)
+    {
+      g_printerr ("Error capturing: %s\n", snd_strerror ((int)frames));
+      exit (EXIT_FAILURE);
+    }
+  self->read_time = g_get_monotonic_time ();
+
+  for (i = 0; i < frames; ++i)
+    {
+      if (ABS (self->buf[i]) >= THRESHOLD)
+        {
+          found = self->listen_pos + i;
+          break;
+        }
+    }
+  self->listen_pos += frames;
+
+  for (i = 0; i < PERIOD; ++i)
+    {
+      self->buf[i] = signal_at (self, self->inject_pos + i);
+    }
+
+  frames = snd_pcm_writei (self->inject, self->buf, PERIOD);
+  if (frames < 0)
+    {
+      g_printerr ("Error playing: %s\n", snd_strerror ((int)frames));
+      exit (EXIT_FAILURE);
+    }
+  self->inject_pos += frames;
+
+  return found;
+}
+
+
+static gboolean
+start (struct bench *self)
+{
+  snd_pcm_uframes_t buffer_size, period_size;
+  int err;
+
+  self->inject = open_pcm (INJECT_PCM, SND_PCM_STREAM_PLAYBACK);
+  self->listen = open_pcm (LISTEN_PCM, SND_PCM_STREAM_CAPTURE);
+  if (!self->inject || !self->listen)
+    {
+      return FALSE;
+    }
+
+  // Same card, so both streams can start on the same frame
+  err = snd_pcm_link (self->inject, self->listen);
+  if (err < 0)
+    {
+      g_printerr ("Error linking streams: %s\n", snd_strerror (err));
+      return FALSE;
+    }
+
+  // Filling the playback buffer starts both streams
+  snd_pcm_get_params (self->inject, &buffer_size, &period_size);
+  memset (self->buf, 0, sizeof (self->buf));
+  while (self->inject_pos < buffer_size)
+    {
+      snd_pcm_sframes_t frames =
+        snd_pcm_writei (self->inject, self->buf, PERIOD);
+      if (frames < 0)
+        {
+          g_printerr ("Error priming: %s\n", snd_strerror ((int)frames));
+          return FALSE;
+        }
+      self->inject_pos += frames;
+    }
+
+  return TRUE;
+}
+
+
+static gint64
+measure_setup (struct bench *self,
+               WysAudio     *audio)
+{
+  const guint64 timeout = self->listen_pos + SETUP_TIMEOUT;
+  gint64 start_time, found;
+
+  self->signal = SIGNAL_TONE;
+
+  start_time = g_get_monotonic_time ();
+  wys_audio_ensure_loopback (audio, WYS_DIRECTION_FROM_NETWORK);
+
+  while (self->listen_pos < timeout)
+    {
+      found = step (self);
+      if (found >= 0)
+        {
+          return self->read_time - start_time
+            - (gint64)FRAMES_TO_US (self->listen_pos - found);
+        }
+    }
+
+  return -1;
+}
+
+
+static guint
+measure_latency (struct bench *self,
+                 guint         n_impulses,
+                 gdouble      *min,
+                 gdouble      *mean,
+                 gdouble      *max)
+{
+  guint64 end, impulse, last_impulse = G_MAXUINT64;
+  gdouble latency, sum = 0.0;
+  gint64 found;
+  guint count = 0;
+
+  // Let the tone drain away
+  self->signal = SIGNAL_SILENCE;
+  end = self->inject_pos + SETTLE_FRAMES;
+  while (self->inject_pos < end)
+    {
+      step (self);
+    }
+
+  self->signal = SIGNAL_IMPULSES;
+  self->impulse_base = self->inject_pos + PERIOD;
+  end = self->impulse_base + (guint64)(n_impulses + 1) * IMPULSE_SPACING;
+
+  *min = G_MAXDOUBLE;
+  *max = 0.0;
+
+  while (self->listen_pos < end && count < n_impulses)
+    {
+      found = step (self);
+      if (found < 0 || (guint64)found < self->impulse_base)
+        {
+          continue;
+        }
+
+      // Latency is well below the spacing, so this is the impulse
+      impulse = ((guint64)found - self->impulse_base) / IMPULSE_SPACING;
+      if (impulse == last_impulse)
+        {
+          continue;
+        }
+      last_impulse = impulse;
+
+      latency = FRAMES_TO_US ((guint64)found - self->impulse_base
+                              - impulse * IMPULSE_SPACING);
+      *min = MIN (*min, latency);
+      *max = MAX (*max, latency);
+      sum += latency;
+      ++count;
+    }
+
+  *mean = count > 0 ? sum / count : 0.0;
+  return count;
+}
+
+
+static WysAudioBackend
+parse_backend (const gchar *name)
+{
+  GEnumClass *klass;
+  GEnumValue *value;
+
+  klass = g_type_class_ref (WYS_TYPE_AUDIO_BACKEND);
+  value = g_enum_get_value_by_nick (klass, name);
+  if (!value)
+    {
+      g_printerr ("Unknown backend `%s'\n", name);
+      exit (EXIT_FAILURE);
+    }
+  g_type_class_unref (klass);
+
+  return value->value;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  g_autofree gchar *backend = NULL;
+  g_autofree gchar *cache_dir = NULL;
+  g_autofree gchar *cache_file = NULL;
+  gint n_impulses = 20;
+  gboolean use_engine = FALSE;
+  WysEngine *engine = NULL;
+  struct bench self = { 0 };
+  WysAudio *audio;
+  gint64 setup;
+  gdouble min, mean, max;
+  guint count;
+
+  GOptionEntry options[] =
+    {
+      { "backend", 'b', 0, G_OPTION_ARG_STRING, &backend, "The backend to measure", "BACKEND" },
+      { "impulses", 'n', 0, G_OPTION_ARG_INT, &n_impulses, "How many impulses to measure the latency with", "COUNT" },
+      { "engine", 'e', 0, G_OPTION_ARG_NONE, &use_engine, "Move the native backend's audio in a shared engine thread", NULL },
+      { NULL }
+    };
+
+  context = g_option_context_new ("- measure call audio latency on snd-aloop");
+  g_option_context_add_main_entries (context, options, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("Error parsing options: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free (context);
+
+  if (!have_loopback_card ())
+    {
+      g_printerr ("No snd-aloop card, skipping\n");
+      return EXIT_SKIP;
+    }
+
+  // Don't read or pollute the real PCM cache
+  cache_dir = g_dir_make_tmp ("wys-bench-XXXXXX", NULL);
+  g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+
+  if (!start (&self))
+    {
+      return EXIT_FAILURE;
+    }
+
+  audio = wys_audio_new (FAKE_CODEC, FAKE_MODEM,
+                         parse_backend (backend ? backend : "native"));
+  if (use_engine)
+    {
+      engine = wys_engine_new ();
+      g_object_set (audio, "engine", engine, NULL);
+    }
+
+  setup = measure_setup (&self, audio);
+  if (setup < 0)
+    {
+      g_printerr ("No audio came through\n");
+      return EXIT_FAILURE;
+    }
+
+  count = measure_latency (&self, n_impulses, &min, &mean, &max);
+
+  printf ("{\"benchmark\": \"latency\", \"backend\": \"%s\", \"engine\": %s,"
+          " \"setup_us\": %" G_GINT64_FORMAT ","
+          " \"latency_us\": {\"min\": %.0f, \"mean\": %.0f, \"max\": %.0f},"
+          " \"impulses\": %u,"
+          " \"drift_ppm\": %.1f}\n",
+          backend ? backend : "native", use_engine ? "true" : "false", setup,
+          min, mean, max, count,
+          wys_audio_get_drift_ppm (audio, WYS_DIRECTION_FROM_NETWORK));
+
+  wys_audio_ensure_no_loopback (audio, WYS_DIRECTION_FROM_NETWORK);
+  g_object_unref (audio);
+  g_clear_pointer (&engine, wys_engine_free);
+
+  snd_pcm_close (self.listen);
+  snd_pcm_close (self.inject);
+
+  cache_file = g_build_filename (cache_dir, "wys", "pcm-cache", NULL);
+  g_remove (cache_file);
+  g_clear_pointer (&cache_file, g_free);
+  cache_file = g_build_filename (cache_dir, "wys", NULL);
+  g_rmdir (cache_file);
+  g_rmdir (cache_dir);
+
+  return count == (guint)n_impulses ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+/*
+ * Passes numbered frames through a WysRing from one thread to
+ * another, in batches of varying size, and checks that every one
+ * arrives once and in order.  Prints the throughput as one JSON
+ * object on stdout.
+ */
+
+#include "wys-ring.h"
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/** Room for 20 ms of 48 kHz audio, as between two loop threads */
+#define RING_FRAMES  960
+#define TOTAL_FRAMES (1 << 24)
+/** Batches are up to a 10 ms period, plus a bit to wrap unevenly */
+#define MAX_BATCH    487
+
+
+static WysRing *ring;
+
+
+static gpointer
+produce (gpointer data)
+{
+  GRand *rand = g_rand_new_with_seed (1);
+  guint32 batch[MAX_BATCH];
+  guint32 next = 0;
+  gsize n, written, i;
+
+  while (next < TOTAL_FRAMES)
+    {
+      n = MIN (g_rand_int_range (rand, 1, MAX_BATCH + 1),
+               TOTAL_FRAMES - next);
+      for (i = 0; i < n; ++i)
+        {
+          batch[i] = next + i;
+        }
+
+      for (written = 0; written < n; )
+        {
+          // The consumer may need the CPU to make room
+          if (wys_ring_get_space (ring) == 0)
+            {
+              g_thread_yield ();
+            }
+          written += wys_ring_write (ring, batch + written, n - written);
+        }
+      next += n;
+    }
+
+  g_rand_free (rand);
+  return NULL;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  GRand *rand = g_rand_new_with_seed (2);
+  guint32 batch[MAX_BATCH];
+  guint32 expected = 0;
+  gboolean in_order = TRUE;
+  GThread *producer;
+  gsize n, i;
+  gint64 start, elapsed;
+
+  ring = wys_ring_new (sizeof (guint32), RING_FRAMES);
+
+  start = g_get_monotonic_time ();
+  producer = g_thread_new ("producer", produce, NULL);
+
+  while (expected < TOTAL_FRAMES)
+    {
+      n = wys_ring_read (ring, batch,
+                         g_rand_int_range (rand, 1, MAX_BATCH + 1));
+      for (i = 0; i < n; ++i)
+        {
+          in_order = in_order && batch[i] == expected + i;
+        }
+      expected += n;
+      if (n == 0)
+        {
+          g_thread_yield ();
+        }
+    }
+
+  g_thread_join (producer);
+  elapsed = g_get_monotonic_time () - start;
+
+  printf ("{\"benchmark\": \"ring\", \"frames\": %u,"
+          " \"frames_per_s\": %.0f, \"in_order\": %s}\n",
+          TOTAL_FRAMES, TOTAL_FRAMES * (gdouble)G_USEC_PER_SEC / elapsed,
+          in_order ? "true" : "false");
+
+  in_order = in_order && wys_ring_get_fill (ring) == 0;
+  wys_ring_free (ring);
+  g_rand_free (rand);
+
+  return in_order ? EXIT_SUCCESS : EXIT_FAILURE;
+}
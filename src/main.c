@@ -24,6 +24,11 @@
 
 #include "wys-modem.h"
 #include "wys-audio.h"
+#include "wys-engine.h"
+#include "wys-rt.h"
+#include "wys-machine-conf.h"
+#include "wys-trace.h"
+#include "enum-types.h"
 #include "util.h"
 #include "config.h"
 #include "mchk-machine-check.h"
@@ -32,6 +37,7 @@
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <gio/gunixinputstream.h>
 
 #include <stdio.h>
@@ -42,6 +48,10 @@
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #define TTY_CHUNK_SIZE   320
 #define SAMPLE_LEN       2
@@ -50,60 +60,729 @@ static GMainLoop *main_loop = NULL;
 
 struct wys_data
 {
-  /** PulseAudio interface */
-  WysAudio *audio;
+  /** Moves the native backend's audio for every route, if
+   * configured or there is more than one */
+  WysEngine *engine;
+  /** Whether the "engine" key asks for one */
+  gboolean engine_configured;
   /** ID for the D-Bus watch */
   guint watch_id;
   /** ModemManager object proxy */
   MMManager *mm;
   /** Map of D-Bus object paths to WysModems */
   GHashTable *modems;
-  /** How many modems have audio, in each direction */
+  /** Map of modem ALSA card names to their routes */
+  GHashTable *routes;
+  /** "PATTERN CARD" lines mapping modems' sysfs devices to their
+   * ALSA cards */
+  gchar **modem_cards;
+  /** How long to keep a loopback after its audio goes, in
+   * milliseconds, in case it comes straight back */
+  guint teardown_grace;
+  /** How many times audio came back within the grace period */
+  guint teardowns_avoided;
+  /** Source ID for the SIGUSR1 handler */
+  guint stats_signal_id;
+  /** What the audio objects are for, kept to create them on demand;
+   * the modem card is for modems with no other */
+  const gchar *machine;
+  const gchar *codec;
+  const gchar *modem;
+  WysAudioBackend backend;
+  /** How long to keep a route's audio object while it has no calls,
+   * in seconds, or 0 to keep it for good */
+  guint idle_timeout;
+  /** How many routes have, or have just had, a call */
+  guint busy_routes;
+  /** Monotonic time the last call went, or 0 during a call */
+  gint64 idle_since;
+  /** How many times the main thread had slept by then */
+  guint64 idle_switches;
+  /** The resident set size before any audio object was created, in
+   * kB, the baseline for the always-on configuration's cost */
+  guint64 baseline_rss;
+};
+
+
+/** The audio for the modems sharing one ALSA card */
+struct route
+{
+  struct wys_data *data;
+  /** The modems' ALSA card */
+  gchar *card;
+  /** Loops the card's call audio.  With an idle timeout, NULL until
+   * a call needs it and again once dropped. */
+  WysAudio *audio;
+  /** How many of the modems have audio, in each direction */
   guint audio_count[2];
+  /** How many of the modems are likely to have audio soon */
+  guint prepare_count;
+  /** How many of the modems have a call with audio that isn't on
+   * hold */
+  guint audible_count;
+  /** Source IDs for loopbacks waiting out the grace period, in each
+   * direction */
+  guint teardown_id[2];
+  /** Source ID for dropping the audio object */
+  guint idle_id;
+  /** Whether the route has, or has just had, a call */
+  gboolean busy;
+  /** The resident set size just before the audio object was last
+   * created, in kB */
+  guint64 unloaded_rss;
 };
 
 
+/** Look up machine configuration lines, falling back to the
+ * default entries */
+static gchar **
+machine_conf_lines (const gchar *machine,
+                    const gchar *key)
+{
+  gchar **lines = NULL;
+
+  if (machine)
+    {
+      lines = wys_machine_conf_lines (machine, key);
+    }
+
+  if (!lines)
+    {
+      lines = wys_machine_conf_lines (WYS_MACHINE_CONF_DEFAULT, key);
+    }
+
+  return lines;
+}
+
+
+/** Look up a number in the machine configuration, falling back to
+ * the default entries.  Returns 0 if not set. */
+static guint
+machine_conf_uint (const gchar *machine,
+                 const gchar *key)
+{
+  g_auto(GStrv) lines = NULL;
+  guint64 value;
+  gchar *end;
+
+  lines = machine_conf_lines (machine, key);
+  if (!lines)
+    {
+      return 0;
+    }
+
+  value = g_ascii_strtoull (lines[0], &end, 10);
+  if (*end != '\0' || value > G_MAXUINT)
+    {
+      g_warning ("Invalid %s `%s', ignoring", key, lines[0]);
+      return 0;
+    }
+
+  return (guint)value;
+}
+
+
+/** Create the audio object, configured for the machine */
+static WysAudio *
+new_audio (const gchar *machine,
+           const gchar *codec,
+           const gchar *modem,
+           WysAudioBackend backend)
+{
+  WysAudio *audio;
+  g_auto(GStrv) capture_pcms = NULL;
+  g_auto(GStrv) playback_pcms = NULL;
+  g_auto(GStrv) dsp_from_network = NULL;
+  g_auto(GStrv) dsp_to_network = NULL;
+
+  audio = wys_audio_new (codec, modem, backend);
+
+  capture_pcms = machine_conf_lines (machine, "capture-pcms");
+  playback_pcms = machine_conf_lines (machine, "playback-pcms");
+  dsp_from_network = machine_conf_lines (machine, "dsp-from-network");
+  dsp_to_network = machine_conf_lines (machine, "dsp-to-network");
+  g_object_set (audio,
+                "capture-pcms", capture_pcms,
+                "playback-pcms", playback_pcms,
+                "min-latency", machine_conf_uint (machine, "min-latency"),
+                "max-latency", machine_conf_uint (machine, "max-latency"),
+                "period-time", machine_conf_uint (machine, "period-time"),
+                "timer-scheduling",
+                machine_conf_uint (machine, "timer-scheduling") != 0,
+                "dsp-from-network", dsp_from_network,
+                "dsp-to-network", dsp_to_network,
+                "echo-tail", machine_conf_uint (machine, "echo-tail"),
+                NULL);
+
+  return audio;
+}
+
+
+/** Read a number from a line of /proc/self/status, such as the
+ * resident set size in kB; 0 if it can't be read */
+static guint64
+read_status (const gchar *field)
+{
+  g_autofree gchar *contents = NULL;
+  const gsize len = strlen (field);
+  const gchar *line;
+
+  if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+    {
+      return 0;
+    }
+
+  for (line = contents; line; line = strchr (line, '\n'))
+    {
+      if (*line == '\n')
+        {
+          ++line;
+        }
+      if (strncmp (line, field, len) == 0 && line[len] == ':')
+        {
+          return g_ascii_strtoull (line + len + 1, NULL, 10);
+        }
+    }
+
+  return 0;
+}
+
+
+/** Have the native backend's loops for an audio object share the
+ * engine, when configured or there's more than one modem card, so
+ * that each extra line doesn't cost a thread per direction */
 static void
-update_audio_count (struct wys_data *data,
-                    WysDirection     direction,
-                    gint             delta)
+share_engine (struct wys_data *data,
+              WysAudio        *audio)
+{
+  if (data->backend != WYS_AUDIO_BACKEND_NATIVE
+      || !(data->engine_configured || g_hash_table_size (data->routes) > 1))
+    {
+      return;
+    }
+
+  if (!data->engine)
+    {
+      data->engine = wys_engine_new ();
+    }
+  if (data->engine)
+    {
+      g_object_set (audio, "engine", data->engine, NULL);
+    }
+}
+
+
+/** Create the route's audio object, and the engine if wanted, unless
+ * they're already there */
+static WysAudio *
+get_audio (struct route *route)
 {
-  const guint old_count = data->audio_count[direction];
+  struct wys_data *data = route->data;
+
+  if (route->audio)
+    {
+      return route->audio;
+    }
 
-  g_assert (delta >= 0 || data->audio_count[direction] > 0);
+  route->unloaded_rss = read_status ("VmRSS");
+  route->audio = new_audio (data->machine, data->codec, route->card,
+                            data->backend);
+  share_engine (data, route->audio);
+  g_message ("Loaded audio for modem card `%s': %" G_GUINT64_FORMAT
+             " kB resident, %" G_GUINT64_FORMAT " kB before",
+             route->card, read_status ("VmRSS"), route->unloaded_rss);
 
-  data->audio_count[direction] += delta;
+  if (data->idle_timeout > 0)
+    {
+      // As it would be by now had it been kept
+      wys_audio_set_muted (route->audio, route->audible_count == 0);
+    }
 
-  if (data->audio_count[direction] > 0 && old_count == 0)
+  return route->audio;
+}
+
+
+static gboolean
+drop_audio_cb (struct route *route)
+{
+  struct wys_data *data = route->data;
+  const guint64 rss = read_status ("VmRSS");
+  GHashTableIter iter;
+  struct route *other;
+  gboolean loaded = FALSE;
+
+  route->idle_id = 0;
+  g_clear_object (&route->audio);
+
+  g_hash_table_iter_init (&iter, data->routes);
+  while (!loaded && g_hash_table_iter_next (&iter, NULL, (gpointer *)&other))
     {
-      g_debug ("Audio %s now present",
-               wys_direction_get_description (direction));
-      wys_audio_ensure_loopback (data->audio, direction);
+      loaded = (other->audio != NULL);
     }
-  else if (data->audio_count[direction] == 0 && old_count > 0)
+  if (!loaded)
     {
-      g_debug ("Audio %s now absent",
-               wys_direction_get_description (direction));
-      wys_audio_ensure_no_loopback (data->audio, direction);
+      g_clear_pointer (&data->engine, wys_engine_free);
+      wys_rt_unlock_memory ();
     }
+#ifdef __GLIBC__
+  // Hand the freed buffers back rather than keeping them resident
+  malloc_trim (0);
+#endif
+
+  g_message ("No calls on modem card `%s' for %u s, dropped audio: %"
+             G_GUINT64_FORMAT " kB resident, %" G_GUINT64_FORMAT
+             " kB with it loaded, %" G_GUINT64_FORMAT
+             " kB before it was loaded",
+             route->card, data->idle_timeout, read_status ("VmRSS"), rss,
+             route->unloaded_rss);
+  return G_SOURCE_REMOVE;
 }
 
 
+/** Note the start or end of a spell without calls on the route, and
+ * on all of them, and with on-demand audio, drop the route's audio
+ * object if it lasts long enough */
 static void
-audio_present_cb (struct wys_data *data,
-                  WysDirection     direction,
-                  WysModem        *modem)
+update_idle (struct route *route)
 {
-  update_audio_count (data, direction, +1);
+  struct wys_data *data = route->data;
+  const gboolean idle =
+    route->prepare_count == 0
+    && route->audio_count[WYS_DIRECTION_FROM_NETWORK] == 0
+    && route->audio_count[WYS_DIRECTION_TO_NETWORK] == 0
+    && route->teardown_id[WYS_DIRECTION_FROM_NETWORK] == 0
+    && route->teardown_id[WYS_DIRECTION_TO_NETWORK] == 0;
+
+  if (!idle)
+    {
+      if (!route->busy)
+        {
+          route->busy = TRUE;
+          if (data->busy_routes++ == 0)
+            {
+              data->idle_since = 0;
+            }
+        }
+      if (route->idle_id)
+        {
+          g_source_remove (route->idle_id);
+          route->idle_id = 0;
+        }
+      return;
+    }
+
+  if (route->busy)
+    {
+      route->busy = FALSE;
+      if (--data->busy_routes == 0)
+        {
+          data->idle_since = g_get_monotonic_time ();
+          data->idle_switches = read_status ("voluntary_ctxt_switches");
+        }
+    }
+
+  if (data->idle_timeout > 0 && route->audio && !route->idle_id)
+    {
+      route->idle_id =
+        g_timeout_add_seconds (data->idle_timeout,
+                               (GSourceFunc)drop_audio_cb, route);
+    }
 }
 
 
+/** Log the resident set size and, between calls, how often the main
+ * thread has woken up since the last one, to compare on-demand audio
+ * with keeping it */
 static void
-audio_absent_cb (struct wys_data *data,
-                 WysDirection     direction,
-                 WysModem        *modem)
+log_footprint (struct wys_data *data)
 {
-  update_audio_count (data, direction, -1);
+  const guint64 rss = read_status ("VmRSS");
+  GHashTableIter iter;
+  struct route *route;
+  guint loaded = 0;
+  gint64 idle;
+  guint64 switches;
+
+  if (data->idle_since == 0)
+    {
+      g_message ("%u lines in calls, %" G_GUINT64_FORMAT
+                 " kB resident, %" G_GUINT64_FORMAT
+                 " kB before any audio was loaded",
+                 data->busy_routes, rss, data->baseline_rss);
+      return;
+    }
+
+  g_hash_table_iter_init (&iter, data->routes);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&route))
+    {
+      loaded += (route->audio != NULL);
+    }
+
+  idle = MAX (g_get_monotonic_time () - data->idle_since, 1);
+  switches = read_status ("voluntary_ctxt_switches") - data->idle_switches;
+  g_message ("No calls for %.0f s, audio loaded for %u of %u lines, %"
+             G_GUINT64_FORMAT " kB resident, %" G_GUINT64_FORMAT
+             " kB before any audio was loaded, %.3f main thread wakeups/s",
+             idle / (gdouble)G_USEC_PER_SEC, loaded,
+             g_hash_table_size (data->routes), rss, data->baseline_rss,
+             switches * (gdouble)G_USEC_PER_SEC / idle);
+}
+
+
+static void
+teardown (struct route *route,
+          WysDirection  direction)
+{
+  route->teardown_id[direction] = 0;
+  wys_audio_ensure_no_loopback (route->audio, direction);
+  update_idle (route);
+}
+
+
+static gboolean
+teardown_from_network_cb (struct route *route)
+{
+  teardown (route, WYS_DIRECTION_FROM_NETWORK);
+  return G_SOURCE_REMOVE;
+}
+
+
+static gboolean
+teardown_to_network_cb (struct route *route)
+{
+  teardown (route, WYS_DIRECTION_TO_NETWORK);
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+update_audio_count (struct route *route,
+                    WysDirection  direction,
+                    gint          delta)
+{
+  struct wys_data *data = route->data;
+  const guint old_count = route->audio_count[direction];
+
+  g_assert (delta >= 0 || route->audio_count[direction] > 0);
+
+  route->audio_count[direction] += delta;
+
+  if (route->audio_count[direction] > 0 && old_count == 0)
+    {
+      g_debug ("Audio %s now present on modem card `%s'",
+               wys_direction_get_description (direction), route->card);
+      if (route->teardown_id[direction])
+        {
+          // Still there from last time
+          g_source_remove (route->teardown_id[direction]);
+          route->teardown_id[direction] = 0;
+          ++data->teardowns_avoided;
+        }
+      else
+        {
+          wys_audio_ensure_loopback (get_audio (route), direction);
+        }
+    }
+  else if (route->audio_count[direction] == 0 && old_count > 0)
+    {
+      g_debug ("Audio %s now absent on modem card `%s'",
+               wys_direction_get_description (direction), route->card);
+      if (data->teardown_grace == 0)
+        {
+          wys_audio_ensure_no_loopback (route->audio, direction);
+        }
+      else
+        {
+          // A dropped call may well be redialled straight away
+          route->teardown_id[direction] =
+            g_timeout_add (data->teardown_grace,
+                           direction == WYS_DIRECTION_FROM_NETWORK
+                           ? (GSourceFunc)teardown_from_network_cb
+                           : (GSourceFunc)teardown_to_network_cb,
+                           route);
+        }
+    }
+
+  update_idle (route);
+}
+
+
+static void
+audio_present_cb (struct route *route,
+                  WysDirection  direction,
+                  WysModem     *modem)
+{
+  update_audio_count (route, direction, +1);
+}
+
+
+static void
+audio_absent_cb (struct route *route,
+                 WysDirection  direction,
+                 WysModem     *modem)
+{
+  update_audio_count (route, direction, -1);
+}
+
+
+static void
+update_audible_count (struct route *route,
+                      gint          delta)
+{
+  const guint old_count = route->audible_count;
+
+  g_assert (delta >= 0 || route->audible_count > 0);
+
+  route->audible_count += delta;
+
+  if (!route->audio)
+    {
+      // Set when it's loaded
+      return;
+    }
+
+  // Held calls keep their loops, silenced, so that taking one off
+  // hold is immediate
+  if (route->audible_count > 0 && old_count == 0)
+    {
+      wys_audio_set_muted (route->audio, FALSE);
+    }
+  else if (route->audible_count == 0 && old_count > 0)
+    {
+      wys_audio_set_muted (route->audio, TRUE);
+    }
+}
+
+
+static void
+audio_audible_cb (struct route *route,
+                  WysModem     *modem)
+{
+  update_audible_count (route, +1);
+}
+
+
+static void
+audio_inaudible_cb (struct route *route,
+                    WysModem     *modem)
+{
+  update_audible_count (route, -1);
+}
+
+
+static void
+update_prepare_count (struct route *route,
+                      gint          delta)
+{
+  const guint old_count = route->prepare_count;
+
+  g_assert (delta >= 0 || route->prepare_count > 0);
+
+  route->prepare_count += delta;
+
+  if (route->prepare_count > 0 && old_count == 0)
+    {
+      g_debug ("Audio on modem card `%s' now likely, preparing",
+               route->card);
+      wys_audio_prepare (get_audio (route));
+    }
+  else if (route->prepare_count == 0 && old_count > 0)
+    {
+      g_debug ("Audio on modem card `%s' now unlikely, unpreparing",
+               route->card);
+      wys_audio_unprepare (route->audio);
+    }
+
+  update_idle (route);
+}
+
+
+static void
+audio_prepare_cb (struct route *route,
+                  WysModem     *modem)
+{
+  update_prepare_count (route, +1);
+}
+
+
+static void
+audio_unprepare_cb (struct route *route,
+                    WysModem     *modem)
+{
+  update_prepare_count (route, -1);
+}
+
+
+static void
+free_route (struct route *route)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (route->teardown_id); ++i)
+    {
+      if (route->teardown_id[i])
+        {
+          g_source_remove (route->teardown_id[i]);
+        }
+    }
+  if (route->idle_id)
+    {
+      g_source_remove (route->idle_id);
+    }
+  g_clear_object (&route->audio);
+  g_free (route->card);
+  g_free (route);
+}
+
+
+/** Find or add the route for a modem card, loading its audio unless
+ * that's on demand */
+static struct route *
+get_route (struct wys_data *data,
+           const gchar     *card)
+{
+  struct route *route;
+
+  route = g_hash_table_lookup (data->routes, card);
+  if (route)
+    {
+      return route;
+    }
+
+  route = g_new0 (struct route, 1);
+  route->data = data;
+  route->card = g_strdup (card);
+  g_hash_table_insert (data->routes, route->card, route);
+
+  if (g_hash_table_size (data->routes) == 2)
+    {
+      GHashTableIter iter;
+      struct route *other;
+
+      // The first card's loops move to the engine when next made
+      g_hash_table_iter_init (&iter, data->routes);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&other))
+        {
+          if (other->audio)
+            {
+              share_engine (data, other->audio);
+            }
+        }
+    }
+
+  if (data->idle_timeout == 0)
+    {
+      get_audio (route);
+    }
+
+  return route;
+}
+
+
+/** Find the ALSA card whose device is, or is below, a sysfs device,
+ * such as a USB modem's audio interface */
+static gchar *
+find_device_card (const gchar *device)
+{
+  const gsize len = strlen (device);
+  GDir *dir;
+  const gchar *name;
+  gchar *card = NULL;
+
+  dir = g_dir_open ("/sys/class/sound", 0, NULL);
+  if (!dir)
+    {
+      return NULL;
+    }
+
+  while (!card && (name = g_dir_read_name (dir)))
+    {
+      g_autofree gchar *link = NULL;
+      g_autofree gchar *id = NULL;
+      gchar *real;
+      gboolean below;
+
+      if (!g_str_has_prefix (name, "card"))
+        {
+          continue;
+        }
+
+      link = g_build_filename ("/sys/class/sound", name, "device", NULL);
+      real = realpath (link, NULL);
+      below = real && strncmp (real, device, len) == 0
+        && (real[len] == '\0' || real[len] == '/');
+      free (real);
+      if (!below)
+        {
+          continue;
+        }
+
+      id = g_build_filename ("/sys/class/sound", name, "id", NULL);
+      if (g_file_get_contents (id, &card, NULL, NULL))
+        {
+          g_strstrip (card);
+        }
+    }
+
+  g_dir_close (dir);
+  return card;
+}
+
+
+/** Work out a modem's ALSA card from the first "modem-cards" line
+ * whose pattern matches its sysfs device.  The line gives the card's
+ * name, or "auto" to find the card below the device.  Modems with no
+ * line use the modem card given at start-up. */
+static gchar *
+get_modem_card (struct wys_data *data,
+                MMObject        *object)
+{
+  MMModem *mm_modem;
+  g_autofree gchar *device = NULL;
+  gchar **line;
+
+  mm_modem = mm_object_get_modem (object);
+  if (mm_modem)
+    {
+      device = mm_modem_dup_device (mm_modem);
+      g_object_unref (mm_modem);
+    }
+
+  for (line = data->modem_cards; device && line && *line; ++line)
+    {
+      g_autofree gchar *pattern = NULL;
+      g_autofree gchar *card = NULL;
+      const gchar *space;
+
+      space = strpbrk (*line, " \t");
+      if (!space)
+        {
+          g_warning ("Invalid modem-cards line `%s', ignoring", *line);
+          continue;
+        }
+      pattern = g_strndup (*line, space - *line);
+      if (!g_pattern_match_simple (pattern, device))
+        {
+          continue;
+        }
+
+      card = g_strstrip (g_strdup (space));
+      if (strcmp (card, "auto") != 0)
+        {
+          return g_steal_pointer (&card);
+        }
+
+      card = find_device_card (device);
+      if (card)
+        {
+          return g_steal_pointer (&card);
+        }
+
+      g_warning ("No ALSA card found for modem device `%s'", device);
+      break;
+    }
+
+  return g_strdup (data->modem);
 }
 
 
@@ -114,6 +793,8 @@ add_modem (struct wys_data *data,
   const gchar *path;
   MMModemVoice *voice;
   WysModem *modem;
+  g_autofree gchar *card = NULL;
+  struct route *route;
 
   path = g_dbus_object_get_object_path (object);
   if (g_hash_table_contains (data->modems, path))
@@ -135,12 +816,34 @@ add_modem (struct wys_data *data,
                        strdup (path),
                        modem);
 
+  card = get_modem_card (data, MM_OBJECT (object));
+  g_debug ("Routing modem `%s' through ALSA card `%s'", path, card);
+  route = get_route (data, card);
+
   g_signal_connect_swapped (modem, "audio-present",
                             G_CALLBACK (audio_present_cb),
-                            data);
+                            route);
   g_signal_connect_swapped (modem, "audio-absent",
                             G_CALLBACK (audio_absent_cb),
-                            data);
+                            route);
+  g_signal_connect_swapped (modem, "audio-audible",
+                            G_CALLBACK (audio_audible_cb),
+                            route);
+  g_signal_connect_swapped (modem, "audio-inaudible",
+                            G_CALLBACK (audio_inaudible_cb),
+                            route);
+  g_signal_connect_swapped (modem, "audio-prepare",
+                            G_CALLBACK (audio_prepare_cb),
+                            route);
+  g_signal_connect_swapped (modem, "audio-unprepare",
+                            G_CALLBACK (audio_unprepare_cb),
+                            route);
+
+  if (wys_trace_mark ("first voice modem"))
+    {
+      g_autofree gchar *trace = wys_trace_to_string ();
+      g_message ("Ready for calls\n%s", trace);
+    }
 }
 
 
@@ -262,7 +965,7 @@ mm_manager_new_cb (GDBusConnection *connection,
       wys_error ("Error creating ModemManager Manager: %s",
                  error->message);
     }
-
+  wys_trace_mark ("ModemManager manager");
 
   g_signal_connect_swapped (G_DBUS_OBJECT_MANAGER (data->mm),
                             "interface-added",
@@ -287,6 +990,7 @@ mm_appeared_cb (GDBusConnection *connection,
                 struct wys_data *data)
 {
   g_debug ("ModemManager appeared on D-Bus");
+  wys_trace_mark ("ModemManager appeared");
 
   mm_manager_new (connection,
                   G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_NONE,
@@ -315,16 +1019,67 @@ mm_vanished_cb (GDBusConnection *connection,
 }
 
 
+static gboolean
+stats_signal_cb (struct wys_data *data)
+{
+  g_autofree gchar *trace = wys_trace_to_string ();
+  GHashTableIter iter;
+  struct route *route;
+
+  g_message ("%s", trace);
+  log_footprint (data);
+  g_hash_table_iter_init (&iter, data->routes);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&route))
+    {
+      if (route->audio)
+        {
+          g_message ("Modem card `%s':", route->card);
+          wys_audio_log_stats (route->audio);
+        }
+    }
+  g_message ("Loopback kept for returning audio %u times",
+             data->teardowns_avoided);
+  return G_SOURCE_CONTINUE;
+}
+
+
 static void
 set_up (struct wys_data *data,
+        const gchar *machine,
         const gchar *codec,
-        const gchar *modem)
+        const gchar *modem,
+        WysAudioBackend backend)
 {
-  data->audio = wys_audio_new (codec, modem);
+  data->machine = machine;
+  data->codec = codec;
+  data->modem = modem;
+  data->backend = backend;
+
+  data->modem_cards = machine_conf_lines (machine, "modem-cards");
+  data->engine_configured = machine_conf_uint (machine, "engine") != 0;
+  data->routes = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                        (GDestroyNotify)free_route);
+  data->idle_since = g_get_monotonic_time ();
+  data->idle_switches = read_status ("voluntary_ctxt_switches");
+  data->baseline_rss = read_status ("VmRSS");
+
+  data->idle_timeout = machine_conf_uint (machine, "idle-timeout");
+  if (data->idle_timeout == 0)
+    {
+      // Most modems use the card given at start-up
+      get_route (data, modem);
+    }
+  wys_trace_mark ("audio set-up");
+
+  data->teardown_grace = machine_conf_uint (machine, "teardown-grace");
 
   data->modems = g_hash_table_new_full (g_str_hash, g_str_equal,
                                         g_free, g_object_unref);
 
+  // "kill -USR1" logs how call audio has been doing
+  data->stats_signal_id =
+    g_unix_signal_add (SIGUSR1, (GSourceFunc)stats_signal_cb, data);
+
   data->watch_id =
     g_bus_watch_name (G_BUS_TYPE_SYSTEM,
                       MM_DBUS_SERVICE,
@@ -333,6 +1088,7 @@ set_up (struct wys_data *data,
                       (GBusNameVanishedCallback)mm_vanished_cb,
                       data, NULL);
 
+  wys_trace_mark ("g_bus_watch_name");
   g_debug ("Watching for ModemManager");
 }
 
@@ -340,21 +1096,26 @@ set_up (struct wys_data *data,
 static void
 tear_down (struct wys_data *data)
 {
+  g_source_remove (data->stats_signal_id);
   clear_dbus (data);
   g_bus_unwatch_name (data->watch_id);
   g_hash_table_unref (data->modems);
-  g_object_unref (G_OBJECT (data->audio));
+  g_hash_table_unref (data->routes);
+  g_strfreev (data->modem_cards);
+  g_clear_pointer (&data->engine, wys_engine_free);
 }
 
 
 static void
-run (const gchar *codec,
-     const gchar *modem)
+run (const gchar *machine,
+     const gchar *codec,
+     const gchar *modem,
+     WysAudioBackend backend)
 {
   struct wys_data data;
 
   memset (&data, 0, sizeof (struct wys_data));
-  set_up (&data, codec, modem);
+  set_up (&data, machine, codec, modem, backend);
 
   main_loop = g_main_loop_new (NULL, FALSE);
 
@@ -369,16 +1130,140 @@ run (const gchar *codec,
 }
 
 
+/** Settings to try when tuning, from the most conservative down.  The
+ * queue bounds scale with the period since how late wakeups are
+ * tends to as well. */
+static const struct
+{
+  guint period_time;
+  guint min_latency;
+  guint max_latency;
+} TUNE_STEPS[] =
+  {
+    { 20000, 40000, 120000 },
+    { 10000, 20000,  60000 },
+    {  5000, 10000,  30000 },
+    {  4000,  8000,  24000 },
+    {  2000,  4000,  12000 },
+    {  1000,  2000,   6000 },
+  };
+
+/** How long each step must run without glitches */
+#define TUNE_SOAK_SECONDS 30
+
+
+static gboolean
+soak_done_cb (gpointer unused)
+{
+  g_main_loop_quit (main_loop);
+  return G_SOURCE_REMOVE;
+}
+
+
+/** Loop audio in both directions with the settings of @step for a
+ * while.  Returns whether it ran without glitches. */
+static gboolean
+soak (WysAudio *audio,
+      guint     step)
+{
+  const guint expected = TUNE_SOAK_SECONDS * G_USEC_PER_SEC
+    / TUNE_STEPS[step].period_time;
+  guint xruns, periods;
+
+  g_object_set (audio,
+                "period-time", TUNE_STEPS[step].period_time,
+                "min-latency", TUNE_STEPS[step].min_latency,
+                "max-latency", TUNE_STEPS[step].max_latency,
+                NULL);
+
+  wys_audio_prepare (audio);
+  wys_audio_ensure_loopback (audio, WYS_DIRECTION_FROM_NETWORK);
+  wys_audio_ensure_loopback (audio, WYS_DIRECTION_TO_NETWORK);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  g_timeout_add_seconds (TUNE_SOAK_SECONDS, soak_done_cb, NULL);
+  g_main_loop_run (main_loop);
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  xruns = wys_audio_get_xruns (audio, &periods);
+
+  wys_audio_ensure_no_loopback (audio, WYS_DIRECTION_FROM_NETWORK);
+  wys_audio_ensure_no_loopback (audio, WYS_DIRECTION_TO_NETWORK);
+  wys_audio_unprepare (audio);
+
+  printf ("Period %u us, latency %u-%u us: %u xruns in %u periods\n",
+          TUNE_STEPS[step].period_time, TUNE_STEPS[step].min_latency,
+          TUNE_STEPS[step].max_latency, xruns, periods);
+
+  // Audio which hardly flowed, say because a PCM couldn't be opened,
+  // doesn't count as running cleanly
+  return xruns == 0 && periods >= expected / 2;
+}
+
+
+static void
+save_tuned (const gchar *machine,
+            const gchar *key,
+            guint        value)
+{
+  g_autofree gchar *str = g_strdup_printf ("%u", value);
+  GError *error = NULL;
+
+  if (!wys_machine_conf_save (machine, key, str,
+                              "Written by " APPLICATION_NAME " --tune",
+                              &error))
+    {
+      g_warning ("Error saving %s: %s", key, error->message);
+      g_error_free (error);
+    }
+}
+
+
+/** Find the shortest period and queue bounds which loop audio
+ * between the codec and modem without glitches and save them in the
+ * user's machine configuration, where they take precedence over the
+ * system's */
+static void
+tune (const gchar *machine,
+      const gchar *codec,
+      const gchar *modem)
+{
+  g_autoptr(WysAudio) audio = NULL;
+  gint best = -1;
+  guint i;
+
+  // Only the native backend can tell us about glitches
+  audio = new_audio (machine, codec, modem, WYS_AUDIO_BACKEND_NATIVE);
+
+  for (i = 0; i < G_N_ELEMENTS (TUNE_STEPS) && soak (audio, i); ++i)
+    {
+      best = i;
+    }
+
+  if (best < 0)
+    {
+      g_warning ("Audio glitched with the most conservative settings"
+                 "; not saving any");
+      return;
+    }
+
+  save_tuned (machine, "period-time", TUNE_STEPS[best].period_time);
+  save_tuned (machine, "min-latency", TUNE_STEPS[best].min_latency);
+  save_tuned (machine, "max-latency", TUNE_STEPS[best].max_latency);
+
+  printf ("Saved period %u us, latency %u-%u us for `%s'\n",
+          TUNE_STEPS[best].period_time, TUNE_STEPS[best].min_latency,
+          TUNE_STEPS[best].max_latency, machine);
+}
+
+
 static void
 check_machine (const gchar *machine)
 {
   gboolean ok, passed;
   GError *error = NULL;
 
-  ok = mchk_check_machine (APP_DATA_NAME,
-                           machine,
-                           &passed,
-                           &error);
+  ok = wys_machine_conf_check (machine, &passed, &error);
   if (!ok)
     {
       g_warning ("Error checking machine name against"
@@ -423,138 +1308,41 @@ setup_signals ()
 
   atexit(terminate);
   try_setup (PIPE, SIG_IGN);
-  try_setup (CHLD, SIG_IGN);
 
 #undef try_setup
 }
 
 
-/** This function will close @fd */
-static gchar *
-read_machine_conf_file (const gchar *filename,
-                        int          fd)
+/** Fill in @value from, in order of precedence, the command line
+ * (an already set @value), the environment variable @var and the
+ * machine configuration file @key.  Returns whether @value is set.
+ */
+static gboolean
+lookup_setting (const gchar  *machine,
+                const gchar  *var,
+                const gchar  *key,
+                      gchar **value)
 {
-  GInputStream *unix_stream;
-  GDataInputStream *data_stream;
-  gboolean try_again;
-  gchar *line;
-  GError *error = NULL;
-
-  g_debug ("Reading machine configuration file `%s'", filename);
-
-  unix_stream = g_unix_input_stream_new (fd, TRUE);
-  g_assert (unix_stream != NULL);
-
-  data_stream = g_data_input_stream_new (unix_stream);
-  g_assert (data_stream != NULL);
-  g_object_unref (unix_stream);
+  const gchar *env;
 
-  do
+  if (*value)
     {
-      try_again = FALSE;
-
-      line = g_data_input_stream_read_line_utf8
-        (data_stream, NULL, NULL, &error);
-
-      if (error)
-        {
-          g_warning ("Error reading from machine"
-                     " configuration file `%s': %s",
-                     filename, error->message);
-          g_error_free (error);
-        }
-      else if (line)
-        {
-          g_strstrip (line);
-
-          // Skip comments and empty lines
-          if (line[0] == '#' || line[0] == '\0')
-            {
-              g_free (line);
-              try_again = TRUE;
-            }
-        }
+      return TRUE;
     }
-  while (try_again);
 
-  g_object_unref (data_stream);
-  return line;
-}
-
-
-static gchar *
-dir_machine_conf (const gchar *dir,
-                  const gchar *machine,
-                  const gchar *key)
-{
-  gchar *filename;
-  int fd;
-  gchar *value = NULL;
-
-  filename = g_build_filename (dir, APP_DATA_NAME,
-                               "machine-conf",
-                               machine, key, NULL);
-
-  g_debug ("Trying machine configuration file `%s'",
-           filename);
-
-  fd = g_open (filename, O_RDONLY, 0);
-  if (fd == -1)
-    {
-      if (errno != ENOENT)
-        {
-          // The error isn't that the file doesn't exist
-          g_warning ("Error opening machine"
-                     " configuration file `%s': %s",
-                     filename, g_strerror (errno));
-        }
-    }
-  else
-    {
-      value = read_machine_conf_file (filename, fd);
-    }
-
-  g_free (filename);
-  return value;
-}
-
-
-static gchar *
-machine_conf (const gchar *machine,
-              const gchar *key)
-{
-  gchar *value = NULL;
-  const gchar * const *dirs, * const *dir;
-
-
-#define try_dir(d)                                      \
-  value = dir_machine_conf (d, machine, key);           \
-  if (value)                                            \
-    {                                                   \
-      return value;                                     \
-    }
-
-
-  try_dir (g_get_user_config_dir ());
-
-  dirs = g_get_system_config_dirs ();
-  for (dir = dirs; *dir; ++dir)
+  env = g_getenv (var);
+  if (env)
     {
-      try_dir (*dir);
+      *value = g_strdup (env);
+      return TRUE;
     }
 
-  try_dir (SYSCONFDIR);
-  try_dir (DATADIR);
-
-  dirs = g_get_system_data_dirs ();
-  for (dir = dirs; *dir; ++dir)
+  if (machine)
     {
-      try_dir (*dir);
+      *value = wys_machine_conf (machine, key);
     }
 
-#undef try_dir
-
-  return NULL;
+  return *value != NULL;
 }
 
 
@@ -564,33 +1352,47 @@ ensure_alsa_card (const gchar  *machine,
                   const gchar  *key,
                         gchar **name)
 {
-  const gchar *env;
-
-  if (*name)
+  if (lookup_setting (machine, var, key, name))
     {
       return;
     }
 
-  env = g_getenv (var);
-  if (env)
+  g_warning ("No %s specified with a machine configuration file"
+             ", environment variable or command line option"
+             "; refusing to run", key);
+  exit (EXIT_SUCCESS);
+}
+
+
+static WysAudioBackend
+get_backend (const gchar *machine,
+             gchar       *name)
+{
+  GEnumClass *klass;
+  GEnumValue *value = NULL;
+  WysAudioBackend backend = WYS_AUDIO_BACKEND_SCRIPT;
+
+  if (!lookup_setting (machine, "WYS_BACKEND", "backend", &name))
     {
-      *name = g_strdup (env);
-      return;
+      return backend;
     }
 
-  if (machine)
+  klass = g_type_class_ref (WYS_TYPE_AUDIO_BACKEND);
+  value = g_enum_get_value_by_nick (klass, name);
+  if (value)
     {
-      *name = machine_conf (machine, key);
-      if (*name)
-        {
-          return;
-        }
+      backend = value->value;
     }
+  else
+    {
+      g_warning ("Unknown audio backend `%s', using `%s'",
+                 name,
+                 g_enum_get_value (klass, backend)->value_nick);
+    }
+  g_type_class_unref (klass);
 
-  g_warning ("No %s specified with a machine configuration file"
-             ", environment variable or command line option"
-             "; refusing to run", key);
-  exit (EXIT_SUCCESS);
+  g_free (name);
+  return backend;
 }
 
 
@@ -603,20 +1405,27 @@ main (int argc, char **argv)
   g_autofree gchar *codec = NULL;
   g_autofree gchar *modem = NULL;
   g_autofree gchar *machine = NULL;
+  gchar *backend = NULL;
+  gboolean tune_mode = FALSE;
 
   GOptionEntry options[] =
     {
       { "codec", 'c', 0, G_OPTION_ARG_STRING, &codec, "Name of the codec's ALSA card", "NAME" },
       { "modem", 'm', 0, G_OPTION_ARG_STRING, &modem, "Name of the modem's ALSA card", "NAME" },
+      { "backend", 'b', 0, G_OPTION_ARG_STRING, &backend, "How to loop audio: script (wys-connect) or native", "BACKEND" },
+      { "tune", 0, 0, G_OPTION_ARG_NONE, &tune_mode, "Find the shortest period and latency that loop audio without glitches and save them", NULL },
       { NULL }
     };
 
+  wys_trace_start ();
   setlocale(LC_ALL, "");
 
   machine = mchk_read_machine (NULL);
+  wys_trace_mark ("mchk_read_machine");
   if (machine)
     {
       check_machine (machine);
+      wys_trace_mark ("check_machine");
     }
   else
     {
@@ -631,6 +1440,7 @@ main (int argc, char **argv)
     {
       g_print ("Error parsing options: %s\n", error->message);
     }
+  wys_trace_mark ("option parsing");
 
 
   if (machine)
@@ -641,10 +1451,23 @@ main (int argc, char **argv)
 
   ensure_alsa_card (machine, "WYS_CODEC", "codec", &codec);
   ensure_alsa_card (machine, "WYS_MODEM", "modem", &modem);
+  wys_trace_mark ("ensure_alsa_card");
 
   setup_signals ();
 
-  run (codec, modem);
+  if (tune_mode)
+    {
+      if (!machine)
+        {
+          g_warning ("Tuning needs a machine name to save settings for");
+          return EXIT_FAILURE;
+        }
+
+      tune (machine, codec, modem);
+      return 0;
+    }
+
+  run (machine, codec, modem, get_backend (machine, backend));
 
   return 0;
 }
@@ -22,20 +22,55 @@
  *
  */
 
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "wys-audio.h"
+#include "wys-child.h"
+#include "wys-loop.h"
+#include "wys-pcm-cache.h"
+#include "enum-types.h"
 #include "util.h"
 
 #include <glib/gi18n.h>
 #include <glib-object.h>
+#include <gio/gio.h>
+#include <alsa/asoundlib.h>
+
+#define SOUND_DEVICE_DIR "/dev/snd"
+/** How long to wait before starting wys-connect again if it exits by
+ * itself, say because alsaloop opened the devices too early, and how
+ * many times to try in a call */
+#define ALSALOOP_RETRY_MS 300
+#define ALSALOOP_RETRIES  20
+/** How long alsaloop has to keep going with a pair of PCMs for them
+ * to be remembered as the ones that work */
+#define ALSALOOP_WORKING_US 1000000
 
 struct alsaloop {
-  int alsaloop_pid;
+  /** wys-connect, for the script backend */
+  WysChild *alsaloop;
+  /** A wys-connect being stopped, still holding the devices */
+  WysChild *releasing;
+  /** Times wys-connect has exited by itself during the call, or more
+   * than ALSALOOP_RETRIES once given up on until the devices change */
+  guint retries;
+  /** The PCMs wys-connect last said it was trying, and when */
+  gchar *capture_pcm;
+  gchar *playback_pcm;
+  gint64 tried_time;
+  /** The ends of the loop, for when it's started later */
+  const gchar *from;
+  const gchar *to;
+  /** In-process loopback, for the native backend */
+  WysLoop *loop;
+  /** Whether audio should be flowing */
+  gboolean active;
+  /** Processing stages for the native backend */
+  gchar **dsp;
+  /** Glitch counters for the native backend, kept across loops */
+  WysStats *stats;
 };
 
 struct _WysAudio
@@ -44,9 +79,41 @@ struct _WysAudio
 
   gchar *codec;
   gchar *modem;
-  
+  WysAudioBackend backend;
+  /** PCM name templates for either backend to try */
+  gchar **capture_pcms;
+  gchar **playback_pcms;
+  /** Bounds on the native backend's playback queue, in microseconds */
+  guint min_latency;
+  guint max_latency;
+  /** How often the native backend moves audio, in microseconds */
+  guint period_time;
+  /** Whether the native backend wakes on timers rather than periods */
+  gboolean timer_scheduling;
+  /** Length of echo the native backend cancels, in milliseconds, or
+   * 0 for none */
+  guint echo_tail;
+  /** Shared by the loops in both directions, created with them */
+  WysEcho *echo;
+  /** Moves the native backend's audio, or NULL for a thread per
+   * loop; not owned */
+  WysEngine *engine;
+  /** Watches for sound devices appearing or becoming accessible */
+  GFileMonitor *device_monitor;
+  /** Starts wys-connect again after it exited by itself */
+  guint retry_id;
+  /** Whether a call is likely, so PCMs should be kept open */
+  gboolean prepared;
+  /** Whether every call is on hold, so loops should play silence */
+  gboolean muted;
+
   struct alsaloop modem_to_speaker;
   struct alsaloop mic_to_modem;
+
+  /** How many times the script backend has been stopped, and the
+   * longest it took to release the devices, in microseconds */
+  guint teardowns;
+  gint64 worst_teardown;
 };
 
 G_DEFINE_TYPE (WysAudio, wys_audio, G_TYPE_OBJECT);
@@ -55,6 +122,17 @@ enum {
   PROP_0,
   PROP_CODEC,
   PROP_MODEM,
+  PROP_BACKEND,
+  PROP_CAPTURE_PCMS,
+  PROP_PLAYBACK_PCMS,
+  PROP_MIN_LATENCY,
+  PROP_MAX_LATENCY,
+  PROP_PERIOD_TIME,
+  PROP_TIMER_SCHEDULING,
+  PROP_DSP_FROM_NETWORK,
+  PROP_DSP_TO_NETWORK,
+  PROP_ECHO_TAIL,
+  PROP_ENGINE,
   PROP_LAST_PROP,
 };
 static GParamSpec *props[PROP_LAST_PROP];
@@ -78,6 +156,54 @@ set_property (GObject      *object,
     self->modem = g_value_dup_string (value);
     break;
 
+  case PROP_BACKEND:
+    self->backend = g_value_get_enum (value);
+    break;
+
+  case PROP_CAPTURE_PCMS:
+    g_strfreev (self->capture_pcms);
+    self->capture_pcms = g_value_dup_boxed (value);
+    break;
+
+  case PROP_PLAYBACK_PCMS:
+    g_strfreev (self->playback_pcms);
+    self->playback_pcms = g_value_dup_boxed (value);
+    break;
+
+  case PROP_MIN_LATENCY:
+    self->min_latency = g_value_get_uint (value);
+    break;
+
+  case PROP_MAX_LATENCY:
+    self->max_latency = g_value_get_uint (value);
+    break;
+
+  case PROP_PERIOD_TIME:
+    self->period_time = g_value_get_uint (value);
+    break;
+
+  case PROP_TIMER_SCHEDULING:
+    self->timer_scheduling = g_value_get_boolean (value);
+    break;
+
+  case PROP_DSP_FROM_NETWORK:
+    g_strfreev (self->modem_to_speaker.dsp);
+    self->modem_to_speaker.dsp = g_value_dup_boxed (value);
+    break;
+
+  case PROP_DSP_TO_NETWORK:
+    g_strfreev (self->mic_to_modem.dsp);
+    self->mic_to_modem.dsp = g_value_dup_boxed (value);
+    break;
+
+  case PROP_ECHO_TAIL:
+    self->echo_tail = g_value_get_uint (value);
+    break;
+
+  case PROP_ENGINE:
+    self->engine = g_value_get_pointer (value);
+    break;
+
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     break;
@@ -85,18 +211,92 @@ set_property (GObject      *object,
 }
 
 
+static void wys_resume_alsaloop (WysAudio *self, struct alsaloop *aloop);
+static void wys_cancel_retry (WysAudio *self);
+
+static void
+device_changed_cb (GFileMonitor      *monitor,
+                   GFile             *file,
+                   GFile             *other_file,
+                   GFileMonitorEvent  event_type,
+                   WysAudio          *self)
+{
+  g_autofree gchar *name = NULL;
+
+  if (event_type != G_FILE_MONITOR_EVENT_CREATED &&
+      event_type != G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+    {
+      return;
+    }
+
+  // Only PCM and control nodes matter
+  name = g_file_get_basename (file);
+  if (!g_str_has_prefix (name, "pcmC") &&
+      !g_str_has_prefix (name, "controlC"))
+    {
+      return;
+    }
+
+  g_debug ("Sound device `%s' changed", name);
+
+  if (self->backend == WYS_AUDIO_BACKEND_SCRIPT)
+    {
+      // No need to wait any longer to retry a wys-connect which
+      // exited, now that something has changed
+      wys_cancel_retry (self);
+      self->modem_to_speaker.retries = 0;
+      self->mic_to_modem.retries = 0;
+      wys_resume_alsaloop (self, &self->modem_to_speaker);
+      wys_resume_alsaloop (self, &self->mic_to_modem);
+      return;
+    }
+
+  if (self->modem_to_speaker.loop)
+    {
+      wys_loop_devices_changed (self->modem_to_speaker.loop);
+    }
+  if (self->mic_to_modem.loop)
+    {
+      wys_loop_devices_changed (self->mic_to_modem.loop);
+    }
+}
+
+
+static void
+watch_devices (WysAudio *self)
+{
+  g_autoptr(GFile) dir = NULL;
+  GError *error = NULL;
+
+  dir = g_file_new_for_path (SOUND_DEVICE_DIR);
+  self->device_monitor = g_file_monitor_directory
+    (dir, G_FILE_MONITOR_NONE, NULL, &error);
+  if (!self->device_monitor)
+    {
+      g_warning ("Error watching `%s' for sound devices: %s",
+                 SOUND_DEVICE_DIR, error->message);
+      g_error_free (error);
+      return;
+    }
+
+  g_signal_connect (self->device_monitor, "changed",
+                    G_CALLBACK (device_changed_cb), self);
+}
+
+
 static void
 constructed (GObject *object)
 {
   GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
   WysAudio *self = WYS_AUDIO (object);
 
-  (void)self; // Currently unused, may become useful later
+  // Loops wait for their devices instead of polling for them
+  watch_devices (self);
 
   parent_class->constructed (object);
 }
 
-static void wys_destroy_alsaloop (struct alsaloop *aloop);
+static void wys_destroy_alsaloop (WysAudio *self, struct alsaloop *aloop);
 
 static void
 dispose (GObject *object)
@@ -104,8 +304,16 @@ dispose (GObject *object)
   GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
   WysAudio *self = WYS_AUDIO (object);
 
-  wys_destroy_alsaloop(&self->modem_to_speaker);
-  wys_destroy_alsaloop(&self->mic_to_modem);
+  self->prepared = FALSE;
+  wys_destroy_alsaloop(self, &self->modem_to_speaker);
+  wys_destroy_alsaloop(self, &self->mic_to_modem);
+  g_clear_pointer (&self->echo, wys_echo_free);
+
+  if (self->device_monitor)
+    {
+      g_signal_handlers_disconnect_by_data (self->device_monitor, self);
+      g_clear_object (&self->device_monitor);
+    }
 
   parent_class->dispose (object);
 }
@@ -117,6 +325,16 @@ finalize (GObject *object)
   GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
   WysAudio *self = WYS_AUDIO (object);
 
+  wys_stats_free (self->mic_to_modem.stats);
+  wys_stats_free (self->modem_to_speaker.stats);
+  g_strfreev (self->mic_to_modem.dsp);
+  g_strfreev (self->modem_to_speaker.dsp);
+  g_free (self->mic_to_modem.capture_pcm);
+  g_free (self->mic_to_modem.playback_pcm);
+  g_free (self->modem_to_speaker.capture_pcm);
+  g_free (self->modem_to_speaker.playback_pcm);
+  g_strfreev (self->playback_pcms);
+  g_strfreev (self->capture_pcms);
   g_free (self->modem);
   g_free (self->codec);
 
@@ -148,38 +366,356 @@ wys_audio_class_init (WysAudioClass *klass)
                          "SIMcom SIM7100",
                          G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
 
+  props[PROP_BACKEND] =
+    g_param_spec_enum ("backend",
+                       _("Backend"),
+                       _("How audio is moved between the ALSA cards"),
+                       WYS_TYPE_AUDIO_BACKEND,
+                       WYS_AUDIO_BACKEND_SCRIPT,
+                       G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_CAPTURE_PCMS] =
+    g_param_spec_boxed ("capture-pcms",
+                        _("Capture PCMs"),
+                        _("Capture PCM name templates to try"),
+                        G_TYPE_STRV,
+                        G_PARAM_WRITABLE);
+
+  props[PROP_PLAYBACK_PCMS] =
+    g_param_spec_boxed ("playback-pcms",
+                        _("Playback PCMs"),
+                        _("Playback PCM name templates to try"),
+                        G_TYPE_STRV,
+                        G_PARAM_WRITABLE);
+
+  props[PROP_MIN_LATENCY] =
+    g_param_spec_uint ("min-latency",
+                       _("Minimum latency"),
+                       _("The least audio the native backend keeps queued, in microseconds, or 0 for the default"),
+                       0, G_MAXUINT, 0,
+                       G_PARAM_WRITABLE);
+
+  props[PROP_MAX_LATENCY] =
+    g_param_spec_uint ("max-latency",
+                       _("Maximum latency"),
+                       _("The most audio the native backend keeps queued, in microseconds, or 0 for the default"),
+                       0, G_MAXUINT, 0,
+                       G_PARAM_WRITABLE);
+
+  props[PROP_PERIOD_TIME] =
+    g_param_spec_uint ("period-time",
+                       _("Period time"),
+                       _("How often the native backend moves audio, in microseconds, or 0 for the default"),
+                       0, G_MAXUINT, 0,
+                       G_PARAM_WRITABLE);
+
+  props[PROP_TIMER_SCHEDULING] =
+    g_param_spec_boolean ("timer-scheduling",
+                          _("Timer scheduling"),
+                          _("Whether the native backend wakes on timers, as late as its queue allows, rather than every period"),
+                          FALSE,
+                          G_PARAM_WRITABLE);
+
+  props[PROP_DSP_FROM_NETWORK] =
+    g_param_spec_boxed ("dsp-from-network",
+                        _("DSP from network"),
+                        _("Processing stages the native backend applies to audio from the network"),
+                        G_TYPE_STRV,
+                        G_PARAM_WRITABLE);
+
+  props[PROP_DSP_TO_NETWORK] =
+    g_param_spec_boxed ("dsp-to-network",
+                        _("DSP to network"),
+                        _("Processing stages the native backend applies to audio to the network"),
+                        G_TYPE_STRV,
+                        G_PARAM_WRITABLE);
+
+  props[PROP_ECHO_TAIL] =
+    g_param_spec_uint ("echo-tail",
+                       _("Echo tail"),
+                       _("The length of echo the native backend cancels, in milliseconds, or 0 for none"),
+                       0, G_MAXUINT, 0,
+                       G_PARAM_WRITABLE);
+
+  props[PROP_ENGINE] =
+    g_param_spec_pointer ("engine",
+                          _("Engine"),
+                          _("The WysEngine to move the native backend's audio in, or NULL for a thread per direction"),
+                          G_PARAM_WRITABLE);
+
   g_object_class_install_properties (object_class, PROP_LAST_PROP, props);
 }
 
 static void
 wys_audio_init (WysAudio *self)
 {
-  self->modem_to_speaker.alsaloop_pid = -1;
-  self->mic_to_modem.alsaloop_pid = -1;
+  self->modem_to_speaker.stats = wys_stats_new();
+  self->mic_to_modem.stats = wys_stats_new();
 }
 
 WysAudio *
-wys_audio_new (const gchar *codec,
-               const gchar *modem)
+wys_audio_new (const gchar     *codec,
+               const gchar     *modem,
+               WysAudioBackend  backend)
 {
   return g_object_new (WYS_TYPE_AUDIO,
                        "codec", codec,
                        "modem", modem,
+                       "backend", backend,
                        NULL);
 }
 
-static void 
-wys_create_alsaloop (struct alsaloop *aloop, const gchar *from, const gchar *to)
+static WysLoop *
+wys_new_loop (WysAudio *self, struct alsaloop *aloop, const gchar *from, const gchar *to)
+{
+  WysLoop *loop;
+
+  loop = wys_loop_new(from, to,
+                      (const gchar * const *)self->capture_pcms,
+                      (const gchar * const *)self->playback_pcms,
+                      self->min_latency, self->max_latency,
+                      self->period_time, self->timer_scheduling,
+                      (const gchar * const *)aloop->dsp,
+                      self->engine);
+  if(!loop)
+    return NULL;
+
+  wys_loop_set_stats(loop, aloop->stats);
+  wys_loop_set_muted(loop, self->muted);
+  if(self->echo_tail == 0)
+    return loop;
+
+  // The far end's audio played on the speaker is the reference for
+  // cancelling its echo from the microphone
+  if(!self->echo)
+    self->echo = wys_echo_new(WYS_LOOP_RATE, self->echo_tail);
+  wys_loop_set_echo(loop, self->echo, aloop == &self->modem_to_speaker);
+
+  return loop;
+}
+
+// Whether a card's control device is there and accessible, which
+// udev does after the PCMs'
+static gboolean
+wys_card_ready (const gchar *card)
+{
+  g_autofree gchar *control = NULL;
+  int index = snd_card_get_index(card);
+
+  if(index < 0)
+    return FALSE;
+
+  control = g_strdup_printf(SOUND_DEVICE_DIR "/controlC%d", index);
+  return access(control, R_OK | W_OK) == 0;
+}
+
+static void wys_alsaloop_exited (WysChild *child, gpointer data);
+static void wys_alsaloop_output (WysChild *child, const gchar *line, gpointer data);
+
+static void
+wys_forget_pcms (struct alsaloop *aloop)
+{
+  g_clear_pointer(&aloop->capture_pcm, g_free);
+  g_clear_pointer(&aloop->playback_pcm, g_free);
+}
+
+// Add an option for each of a card's PCMs, the one that worked last
+// time first
+static void
+wys_add_pcm_args (GPtrArray *argv, const gchar *option, const gchar * const *templates,
+                  const gchar *card, const gchar *cached)
+{
+  guint i;
+
+  if(cached){
+    g_ptr_array_add(argv, g_strdup(option));
+    g_ptr_array_add(argv, g_strdup(cached));
+  }
+
+  for(i = 0; templates[i]; i++){
+    g_autofree gchar *pcm = wys_loop_expand_pcm(templates[i], card);
+
+    if(g_strcmp0(pcm, cached) == 0)
+      continue;
+    g_ptr_array_add(argv, g_strdup(option));
+    g_ptr_array_add(argv, g_steal_pointer(&pcm));
+  }
+}
+
+static void
+wys_spawn_alsaloop (WysAudio *self, struct alsaloop *aloop)
+{
+  g_autoptr(GPtrArray) argv = NULL;
+  g_autofree gchar *capture = NULL;
+  g_autofree gchar *playback = NULL;
+
+  // Started from device_changed_cb() once they appear
+  if(!wys_card_ready(aloop->from) || !wys_card_ready(aloop->to)){
+    g_debug("Waiting for `%s' and `%s' to start wys-connect", aloop->from, aloop->to);
+    return;
+  }
+
+  argv = g_ptr_array_new_with_free_func(g_free);
+  g_ptr_array_add(argv, g_strdup("wys-connect"));
+
+  // Otherwise wys-connect tries its own list
+  if(self->capture_pcms && self->playback_pcms){
+    wys_pcm_cache_lookup(aloop->from, aloop->to, &capture, &playback);
+    wys_add_pcm_args(argv, "-c", (const gchar * const *)self->capture_pcms,
+                     aloop->from, capture);
+    wys_add_pcm_args(argv, "-p", (const gchar * const *)self->playback_pcms,
+                     aloop->to, playback);
+  }
+
+  g_ptr_array_add(argv, g_strdup(aloop->from));
+  g_ptr_array_add(argv, g_strdup(aloop->to));
+  // alsaloop's latency is all it buffers, like the native backend's
+  // most queued plus a period either side
+  if(self->max_latency)
+    g_ptr_array_add(argv, g_strdup_printf("%u", self->max_latency + 2 * self->period_time));
+  g_ptr_array_add(argv, NULL);
+
+  wys_forget_pcms(aloop);
+  aloop->alsaloop = wys_child_spawn((const gchar * const *)argv->pdata,
+                                    wys_alsaloop_exited, wys_alsaloop_output, self);
+}
+
+// wys-connect says which pair of PCMs it is trying as it goes; the
+// last one is working if alsaloop is still going a while later
+static void
+wys_alsaloop_output (WysChild *child, const gchar *line, gpointer data)
+{
+  WysAudio *self = data;
+  struct alsaloop *aloop = self->modem_to_speaker.alsaloop == child
+    ? &self->modem_to_speaker : &self->mic_to_modem;
+  g_auto(GStrv) fields = g_strsplit(line, "\t", 3);
+
+  if(g_strv_length(fields) != 3 || !g_str_equal(fields[0], "trying")){
+    g_debug("wys-connect: %s", line);
+    return;
+  }
+
+  g_debug("wys-connect trying `%s' -> `%s'", fields[1], fields[2]);
+  wys_forget_pcms(aloop);
+  aloop->capture_pcm = g_strdup(fields[1]);
+  aloop->playback_pcm = g_strdup(fields[2]);
+  aloop->tried_time = g_get_monotonic_time();
+}
+
+// Remember the PCMs wys-connect is using, if they have been working
+// long enough, so that they're tried first next time
+static void
+wys_store_pcms (struct alsaloop *aloop)
+{
+  if(aloop->capture_pcm
+     && g_get_monotonic_time() - aloop->tried_time >= ALSALOOP_WORKING_US)
+    wys_pcm_cache_store(aloop->from, aloop->to, aloop->capture_pcm, aloop->playback_pcm);
+  wys_forget_pcms(aloop);
+}
+
+static void
+wys_alsaloop_released (WysChild *child, gint64 teardown_us, gpointer data)
+{
+  WysAudio *self = data;
+  struct alsaloop *aloop = self->modem_to_speaker.releasing == child
+    ? &self->modem_to_speaker : &self->mic_to_modem;
+
+  aloop->releasing = NULL;
+  self->teardowns++;
+  self->worst_teardown = MAX(self->worst_teardown, teardown_us);
+
+  // The call came back while the old loop was holding the devices
+  wys_resume_alsaloop(self, aloop);
+
+  g_object_unref(self);
+}
+
+// Start wys-connect for a call that has none, if nothing is still
+// holding the devices and it isn't waiting to retry
+static void
+wys_resume_alsaloop (WysAudio *self, struct alsaloop *aloop)
+{
+  if(aloop->active && !aloop->alsaloop && !aloop->releasing && !self->retry_id
+     && aloop->retries <= ALSALOOP_RETRIES)
+    wys_spawn_alsaloop(self, aloop);
+}
+
+static void
+wys_cancel_retry (WysAudio *self)
+{
+  if(self->retry_id)
+    g_source_remove(self->retry_id);
+  self->retry_id = 0;
+}
+
+static gboolean
+wys_retry_alsaloop (gpointer data)
 {
-  int pid = fork();
-  if(pid == -1)
+  WysAudio *self = data;
+
+  self->retry_id = 0;
+  wys_resume_alsaloop(self, &self->modem_to_speaker);
+  wys_resume_alsaloop(self, &self->mic_to_modem);
+  return G_SOURCE_REMOVE;
+}
+
+// wys-connect gave up during a call, so the loop is silent until it
+// is started again
+static void
+wys_alsaloop_exited (WysChild *child, gpointer data)
+{
+  WysAudio *self = data;
+  struct alsaloop *aloop = self->modem_to_speaker.alsaloop == child
+    ? &self->modem_to_speaker : &self->mic_to_modem;
+
+  // Sooner if the devices change, see device_changed_cb()
+  if(aloop->retries < ALSALOOP_RETRIES){
+    aloop->retries++;
+    g_debug("wys-connect for `%s' -> `%s' exited, retrying", aloop->from, aloop->to);
+    if(!self->retry_id)
+      self->retry_id = g_timeout_add(ALSALOOP_RETRY_MS, wys_retry_alsaloop, self);
+  } else {
+    g_warning("wys-connect for `%s' -> `%s' keeps exiting, waiting for the devices to change",
+              aloop->from, aloop->to);
+    aloop->retries = ALSALOOP_RETRIES + 1;
+  }
+
+  // Anything it left behind still has to go before it's retried
+  wys_forget_pcms(aloop);
+  aloop->releasing = g_steal_pointer(&aloop->alsaloop);
+  wys_child_stop(aloop->releasing, wys_alsaloop_released, g_object_ref(self));
+}
+
+static void
+wys_create_alsaloop (WysAudio *self, struct alsaloop *aloop, const gchar *from, const gchar *to)
+{
+  if(!aloop->active){
+    wys_stats_begin_call(aloop->stats);
+    aloop->retries = 0;
+    // The first direction of a new call; the canceller's timeline has
+    // moved on by however long it has been since the last one
+    if(self->echo && !self->modem_to_speaker.active && !self->mic_to_modem.active)
+      wys_echo_reset(self->echo);
+  }
+  aloop->active = TRUE;
+  aloop->from = from;
+  aloop->to = to;
+
+  if(self->backend == WYS_AUDIO_BACKEND_NATIVE){
+    // Usually the PCMs have already been opened by wys_audio_prepare()
+    if(!aloop->loop)
+      aloop->loop = wys_new_loop(self, aloop, from, to);
+    if(aloop->loop)
+      wys_loop_start(aloop->loop);
     return;
-  if(pid){
-    aloop->alsaloop_pid = pid;
-  }else{
-    execlp("wys-connect", "wys-connect", from, to, (char*)0);
-    abort();
   }
+
+  // A loop still being stopped is started again once it has let go
+  // of the devices, see wys_alsaloop_released()
+  if(aloop->alsaloop || aloop->releasing)
+    return;
+
+  wys_spawn_alsaloop(self, aloop);
 }
 
 void
@@ -187,18 +723,53 @@ wys_audio_ensure_loopback (WysAudio     *self,
                            WysDirection  direction)
 {
   switch(direction){
-    case WYS_DIRECTION_FROM_NETWORK: wys_create_alsaloop(&self->modem_to_speaker, self->modem, self->codec); break;
-    case WYS_DIRECTION_TO_NETWORK:   wys_create_alsaloop(&self->mic_to_modem    , self->codec, self->modem); break;
+    case WYS_DIRECTION_FROM_NETWORK: wys_create_alsaloop(self, &self->modem_to_speaker, self->modem, self->codec); break;
+    case WYS_DIRECTION_TO_NETWORK:   wys_create_alsaloop(self, &self->mic_to_modem    , self->codec, self->modem); break;
   }
 }
 
+// The native backend's loops leave their errors in the stats rather
+// than logging from their real-time threads
 static void
-wys_destroy_alsaloop (struct alsaloop *aloop)
+wys_log_failure (WysAudio *self, struct alsaloop *aloop)
 {
-  if(aloop->alsaloop_pid <= 0)
+  const WysDirection direction = aloop == &self->modem_to_speaker
+    ? WYS_DIRECTION_FROM_NETWORK : WYS_DIRECTION_TO_NETWORK;
+  const gchar *what;
+  gint err;
+
+  what = wys_stats_take_failure(aloop->stats, &err);
+  if(!what)
+    return;
+
+  if(err < 0)
+    g_warning("Audio %s: %s: %s", wys_direction_get_description(direction), what, snd_strerror(err));
+  else
+    g_warning("Audio %s: %s", wys_direction_get_description(direction), what);
+}
+
+static void
+wys_destroy_alsaloop (WysAudio *self, struct alsaloop *aloop)
+{
+  wys_log_failure(self, aloop);
+  if(aloop->active)
+    wys_stats_end_call(aloop->stats);
+  aloop->active = FALSE;
+  if(!self->modem_to_speaker.active && !self->mic_to_modem.active)
+    wys_cancel_retry(self);
+
+  if(aloop->loop){
+    if(self->prepared)
+      wys_loop_stop(aloop->loop);
+    else
+      g_clear_pointer(&aloop->loop, wys_loop_free);
+  }
+
+  if(!aloop->alsaloop)
     return;
-  kill(aloop->alsaloop_pid, SIGTERM);
-  aloop->alsaloop_pid = -1;
+  wys_store_pcms(aloop);
+  aloop->releasing = g_steal_pointer(&aloop->alsaloop);
+  wys_child_stop(aloop->releasing, wys_alsaloop_released, g_object_ref(self));
 }
 
 
@@ -207,7 +778,144 @@ wys_audio_ensure_no_loopback (WysAudio     *self,
                               WysDirection  direction)
 {
   switch(direction){
-    case WYS_DIRECTION_FROM_NETWORK: wys_destroy_alsaloop(&self->modem_to_speaker); break;
-    case WYS_DIRECTION_TO_NETWORK:   wys_destroy_alsaloop(&self->mic_to_modem    ); break;
+    case WYS_DIRECTION_FROM_NETWORK: wys_destroy_alsaloop(self, &self->modem_to_speaker); break;
+    case WYS_DIRECTION_TO_NETWORK:   wys_destroy_alsaloop(self, &self->mic_to_modem    ); break;
   }
 }
+
+
+static void
+wys_release_alsaloop (struct alsaloop *aloop)
+{
+  if(!aloop->active)
+    g_clear_pointer(&aloop->loop, wys_loop_free);
+}
+
+
+/**
+ * wys_audio_prepare:
+ *
+ * Open and configure the PCMs for both directions ahead of a likely
+ * call, so that wys_audio_ensure_loopback() only has to start the
+ * streams.  Only the native backend does anything here.
+ */
+void
+wys_audio_prepare (WysAudio *self)
+{
+  if(self->backend != WYS_AUDIO_BACKEND_NATIVE)
+    return;
+
+  self->prepared = TRUE;
+
+  if(!self->modem_to_speaker.loop)
+    self->modem_to_speaker.loop = wys_new_loop(self, &self->modem_to_speaker, self->modem, self->codec);
+  if(!self->mic_to_modem.loop)
+    self->mic_to_modem.loop = wys_new_loop(self, &self->mic_to_modem, self->codec, self->modem);
+}
+
+
+/** Close any PCMs held open by wys_audio_prepare() which aren't in use */
+void
+wys_audio_unprepare (WysAudio *self)
+{
+  self->prepared = FALSE;
+
+  wys_release_alsaloop(&self->modem_to_speaker);
+  wys_release_alsaloop(&self->mic_to_modem);
+}
+
+
+/** The clock drift the native backend is compensating for in
+ * @direction, in parts per million, or 0 if unknown */
+gdouble
+wys_audio_get_drift_ppm (WysAudio     *self,
+                         WysDirection  direction)
+{
+  struct alsaloop *aloop;
+
+  switch(direction){
+    case WYS_DIRECTION_FROM_NETWORK: aloop = &self->modem_to_speaker; break;
+    case WYS_DIRECTION_TO_NETWORK:   aloop = &self->mic_to_modem    ; break;
+    default: return 0.0;
+  }
+
+  return aloop->loop ? wys_loop_get_drift_ppm(aloop->loop) : 0.0;
+}
+
+
+/**
+ * wys_audio_set_muted:
+ *
+ * Have the native backend play silence in both directions, or stop
+ * doing so, without stopping its loops.  Used while calls are on
+ * hold so that taking one off hold, or swapping calls, doesn't
+ * restart the audio.  The script backend keeps looping whatever the
+ * modem sends, which is silence for a held call anyway.
+ */
+void
+wys_audio_set_muted (WysAudio *self,
+                     gboolean  muted)
+{
+  if(self->muted == muted)
+    return;
+
+  g_debug("Audio %s", muted ? "muted" : "unmuted");
+  self->muted = muted;
+
+  if(self->modem_to_speaker.loop)
+    wys_loop_set_muted(self->modem_to_speaker.loop, muted);
+  if(self->mic_to_modem.loop)
+    wys_loop_set_muted(self->mic_to_modem.loop, muted);
+}
+
+
+/**
+ * wys_audio_log_stats:
+ *
+ * Log the native backend's glitch counts for each direction, for the
+ * last call and since startup, and how long the script backend has
+ * taken to let go of the devices.
+ */
+void
+wys_audio_log_stats (WysAudio *self)
+{
+  g_autofree gchar *from = NULL;
+  g_autofree gchar *to = NULL;
+
+  wys_log_failure(self, &self->modem_to_speaker);
+  wys_log_failure(self, &self->mic_to_modem);
+  from = wys_stats_to_string(self->modem_to_speaker.stats);
+  to = wys_stats_to_string(self->mic_to_modem.stats);
+
+  g_message("Audio %s:\n%s",
+            wys_direction_get_description(WYS_DIRECTION_FROM_NETWORK), from);
+  g_message("Audio %s:\n%s",
+            wys_direction_get_description(WYS_DIRECTION_TO_NETWORK), to);
+
+  if(self->teardowns)
+    g_message("Loopback stopped %u times, slowest release %" G_GINT64_FORMAT " us",
+              self->teardowns, self->worst_teardown);
+}
+
+
+/**
+ * wys_audio_get_xruns:
+ * @periods: (out) (optional): where to store the number of periods
+ * moved
+ *
+ * Returns: the number of xruns in both directions in the current or
+ * last call, for the native backend
+ */
+guint
+wys_audio_get_xruns (WysAudio *self,
+                     guint    *periods)
+{
+  guint from_periods, to_periods, xruns;
+
+  xruns = wys_stats_get_xruns(self->modem_to_speaker.stats, &from_periods)
+    + wys_stats_get_xruns(self->mic_to_modem.stats, &to_periods);
+  if(periods)
+    *periods = MIN(from_periods, to_periods);
+
+  return xruns;
+}
@@ -35,12 +35,28 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE (WysAudio, wys_audio, WYS, AUDIO, GObject);
 
-WysAudio *wys_audio_new                (const gchar  *codec,
-                                        const gchar  *modem);
+typedef enum
+{
+  WYS_AUDIO_BACKEND_SCRIPT = 0,
+  WYS_AUDIO_BACKEND_NATIVE
+} WysAudioBackend;
+
+WysAudio *wys_audio_new                (const gchar     *codec,
+                                        const gchar     *modem,
+                                        WysAudioBackend  backend);
 void      wys_audio_ensure_loopback    (WysAudio     *self,
                                         WysDirection  direction);
 void      wys_audio_ensure_no_loopback (WysAudio     *self,
                                         WysDirection  direction);
+void      wys_audio_prepare            (WysAudio     *self);
+void      wys_audio_unprepare          (WysAudio     *self);
+gdouble   wys_audio_get_drift_ppm      (WysAudio     *self,
+                                        WysDirection  direction);
+void      wys_audio_set_muted          (WysAudio     *self,
+                                        gboolean      muted);
+void      wys_audio_log_stats          (WysAudio     *self);
+guint     wys_audio_get_xruns          (WysAudio     *self,
+                                        guint        *periods);
 
 G_END_DECLS
 
@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-child.h"
+
+#include <glib-unix.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/** How long the group has to exit after SIGTERM before it's killed */
+#define CHILD_KILL_MS  1000
+/** How often to check for stragglers once the leader has exited */
+#define CHILD_POLL_MS  5
+
+
+struct _WysChild
+{
+  /** Also the process group of the child and all its descendants */
+  GPid pid;
+  /** Signals the leader's exit, or -1 on kernels without pidfds,
+   * where a child watch is used instead */
+  int pidfd;
+  /** Whether the leader has exited and been reaped */
+  gboolean exited;
+  /** Set by wys_child_stop() */
+  gint64 stop_time;
+  guint kill_timer;
+  guint poll_timer;
+  WysChildExited exited_cb;
+  WysChildOutput output_cb;
+  /** Passed to exited_cb and output_cb */
+  gpointer spawn_data;
+  /** The read end of a pipe from the child's standard output, or -1 */
+  int output_fd;
+  guint output_watch;
+  /** Output since the last newline */
+  GString *output;
+  WysChildReleased released;
+  gpointer data;
+};
+
+
+static void
+close_output (WysChild *self)
+{
+  if (self->output_watch)
+    {
+      g_source_remove (self->output_watch);
+      self->output_watch = 0;
+    }
+  if (self->output_fd >= 0)
+    {
+      close (self->output_fd);
+      self->output_fd = -1;
+    }
+  if (self->output)
+    {
+      g_string_free (self->output, TRUE);
+      self->output = NULL;
+    }
+}
+
+
+static void
+release (WysChild *self)
+{
+  const gint64 teardown = g_get_monotonic_time () - self->stop_time;
+
+  g_debug ("Child %d and its descendants exited %" G_GINT64_FORMAT
+           " us after being stopped", self->pid, teardown);
+
+  if (self->kill_timer)
+    {
+      g_source_remove (self->kill_timer);
+    }
+  if (self->poll_timer)
+    {
+      g_source_remove (self->poll_timer);
+    }
+  close_output (self);
+
+  if (self->released)
+    {
+      self->released (self, teardown, self->data);
+    }
+  g_free (self);
+}
+
+
+static gboolean
+group_empty (WysChild *self)
+{
+  if (!self->exited)
+    {
+      return FALSE;
+    }
+
+  // Reap anything orphaned to us
+  while (waitpid (-self->pid, NULL, WNOHANG) > 0)
+    {
+    }
+
+  return kill (-self->pid, 0) == -1 && errno == ESRCH;
+}
+
+
+static gboolean
+poll_cb (WysChild *self)
+{
+  if (!group_empty (self))
+    {
+      return G_SOURCE_CONTINUE;
+    }
+
+  self->poll_timer = 0;
+  release (self);
+  return G_SOURCE_REMOVE;
+}
+
+
+/** Once the leader has gone, anything left in the group is orphaned
+ * to us and may take a moment to die, so we check back until it has */
+static void
+check_released (WysChild *self)
+{
+  if (group_empty (self))
+    {
+      release (self);
+    }
+  else if (self->exited && !self->poll_timer)
+    {
+      self->poll_timer = g_timeout_add (CHILD_POLL_MS,
+                                        (GSourceFunc)poll_cb, self);
+    }
+}
+
+
+static void
+leader_exited (WysChild *self)
+{
+  self->exited = TRUE;
+
+  if (!self->stop_time)
+    {
+      g_debug ("Child %d exited by itself", self->pid);
+      if (self->exited_cb)
+        {
+          self->exited_cb (self, self->spawn_data);
+        }
+      return;
+    }
+
+  // Nothing in the group should outlive the leader's own cleanup
+  kill (-self->pid, SIGKILL);
+  check_released (self);
+}
+
+
+static gboolean
+pidfd_cb (gint          fd,
+          GIOCondition  condition,
+          WysChild     *self)
+{
+  if (waitpid (self->pid, NULL, WNOHANG) == -1)
+    {
+      g_debug ("Error reaping child %d: %s", self->pid, g_strerror (errno));
+    }
+  close (self->pidfd);
+  self->pidfd = -1;
+
+  leader_exited (self);
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+child_watch_cb (GPid      pid,
+                gint      status,
+                WysChild *self)
+{
+  g_spawn_close_pid (pid);
+  leader_exited (self);
+}
+
+
+static gboolean
+output_fd_cb (gint          fd,
+              GIOCondition  condition,
+              WysChild     *self)
+{
+  gchar buffer[256];
+  gchar *newline;
+  gssize n;
+
+  n = read (fd, buffer, sizeof (buffer));
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+      return G_SOURCE_CONTINUE;
+    }
+  if (n <= 0)
+    {
+      // Everything in the group has closed its standard output
+      self->output_watch = 0;
+      close_output (self);
+      return G_SOURCE_REMOVE;
+    }
+
+  g_string_append_len (self->output, buffer, n);
+  while ((newline = strchr (self->output->str, '\n')))
+    {
+      *newline = '\0';
+      if (!self->stop_time)
+        {
+          self->output_cb (self, self->output->str, self->spawn_data);
+        }
+      g_string_erase (self->output, 0, newline - self->output->str + 1);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+
+static gboolean
+kill_cb (WysChild *self)
+{
+  g_debug ("Child %d slow to exit, killing its group", self->pid);
+  kill (-self->pid, SIGKILL);
+  self->kill_timer = 0;
+  return G_SOURCE_REMOVE;
+}
+
+
+/**
+ * wys_child_spawn:
+ * @argv: the program to run and its arguments, searched for in PATH
+ * @exited: (nullable): called if the program exits by itself
+ * @output: (nullable): called with each line of the program's
+ * standard output, which is otherwise shared with ours
+ *
+ * Run a program in a process group of its own, so that it can be
+ * stopped along with anything it starts, and watch for it exiting
+ * from the main loop.
+ *
+ * Returns: (nullable): the child, or %NULL if it couldn't be started
+ */
+WysChild *
+wys_child_spawn (const gchar * const *argv,
+                 WysChildExited       exited,
+                 WysChildOutput       output,
+                 gpointer             data)
+{
+  static gboolean subreaper = FALSE;
+  int fds[2] = { -1, -1 };
+  GError *error = NULL;
+  WysChild *self;
+  pid_t pid;
+
+  // Otherwise the group's orphans are left for init to reap, in its
+  // own time
+  if (!subreaper)
+    {
+      if (prctl (PR_SET_CHILD_SUBREAPER, 1) == -1)
+        {
+          g_debug ("Error becoming a subreaper: %s", g_strerror (errno));
+        }
+      subreaper = TRUE;
+    }
+
+  if (output && !g_unix_open_pipe (fds, FD_CLOEXEC, &error))
+    {
+      g_warning ("Error creating pipe for `%s': %s", argv[0], error->message);
+      g_error_free (error);
+      return NULL;
+    }
+
+  pid = fork ();
+  if (pid == -1)
+    {
+      g_warning ("Error starting `%s': %s", argv[0], g_strerror (errno));
+      if (output)
+        {
+          close (fds[0]);
+          close (fds[1]);
+        }
+      return NULL;
+    }
+
+  if (pid == 0)
+    {
+      setpgid (0, 0);
+      if (output)
+        {
+          dup2 (fds[1], STDOUT_FILENO);
+        }
+      execvp (argv[0], (char * const *)argv);
+      _exit (127);
+    }
+
+  // As well as in the child, so that we can't signal the group
+  // before it exists
+  setpgid (pid, pid);
+
+  self = g_new0 (WysChild, 1);
+  self->pid = pid;
+  self->exited_cb = exited;
+  self->output_cb = output;
+  self->spawn_data = data;
+  self->output_fd = -1;
+
+  if (output)
+    {
+      close (fds[1]);
+      self->output_fd = fds[0];
+      self->output = g_string_new (NULL);
+      g_unix_set_fd_nonblocking (self->output_fd, TRUE, NULL);
+      self->output_watch = g_unix_fd_add (self->output_fd,
+                                          G_IO_IN | G_IO_HUP,
+                                          (GUnixFDSourceFunc)output_fd_cb,
+                                          self);
+    }
+
+  self->pidfd = syscall (SYS_pidfd_open, pid, 0);
+  if (self->pidfd >= 0)
+    {
+      g_unix_fd_add (self->pidfd, G_IO_IN,
+                     (GUnixFDSourceFunc)pidfd_cb, self);
+    }
+  else
+    {
+      g_debug ("Error opening pidfd for child %d, using a child watch: %s",
+               pid, g_strerror (errno));
+      g_child_watch_add (pid, (GChildWatchFunc)child_watch_cb, self);
+    }
+
+  return self;
+}
+
+
+/**
+ * wys_child_stop:
+ * @released: (nullable): called once the child and all its
+ * descendants have exited, possibly before this returns
+ *
+ * Ask the child's process group to terminate, killing it if it takes
+ * too long.  @child is freed after @released is called.
+ */
+void
+wys_child_stop (WysChild         *self,
+                WysChildReleased  released,
+                gpointer          data)
+{
+  g_return_if_fail (self->stop_time == 0);
+
+  self->stop_time = g_get_monotonic_time ();
+  self->released = released;
+  self->data = data;
+
+  if (!self->exited)
+    {
+      kill (-self->pid, SIGTERM);
+      self->kill_timer = g_timeout_add (CHILD_KILL_MS,
+                                        (GSourceFunc)kill_cb, self);
+    }
+  else
+    {
+      // Anything the leader left behind when it exited is orphaned
+      kill (-self->pid, SIGKILL);
+    }
+
+  check_released (self);
+}
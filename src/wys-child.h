@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_CHILD_H__
+#define WYS_CHILD_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _WysChild WysChild;
+
+/** Called from the main loop once every process in the child's group
+ * has exited, @teardown_us after wys_child_stop() */
+typedef void (*WysChildReleased) (WysChild *child,
+                                  gint64    teardown_us,
+                                  gpointer  data);
+
+/** Called from the main loop if the child's leader exits before
+ * wys_child_stop() is called; the child still has to be stopped */
+typedef void (*WysChildExited) (WysChild *child,
+                                gpointer  data);
+
+/** Called from the main loop with each line the child writes to its
+ * standard output, without the newline, until wys_child_stop(), which
+ * it mustn't call itself */
+typedef void (*WysChildOutput) (WysChild    *child,
+                                const gchar *line,
+                                gpointer     data);
+
+WysChild *wys_child_spawn (const gchar * const *argv,
+                           WysChildExited       exited,
+                           WysChildOutput       output,
+                           gpointer             data);
+void      wys_child_stop  (WysChild            *child,
+                           WysChildReleased     released,
+                           gpointer             data);
+
+G_END_DECLS
+
+#endif /* WYS_CHILD_H__ */
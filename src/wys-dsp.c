@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "wys-dsp.h"
+#include "wys-kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define DEFAULT_Q          0.7071
+#define DEFAULT_RELEASE_MS 50.0
+
+
+typedef struct _Stage Stage;
+
+struct stage_type
+{
+  const gchar *name;
+  guint min_args;
+  guint max_args;
+  /** Set up from the stage's arguments, which have been parsed as
+   * numbers.  Returns %FALSE if they aren't valid. */
+  gboolean (*setup)   (Stage         *stage,
+                       const gdouble *args,
+                       guint          n_args,
+                       guint          rate);
+  void     (*reset)   (Stage         *stage);
+  void     (*process) (Stage         *stage,
+                       gfloat        *block,
+                       guint          frames);
+};
+
+struct _Stage
+{
+  const struct stage_type *type;
+  union
+  {
+    gfloat gain;
+    struct
+    {
+      gfloat b0, b1, b2, a1, a2;
+      gfloat z1, z2;
+    } biquad;
+    struct
+    {
+      gfloat threshold;
+      gfloat release;
+      gfloat envelope;
+    } limiter;
+  } u;
+};
+
+struct _WysDsp
+{
+  Stage *stages;
+  guint n_stages;
+  gfloat block[WYS_DSP_BLOCK_FRAMES];
+};
+
+
+static inline gfloat
+db_to_linear (gdouble db)
+{
+  return (gfloat)pow (10.0, db / 20.0);
+}
+
+
+/* gain DB */
+
+static gboolean
+gain_setup (Stage         *stage,
+            const gdouble *args,
+            guint          n_args,
+            guint          rate)
+{
+  stage->u.gain = db_to_linear (args[0]);
+  return TRUE;
+}
+
+
+static void
+gain_process (Stage  *stage,
+              gfloat *block,
+              guint   frames)
+{
+  const gfloat gain = stage->u.gain;
+  guint i;
+
+  for (i = 0; i < frames; ++i)
+    {
+      block[i] *= gain;
+    }
+}
+
+
+/* highpass HZ [Q] */
+
+static gboolean
+highpass_setup (Stage         *stage,
+                const gdouble *args,
+                guint          n_args,
+                guint          rate)
+{
+  const gdouble q = n_args > 1 ? args[1] : DEFAULT_Q;
+  gdouble w0, alpha, cosw0, a0;
+
+  if (args[0] <= 0.0 || args[0] >= rate / 2.0 || q <= 0.0)
+    {
+      return FALSE;
+    }
+
+  // From the Audio EQ Cookbook
+  w0 = 2.0 * G_PI * args[0] / rate;
+  cosw0 = cos (w0);
+  alpha = sin (w0) / (2.0 * q);
+  a0 = 1.0 + alpha;
+
+  stage->u.biquad.b0 = (1.0 + cosw0) / 2.0 / a0;
+  stage->u.biquad.b1 = -(1.0 + cosw0) / a0;
+  stage->u.biquad.b2 = (1.0 + cosw0) / 2.0 / a0;
+  stage->u.biquad.a1 = -2.0 * cosw0 / a0;
+  stage->u.biquad.a2 = (1.0 - alpha) / a0;
+
+  return TRUE;
+}
+
+
+static void
+biquad_reset (Stage *stage)
+{
+  stage->u.biquad.z1 = stage->u.biquad.z2 = 0.0f;
+}
+
+
+static void
+biquad_process (Stage  *stage,
+                gfloat *block,
+                guint   frames)
+{
+  const gfloat b0 = stage->u.biquad.b0, b1 = stage->u.biquad.b1;
+  const gfloat b2 = stage->u.biquad.b2, a1 = stage->u.biquad.a1;
+  const gfloat a2 = stage->u.biquad.a2;
+  gfloat z1 = stage->u.biquad.z1, z2 = stage->u.biquad.z2;
+  guint i;
+
+  // Transposed direct form II
+  for (i = 0; i < frames; ++i)
+    {
+      const gfloat x = block[i];
+      const gfloat y = b0 * x + z1;
+
+      z1 = b1 * x - a1 * y + z2;
+      z2 = b2 * x - a2 * y;
+      block[i] = y;
+    }
+
+  stage->u.biquad.z1 = z1;
+  stage->u.biquad.z2 = z2;
+}
+
+
+/* limiter THRESHOLD_DB [RELEASE_MS] */
+
+static gboolean
+limiter_setup (Stage         *stage,
+               const gdouble *args,
+               guint          n_args,
+               guint          rate)
+{
+  const gdouble release_ms = n_args > 1 ? args[1] : DEFAULT_RELEASE_MS;
+
+  if (args[0] > 0.0 || release_ms <= 0.0)
+    {
+      return FALSE;
+    }
+
+  stage->u.limiter.threshold = db_to_linear (args[0]);
+  // Decays by 1/e over the release time
+  stage->u.limiter.release = (gfloat)exp (-1000.0 / (release_ms * rate));
+
+  return TRUE;
+}
+
+
+static void
+limiter_reset (Stage *stage)
+{
+  stage->u.limiter.envelope = 0.0f;
+}
+
+
+static void
+limiter_process (Stage  *stage,
+                 gfloat *block,
+                 guint   frames)
+{
+  const gfloat threshold = stage->u.limiter.threshold;
+  const gfloat release = stage->u.limiter.release;
+  gfloat envelope = stage->u.limiter.envelope;
+  guint i;
+
+  // Instant attack, so nothing gets over the threshold
+  for (i = 0; i < frames; ++i)
+    {
+      const gfloat level = fabsf (block[i]);
+
+      envelope = MAX (level, envelope * release);
+      if (envelope > threshold)
+        {
+          block[i] *= threshold / envelope;
+        }
+    }
+
+  stage->u.limiter.envelope = envelope;
+}
+
+
+static const struct stage_type STAGE_TYPES[] =
+  {
+    { "gain", 1, 1, gain_setup, NULL, gain_process },
+    { "highpass", 1, 2, highpass_setup, biquad_reset, biquad_process },
+    { "limiter", 1, 2, limiter_setup, limiter_reset, limiter_process },
+  };
+
+
+static const struct stage_type *
+find_stage_type (const gchar *name)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (STAGE_TYPES); ++i)
+    {
+      if (g_strcmp0 (STAGE_TYPES[i].name, name) == 0)
+        {
+          return &STAGE_TYPES[i];
+        }
+    }
+
+  return NULL;
+}
+
+
+/** Set up @stage from a line such as "highpass 100" */
+static gboolean
+parse_stage (Stage       *stage,
+             const gchar *line,
+             guint        rate)
+{
+  g_auto(GStrv) words = NULL;
+  const struct stage_type *type;
+  gdouble args[2];
+  guint n_args = 0;
+  gchar **word, *end;
+
+  words = g_strsplit_set (line, " \t", -1);
+
+  type = find_stage_type (words[0]);
+  if (!type)
+    {
+      g_warning ("Unknown DSP stage `%s'", words[0]);
+      return FALSE;
+    }
+
+  for (word = words + 1; *word; ++word)
+    {
+      if (**word == '\0')
+        {
+          continue;
+        }
+
+      if (n_args == type->max_args)
+        {
+          g_warning ("Too many arguments for DSP stage `%s'", line);
+          return FALSE;
+        }
+
+      args[n_args] = g_ascii_strtod (*word, &end);
+      if (*end != '\0')
+        {
+          g_warning ("Invalid argument `%s' for DSP stage `%s'",
+                     *word, line);
+          return FALSE;
+        }
+      ++n_args;
+    }
+
+  if (n_args < type->min_args
+      || !type->setup (stage, args, n_args, rate))
+    {
+      g_warning ("Invalid arguments for DSP stage `%s'", line);
+      return FALSE;
+    }
+
+  stage->type = type;
+  return TRUE;
+}
+
+
+/**
+ * wys_dsp_new:
+ * @stages: (allow-none): stage descriptions, in processing order
+ * @rate: the sample rate
+ *
+ * Set up a chain of processing stages from descriptions such as
+ * "highpass 100", "gain -3" or "limiter -1 50".  Stages which can't
+ * be set up are left out with a warning.  Everything the chain needs
+ * is allocated here, so wys_dsp_process() never allocates or locks.
+ *
+ * Returns: (nullable): the chain, or %NULL if it would have no
+ * stages.
+ */
+WysDsp *
+wys_dsp_new (const gchar * const *stages,
+             guint                rate)
+{
+  WysDsp *self;
+  guint n, i;
+
+  n = stages ? g_strv_length ((gchar **)stages) : 0;
+  if (n == 0)
+    {
+      return NULL;
+    }
+
+  self = g_new0 (WysDsp, 1);
+  self->stages = g_new0 (Stage, n);
+
+  for (i = 0; i < n; ++i)
+    {
+      if (parse_stage (&self->stages[self->n_stages], stages[i], rate))
+        {
+          g_debug ("DSP stage %u: %s", self->n_stages, stages[i]);
+          ++self->n_stages;
+        }
+    }
+
+  if (self->n_stages == 0)
+    {
+      wys_dsp_free (self);
+      return NULL;
+    }
+
+  wys_dsp_reset (self);
+  return self;
+}
+
+
+void
+wys_dsp_free (WysDsp *self)
+{
+  g_free (self->stages);
+  g_free (self);
+}
+
+
+/** Forget the stages' state, for example after an xrun */
+void
+wys_dsp_reset (WysDsp *self)
+{
+  guint i;
+
+  for (i = 0; i < self->n_stages; ++i)
+    {
+      if (self->stages[i].type->reset)
+        {
+          self->stages[i].type->reset (&self->stages[i]);
+        }
+    }
+}
+
+
+/** Run mono S16 @frames through the chain, in place */
+void
+wys_dsp_process (WysDsp *self,
+                 gint16 *frames,
+                 gsize   n_frames)
+{
+  gsize done, n;
+  guint i;
+
+  for (done = 0; done < n_frames; done += n)
+    {
+      n = MIN (n_frames - done, WYS_DSP_BLOCK_FRAMES);
+
+      wys_kernel_s16_to_float (frames + done, self->block, n);
+      for (i = 0; i < self->n_stages; ++i)
+        {
+          self->stages[i].type->process (&self->stages[i], self->block, n);
+        }
+      wys_kernel_float_to_s16 (self->block, frames + done, n);
+    }
+}
@@ -0,0 +1,791 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#include "wys-echo.h"
+#include "wys-kernels.h"
+#include "wys-ring.h"
+
+#include <math.h>
+#include <string.h>
+
+/** Far-end audio the playing loop can get ahead of the capturing
+ * loop by, in frames */
+#define RING_FRAMES       (1 << 15)
+/** Frames converted at a time */
+#define CHUNK_FRAMES      256
+/** Frames per block, which is also the length of each partition of
+ * the filter; a power of two */
+#define BLOCK_SHIFT       7
+#define BLOCK_FRAMES      (1 << BLOCK_SHIFT)
+/** The transforms cover two blocks */
+#define FFT_FRAMES        (2 * BLOCK_FRAMES)
+/** Frequency bins of a transform of real audio, DC to Nyquist */
+#define BINS              (BLOCK_FRAMES + 1)
+/** Step size, before normalising by the reference's power in each
+ * bin */
+#define STEP_SIZE         0.5f
+/** Keeps the normalisation sane when the reference is near silent,
+ * as a power per bin */
+#define REGULARISATION    (FFT_FRAMES * 1e-5f)
+/** How quickly each bin's power estimate follows the reference */
+#define POWER_SMOOTHING   0.1f
+/** Near-end speech is assumed when the microphone is louder than this
+ * fraction of the recent reference peak, which the echo alone can't
+ * manage through a speaker and microphone with any coupling loss */
+#define DOUBLE_TALK_RATIO 1.0f
+/** How long adaptation stays frozen after near-end speech, in ms */
+#define DOUBLE_TALK_HOLD  30
+
+
+/*
+ * The echo is modelled by a partitioned-block frequency-domain
+ * adaptive filter: the filter is cut into partitions a block long,
+ * each applied by multiplying spectra in an overlap-save transform
+ * of two blocks' reference, and all of them adapted once a block
+ * from the spectrum of its error.  Spectra are arrays of BINS
+ * complex numbers, real and imaginary parts interleaved.
+ *
+ * Blocks are aligned on the timeline rather than to whatever the
+ * capturing loop passes in, so that the spectra of past blocks can be
+ * kept.  A block the capturing loop only has part of is cancelled
+ * with the reference it has so far, which is all its echo depends
+ * on, and adapted once the rest arrives.
+ */
+
+struct _WysEcho
+{
+  guint rate;
+  /** Adaptive filter length, in blocks */
+  guint partitions;
+
+  /** Far-end audio, in timeline order with any gaps filled with
+   * silence, from the loop playing it to the loop capturing the
+   * echo */
+  WysRing *ring;
+  /** Bumped by wys_echo_reset(), which each loop notices on its next
+   * call; accessed atomically */
+  gint generation;
+  /** Where the playing loop started the ring again after noticing
+   * start_generation: the timeline frame and the number of frames
+   * written to the ring before it.  start_generation is stored last
+   * and the others are read again if it changes meanwhile; all are
+   * accessed atomically. */
+  gint start_generation;
+  gint64 start_timeline;
+  guint64 start_written;
+
+  /** Only touched by the playing loop: */
+  gint write_generation;
+  /** The timeline frame the next frame written to the ring is for */
+  gint64 write_end;
+  /** Frames written to the ring altogether */
+  guint64 written;
+
+  /** Only touched by the capturing loop: */
+  gint read_generation;
+  /** The timeline frame the next frame read from the ring is for, or
+   * -1 before the playing loop has started the ring for
+   * read_generation */
+  gint64 read_end;
+  /** Frames taken from the ring altogether */
+  guint64 read;
+  /** The reference for the current block, preceded by the previous
+   * block, starting at timeline frame window_start.  Anything not
+   * read from the ring yet is silence. */
+  gfloat *window;
+  gsize window_frames;
+  gint64 window_start;
+
+  /** The current block, or -1 before the first */
+  gint64 block;
+  /** Each partition's weights */
+  gfloat *weights;
+  /** The reference spectra of the last partitions blocks, block b's
+   * at b % partitions */
+  gfloat *spectra;
+  /** The peak of each of those blocks' reference */
+  gfloat *peaks;
+  /** The echo of the current block from partitions other than the
+   * first, which only depends on earlier blocks */
+  gfloat rest[2 * BINS];
+  gboolean have_rest;
+  /** The reference's power in each bin */
+  gfloat power[BINS];
+  /** What was left of the current block's capture, for adapting */
+  gfloat error[BLOCK_FRAMES];
+  gboolean adapt;
+  guint hold;
+  /** The partition constrained to its length next */
+  guint constrain;
+
+  /** Twiddle factors for the complex transforms of half as many
+   * frames, each stage's together, the stage of size 2h's at h - 1;
+   * then for unpacking them into real transforms */
+  gfloat twiddles[2 * (BLOCK_FRAMES - 1)];
+  gfloat unpack[FFT_FRAMES];
+  guint8 reversed[BLOCK_FRAMES];
+  /** Scratch space for the transforms */
+  gfloat scratch[FFT_FRAMES];
+  gfloat spectrum[2 * BINS];
+  gfloat frames[FFT_FRAMES];
+};
+
+
+/**
+ * wys_echo_new:
+ * @rate: the sample rate of both directions
+ * @tail_ms: how long an echo path to model
+ *
+ * Create an acoustic echo canceller.  The loop playing far-end audio
+ * to the speaker feeds it with wys_echo_write_reference() and the
+ * loop capturing the microphone cancels the echo with
+ * wys_echo_cancel(), from another thread.  Both place frames on a
+ * common timeline, the time at which each one left the DAC or
+ * reached the ADC, so that the reference lines up with the echo to
+ * within the acoustic path and converter delays.
+ */
+WysEcho *
+wys_echo_new (guint rate,
+              guint tail_ms)
+{
+  WysEcho *self;
+  guint half, i, j;
+
+  self = g_new0 (WysEcho, 1);
+  self->rate = rate;
+  self->partitions = MAX (1, (rate * tail_ms / 1000 + BLOCK_FRAMES - 1)
+                          / BLOCK_FRAMES);
+  self->ring = wys_ring_new (sizeof (gfloat), RING_FRAMES);
+  self->start_generation = -1;
+  self->write_generation = -1;
+  self->read_generation = -1;
+  self->read_end = -1;
+  self->window_frames = FFT_FRAMES;
+  self->window = g_new0 (gfloat, self->window_frames);
+  self->block = -1;
+  self->weights = g_new0 (gfloat, self->partitions * 2 * BINS);
+  self->spectra = g_new0 (gfloat, self->partitions * 2 * BINS);
+  self->peaks = g_new0 (gfloat, self->partitions);
+
+  for (half = 1; half < BLOCK_FRAMES; half <<= 1)
+    {
+      gfloat *twiddles = self->twiddles + 2 * (half - 1);
+
+      for (i = 0; i < half; ++i)
+        {
+          twiddles[2 * i] = cos (-G_PI * i / half);
+          twiddles[2 * i + 1] = sin (-G_PI * i / half);
+        }
+    }
+  for (i = 0; i < BLOCK_FRAMES; ++i)
+    {
+      self->unpack[2 * i] = cos (-2 * G_PI * i / FFT_FRAMES);
+      self->unpack[2 * i + 1] = sin (-2 * G_PI * i / FFT_FRAMES);
+    }
+  for (i = 0; i < BLOCK_FRAMES; ++i)
+    {
+      for (j = 0; 1u << j < BLOCK_FRAMES; ++j)
+        {
+          self->reversed[i] |= ((i >> j) & 1) << (BLOCK_SHIFT - 1 - j);
+        }
+    }
+
+  return self;
+}
+
+
+void
+wys_echo_free (WysEcho *self)
+{
+  g_free (self->peaks);
+  g_free (self->spectra);
+  g_free (self->weights);
+  g_free (self->window);
+  wys_ring_free (self->ring);
+  g_free (self);
+}
+
+
+/**
+ * wys_echo_reset:
+ *
+ * Start afresh for a new call, forgetting the far-end audio and the
+ * echo path of the last one.  The loops may still be running; each
+ * notices on its next call to wys_echo_write_reference() or
+ * wys_echo_cancel().
+ */
+void
+wys_echo_reset (WysEcho *self)
+{
+  g_atomic_int_inc (&self->generation);
+}
+
+
+/** Convert a monotonic time to a timeline frame */
+gint64
+wys_echo_timeline (WysEcho *self,
+                   gint64   time_ns)
+{
+  return time_ns / 1000 * self->rate / G_USEC_PER_SEC;
+}
+
+
+/** Append @n_frames frames to the ring, or silence if @frames is
+ * %NULL.  Returns whether they all fitted. */
+static gboolean
+write_ring (WysEcho      *self,
+            const gint16 *frames,
+            gsize         n_frames)
+{
+  gfloat chunk[CHUNK_FRAMES];
+  gsize n, written;
+
+  if (!frames)
+    {
+      memset (chunk, 0, sizeof (chunk));
+    }
+
+  for (; n_frames > 0; n_frames -= n)
+    {
+      n = MIN (n_frames, CHUNK_FRAMES);
+      if (frames)
+        {
+          // The ring keeps floats so that the canceller can use it
+          // directly
+          wys_kernel_s16_to_float (frames, chunk, n);
+          frames += n;
+        }
+
+      written = wys_ring_write (self->ring, chunk, n);
+      self->write_end += written;
+      self->written += written;
+      if (written < n)
+        {
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+
+/**
+ * wys_echo_write_reference:
+ * @timeline: the timeline frame at which the first of @frames is
+ * played
+ *
+ * Record far-end audio sent to the speaker.  Only one thread may
+ * call this.
+ */
+void
+wys_echo_write_reference (WysEcho      *self,
+                          gint64        timeline,
+                          const gint16 *frames,
+                          gsize         n_frames)
+{
+  const gint generation = g_atomic_int_get (&self->generation);
+  gsize skip;
+
+  // Whatever is left in the ring is for the capturing loop to skip
+  if (generation != self->write_generation)
+    {
+      self->write_generation = generation;
+      self->write_end = timeline;
+      __atomic_store_n (&self->start_timeline, timeline, __ATOMIC_RELAXED);
+      __atomic_store_n (&self->start_written, self->written,
+                        __ATOMIC_RELAXED);
+      __atomic_store_n (&self->start_generation, generation,
+                        __ATOMIC_RELEASE);
+    }
+
+  // Anything skipped over was silence.  If the capturing loop has
+  // fallen so far behind that it doesn't fit, the frames are dropped
+  // and the gap is filled on the next call instead, keeping the ring
+  // in timeline order.
+  if (timeline > self->write_end
+      && !write_ring (self, NULL, timeline - self->write_end))
+    {
+      return;
+    }
+
+  // Anything written already stays as it was
+  skip = MIN ((gint64)n_frames, self->write_end - timeline);
+  write_ring (self, frames + skip, n_frames - skip);
+}
+
+
+/** Once the playing loop has started the ring for the current call,
+ * skip anything left from before and return %TRUE */
+static gboolean
+find_start (WysEcho *self)
+{
+  gint64 timeline;
+  guint64 written;
+
+  if (__atomic_load_n (&self->start_generation, __ATOMIC_ACQUIRE)
+      != self->read_generation)
+    {
+      return FALSE;
+    }
+
+  timeline = __atomic_load_n (&self->start_timeline, __ATOMIC_RELAXED);
+  written = __atomic_load_n (&self->start_written, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  // Started again meanwhile
+  if (__atomic_load_n (&self->start_generation, __ATOMIC_RELAXED)
+      != self->read_generation)
+    {
+      return FALSE;
+    }
+
+  self->read += wys_ring_skip (self->ring, written - self->read);
+  if (self->read != written)
+    {
+      return FALSE;
+    }
+
+  self->read_end = timeline;
+  return TRUE;
+}
+
+
+/** Move the reference window to start at timeline frame @start and
+ * fill it with whatever far-end audio has arrived for it */
+static void
+read_reference (WysEcho *self,
+                gint64   start)
+{
+  const gint64 delta = start - self->window_start;
+  const gint64 end = start + self->window_frames;
+  gsize n, got;
+
+  if (delta > 0 && delta < (gint64)self->window_frames)
+    {
+      memmove (self->window, self->window + delta,
+               (self->window_frames - delta) * sizeof (gfloat));
+      memset (self->window + self->window_frames - delta, 0,
+              delta * sizeof (gfloat));
+    }
+  else if (delta != 0)
+    {
+      memset (self->window, 0, self->window_frames * sizeof (gfloat));
+    }
+  self->window_start = start;
+
+  if (self->read_end < 0 && !find_start (self))
+    {
+      return;
+    }
+
+  // Frames older than the window are too late to be any use; those
+  // past its end stay in the ring for later blocks
+  while (self->read_end < end)
+    {
+      if (self->read_end < start)
+        {
+          n = start - self->read_end;
+          got = wys_ring_skip (self->ring, n);
+        }
+      else
+        {
+          n = end - self->read_end;
+          got = wys_ring_read (self->ring,
+                               self->window + (self->read_end - start), n);
+        }
+
+      self->read_end += got;
+      self->read += got;
+      if (got < n)
+        {
+          break;
+        }
+    }
+}
+
+
+/** Transform BLOCK_FRAMES complex numbers in @data in place */
+static void
+transform (WysEcho *self,
+           gfloat  *data)
+{
+  guint size, i, j;
+
+  for (i = 0; i < BLOCK_FRAMES; ++i)
+    {
+      j = self->reversed[i];
+      if (j > i)
+        {
+          const gfloat re = data[2 * i], im = data[2 * i + 1];
+
+          data[2 * i] = data[2 * j];
+          data[2 * i + 1] = data[2 * j + 1];
+          data[2 * j] = re;
+          data[2 * j + 1] = im;
+        }
+    }
+
+  for (size = 2; size <= BLOCK_FRAMES; size <<= 1)
+    {
+      const guint half = size / 2;
+
+      for (i = 0; i < BLOCK_FRAMES; i += size)
+        {
+          wys_kernel_butterfly_f32 (data + 2 * i, data + 2 * (i + half),
+                                    self->twiddles + 2 * (half - 1), half);
+        }
+    }
+}
+
+
+/** The twiddle factor for unpacking bin @k, e^(-2 pi i k / N) */
+static inline void
+unpack_twiddle (WysEcho *self,
+                guint    k,
+                gfloat  *wr,
+                gfloat  *wi)
+{
+  if (k < BLOCK_FRAMES)
+    {
+      *wr = self->unpack[2 * k];
+      *wi = self->unpack[2 * k + 1];
+    }
+  else
+    {
+      *wr = -1.0f;
+      *wi = 0.0f;
+    }
+}
+
+
+/** Work out the spectrum of FFT_FRAMES real frames, by transforming
+ * them as half as many complex numbers, even frames real and odd
+ * ones imaginary, and then pulling the two halves apart */
+static void
+forward (WysEcho      *self,
+         const gfloat *in,
+         gfloat       *out)
+{
+  gfloat *z = self->scratch;
+  guint k;
+
+  memcpy (z, in, FFT_FRAMES * sizeof (gfloat));
+  transform (self, z);
+
+  for (k = 0; k < BINS; ++k)
+    {
+      const guint a = k % BLOCK_FRAMES;
+      const guint b = (BLOCK_FRAMES - k) % BLOCK_FRAMES;
+      // The even frames' spectrum, and the odd frames'
+      const gfloat er = (z[2 * a] + z[2 * b]) / 2;
+      const gfloat ei = (z[2 * a + 1] - z[2 * b + 1]) / 2;
+      const gfloat or = (z[2 * a + 1] + z[2 * b + 1]) / 2;
+      const gfloat oi = (z[2 * b] - z[2 * a]) / 2;
+      gfloat wr, wi;
+
+      unpack_twiddle (self, k, &wr, &wi);
+      out[2 * k] = er + wr * or - wi * oi;
+      out[2 * k + 1] = ei + wr * oi + wi * or;
+    }
+}
+
+
+/** The reverse of forward() */
+static void
+inverse (WysEcho      *self,
+         const gfloat *in,
+         gfloat       *out)
+{
+  gfloat *z = self->scratch;
+  guint k;
+
+  for (k = 0; k < BLOCK_FRAMES; ++k)
+    {
+      const guint b = BLOCK_FRAMES - k;
+      const gfloat er = (in[2 * k] + in[2 * b]) / 2;
+      const gfloat ei = (in[2 * k + 1] - in[2 * b + 1]) / 2;
+      const gfloat dr = (in[2 * k] - in[2 * b]) / 2;
+      const gfloat di = (in[2 * k + 1] + in[2 * b + 1]) / 2;
+      gfloat wr, wi, or, oi;
+
+      // Undo the twiddle by multiplying by its conjugate
+      unpack_twiddle (self, k, &wr, &wi);
+      or = dr * wr + di * wi;
+      oi = di * wr - dr * wi;
+
+      // Conjugated, so that the forward transform does the inverse
+      z[2 * k] = er - oi;
+      z[2 * k + 1] = -(ei + or);
+    }
+
+  transform (self, z);
+
+  for (k = 0; k < BLOCK_FRAMES; ++k)
+    {
+      out[2 * k] = z[2 * k] / BLOCK_FRAMES;
+      out[2 * k + 1] = -z[2 * k + 1] / BLOCK_FRAMES;
+    }
+}
+
+
+static inline gfloat *
+partition (gfloat *spectra,
+           guint   p)
+{
+  return spectra + p * 2 * BINS;
+}
+
+
+/** Where block @block's spectrum and peak are kept */
+static inline guint
+slot (WysEcho *self,
+      gint64   block)
+{
+  const gint64 n = self->partitions;
+
+  return (block % n + n) % n;
+}
+
+
+/** The spectrum of block @block's reference */
+static inline gfloat *
+block_spectrum (WysEcho *self,
+                gint64   block)
+{
+  return partition (self->spectra, slot (self, block));
+}
+
+
+/** Forget everything about the reference but the filter itself, for
+ * when the capture timeline jumps to block @block */
+static void
+restart (WysEcho *self,
+         gint64   block)
+{
+  memset (self->spectra, 0,
+          self->partitions * 2 * BINS * sizeof (gfloat));
+  memset (self->peaks, 0, self->partitions * sizeof (gfloat));
+  memset (self->error, 0, sizeof (self->error));
+  self->have_rest = FALSE;
+  self->adapt = TRUE;
+  self->block = block;
+}
+
+
+/** Cancel the echo from @n_frames frames, @offset frames into the
+ * current block */
+static void
+cancel_part (WysEcho *self,
+             guint    offset,
+             gint16  *frames,
+             gsize    n_frames)
+{
+  const gint64 block = self->block;
+  const guint hold = self->rate * DOUBLE_TALK_HOLD / 1000;
+  gfloat *spectrum = block_spectrum (self, block);
+  gfloat *echo = self->frames + BLOCK_FRAMES + offset;
+  gfloat peak = 0.0f;
+  guint p;
+  gsize i;
+
+  read_reference (self, (block - 1) * BLOCK_FRAMES);
+  forward (self, self->window, spectrum);
+
+  // Earlier blocks don't change as the rest of this one arrives
+  if (!self->have_rest)
+    {
+      memset (self->rest, 0, sizeof (self->rest));
+      for (p = 1; p < self->partitions; ++p)
+        {
+          wys_kernel_cmac_f32 (partition (self->weights, p),
+                               block_spectrum (self, block - p),
+                               self->rest, BINS);
+        }
+      self->have_rest = TRUE;
+    }
+
+  memcpy (self->spectrum, self->rest, sizeof (self->spectrum));
+  wys_kernel_cmac_f32 (partition (self->weights, 0), spectrum,
+                       self->spectrum, BINS);
+  // The second half of the transform is the echo of the current
+  // block; the first half wrapped around
+  inverse (self, self->spectrum, self->frames);
+
+  for (p = 1; p < self->partitions; ++p)
+    {
+      peak = MAX (peak, self->peaks[slot (self, block - p)]);
+    }
+  for (i = 0; i < offset + n_frames; ++i)
+    {
+      peak = MAX (peak, fabsf (self->window[BLOCK_FRAMES + i]));
+    }
+
+  wys_kernel_s16_to_float (frames, self->scratch, n_frames);
+
+  for (i = 0; i < n_frames; ++i)
+    {
+      const gfloat mic = self->scratch[i];
+      const gfloat error = mic - echo[i];
+
+      if (fabsf (mic) > DOUBLE_TALK_RATIO * peak)
+        {
+          self->hold = hold;
+        }
+
+      if (self->hold > 0)
+        {
+          --self->hold;
+          self->adapt = FALSE;
+        }
+
+      self->error[offset + i] = error;
+      self->scratch[i] = error;
+    }
+
+  if (peak == 0.0f)
+    {
+      self->adapt = FALSE;
+    }
+
+  wys_kernel_float_to_s16 (self->scratch, frames, n_frames);
+}
+
+
+/** Adapt the filter to the error left in the current block, now that
+ * it's all here, and move on to the next */
+static void
+finish_block (WysEcho *self)
+{
+  const gint64 block = self->block;
+  const gfloat *spectrum = block_spectrum (self, block);
+  gfloat peak = 0.0f;
+  guint p, k;
+
+  for (k = 0; k < BLOCK_FRAMES; ++k)
+    {
+      peak = MAX (peak, fabsf (self->window[BLOCK_FRAMES + k]));
+    }
+  self->peaks[slot (self, block)] = peak;
+
+  for (k = 0; k < BINS; ++k)
+    {
+      const gfloat power = spectrum[2 * k] * spectrum[2 * k]
+        + spectrum[2 * k + 1] * spectrum[2 * k + 1];
+
+      self->power[k] += POWER_SMOOTHING * (power - self->power[k]);
+    }
+
+  if (self->adapt)
+    {
+      // The error's spectrum, lined up with the second half of the
+      // reference transform
+      memset (self->frames, 0, BLOCK_FRAMES * sizeof (gfloat));
+      memcpy (self->frames + BLOCK_FRAMES, self->error,
+              sizeof (self->error));
+      forward (self, self->frames, self->spectrum);
+
+      // Normalised by the reference's power over the whole filter
+      for (k = 0; k < BINS; ++k)
+        {
+          const gfloat step = STEP_SIZE
+            / (self->partitions * self->power[k] + REGULARISATION);
+
+          self->spectrum[2 * k] *= step;
+          self->spectrum[2 * k + 1] *= step;
+        }
+
+      for (p = 0; p < self->partitions; ++p)
+        {
+          const gfloat *x = block_spectrum (self, block - p);
+          gfloat *w = partition (self->weights, p);
+
+          // The correlation of the error with the reference
+          wys_kernel_cmac_conj_f32 (x, self->spectrum, w, BINS);
+        }
+
+      // Adapting in the frequency domain lets each partition grow
+      // past a block long, wrapping around; trimming them back is a
+      // pair of transforms each, so one is done a block
+      p = self->constrain;
+      self->constrain = (p + 1) % self->partitions;
+      inverse (self, partition (self->weights, p), self->frames);
+      memset (self->frames + BLOCK_FRAMES, 0,
+              BLOCK_FRAMES * sizeof (gfloat));
+      forward (self, self->frames, partition (self->weights, p));
+    }
+
+  memset (self->error, 0, sizeof (self->error));
+  self->have_rest = FALSE;
+  self->adapt = TRUE;
+  self->block = block + 1;
+}
+
+
+/**
+ * wys_echo_cancel:
+ * @timeline: the timeline frame at which the first of @frames was
+ * captured
+ *
+ * Remove the echo of the far-end audio from captured @frames, in
+ * place.  Only one thread may call this.
+ */
+void
+wys_echo_cancel (WysEcho *self,
+                 gint64   timeline,
+                 gint16  *frames,
+                 gsize    n_frames)
+{
+  const gint generation = g_atomic_int_get (&self->generation);
+  gsize offset, n;
+
+  // A new call, which may not even be through the same speaker
+  if (generation != self->read_generation)
+    {
+      self->read_generation = generation;
+      self->read_end = -1;
+      memset (self->weights, 0,
+              self->partitions * 2 * BINS * sizeof (gfloat));
+      memset (self->power, 0, sizeof (self->power));
+      self->block = -1;
+      self->hold = 0;
+    }
+
+  while (n_frames > 0)
+    {
+      const gint64 block = timeline >> BLOCK_SHIFT;
+
+      if (block != self->block)
+        {
+          restart (self, block);
+        }
+
+      offset = timeline - (block << BLOCK_SHIFT);
+      n = MIN (n_frames, BLOCK_FRAMES - offset);
+      cancel_part (self, offset, frames, n);
+      if (offset + n == BLOCK_FRAMES)
+        {
+          finish_block (self);
+        }
+
+      timeline += n;
+      frames += n;
+      n_frames -= n;
+    }
+}
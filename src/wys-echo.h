@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_ECHO_H__
+#define WYS_ECHO_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _WysEcho WysEcho;
+
+WysEcho *wys_echo_new             (guint         rate,
+                                   guint         tail_ms);
+void     wys_echo_free            (WysEcho      *self);
+void     wys_echo_reset           (WysEcho      *self);
+gint64   wys_echo_timeline        (WysEcho      *self,
+                                   gint64        time_ns);
+void     wys_echo_write_reference (WysEcho      *self,
+                                   gint64        timeline,
+                                   const gint16 *frames,
+                                   gsize         n_frames);
+void     wys_echo_cancel          (WysEcho      *self,
+                                   gint64        timeline,
+                                   gint16       *frames,
+                                   gsize         n_frames);
+
+G_END_DECLS
+
+#endif /* WYS_ECHO_H__ */
@@ -0,0 +1,472 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-engine.h"
+#include "wys-rt.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+/** Room for each loop's descriptors, more than any capture PCM
+ * needs to be polled */
+#define ENGINE_FDS_PER_LOOP 4
+
+
+/** Room for serving some number of loops: the loops themselves, how
+ * many descriptors each is polled with, and the descriptors for them
+ * all and the wakeup */
+struct slots
+{
+  WysLoop **loops;
+  guint *counts;
+  struct pollfd *fds;
+  guint size;
+};
+
+
+/** A change to the loops being served, handed to the engine's
+ * thread.  It lives on the stack of whoever asked for it until the
+ * thread has dealt with it. */
+struct command
+{
+  struct command *next;
+  WysLoop *loop;
+  gboolean add;
+  /** Bigger slots allocated by whoever is adding a loop, so the
+   * real-time thread never has to.  The thread swaps them for its own
+   * and hands those back to be freed. */
+  struct slots slots;
+  /** Set by the thread once it has dealt with the command, and
+   * whether it could */
+  gboolean done;
+  gboolean ok;
+};
+
+
+struct _WysEngine
+{
+  /** The loops being served and room for them; only touched by the
+   * engine's thread */
+  struct slots slots;
+  guint n_loops;
+  /** Loops being served or queued to be, and the most the thread's
+   * slots will have room for once the queue is done */
+  guint reserved;
+  guint promised;
+  /** Commands waiting for the thread, and whether there are any.  The
+   * lock only guards the queue, so it is never held while the thread
+   * is touching the PCMs. */
+  struct command *first;
+  struct command *last;
+  gint pending;
+  /** Set once the thread won't take any more commands */
+  gboolean exited;
+  GMutex lock;
+  /** Signalled when commands are done */
+  GCond done;
+  /** Written to interrupt the thread's poll */
+  int wakeup_fd;
+  /** Cleared to ask the thread to exit */
+  gint running;
+  pthread_t thread;
+};
+
+
+/** Carry out the queued commands, before preparing the loops, so that
+ * a removed loop isn't touched again */
+static void
+slots_init (struct slots *slots,
+            guint         size)
+{
+  slots->loops = g_new (WysLoop *, size);
+  slots->counts = g_new (guint, size);
+  slots->fds = g_new (struct pollfd, 1 + size * ENGINE_FDS_PER_LOOP);
+  slots->size = size;
+}
+
+
+static void
+slots_clear (struct slots *slots)
+{
+  g_free (slots->loops);
+  g_free (slots->counts);
+  g_free (slots->fds);
+  memset (slots, 0, sizeof (*slots));
+}
+
+
+/** Add a loop, moving to the command's slots first if they're bigger */
+static gboolean
+add_loop (WysEngine      *self,
+          struct command *command)
+{
+  struct slots old;
+
+  if (command->slots.size > self->slots.size)
+    {
+      memcpy (command->slots.loops, self->slots.loops,
+              self->n_loops * sizeof (WysLoop *));
+      old = self->slots;
+      self->slots = command->slots;
+      command->slots = old;
+    }
+
+  // run_command() made sure of room, but don't scribble if not
+  if (self->n_loops == self->slots.size)
+    {
+      return FALSE;
+    }
+
+  self->slots.loops[self->n_loops++] = command->loop;
+  return TRUE;
+}
+
+
+static gboolean
+remove_loop (WysEngine *self,
+             WysLoop   *loop)
+{
+  guint i;
+
+  for (i = 0; i < self->n_loops; ++i)
+    {
+      if (self->slots.loops[i] == loop)
+        {
+          memmove (self->slots.loops + i, self->slots.loops + i + 1,
+                   (--self->n_loops - i) * sizeof (WysLoop *));
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+
+static void
+take_commands (WysEngine *self)
+{
+  struct command *command;
+
+  if (!g_atomic_int_get (&self->pending))
+    {
+      return;
+    }
+
+  g_mutex_lock (&self->lock);
+  for (command = self->first; command; command = command->next)
+    {
+      if (command->add)
+        {
+          command->ok = add_loop (self, command);
+        }
+      else
+        {
+          command->ok = remove_loop (self, command->loop);
+        }
+      command->done = TRUE;
+    }
+  self->first = self->last = NULL;
+  g_atomic_int_set (&self->pending, FALSE);
+  g_cond_broadcast (&self->done);
+  g_mutex_unlock (&self->lock);
+}
+
+
+/** Let anyone waiting for a command know it won't be done */
+static void
+drop_commands (WysEngine *self)
+{
+  g_mutex_lock (&self->lock);
+  self->exited = TRUE;
+  self->first = self->last = NULL;
+  g_cond_broadcast (&self->done);
+  g_mutex_unlock (&self->lock);
+}
+
+
+static gpointer
+engine_thread (WysEngine *self)
+{
+  WysLoop **loops;
+  struct pollfd *fds;
+  guint *counts;
+  guint fds_size, n_loops, n_fds, offset, i;
+  gint64 deadline, now;
+  int timeout;
+  guint64 value;
+
+  wys_rt_make_realtime ("audio engine");
+
+  while (g_atomic_int_get (&self->running))
+    {
+      take_commands (self);
+      loops = self->slots.loops;
+      counts = self->slots.counts;
+      fds = self->slots.fds;
+      fds_size = 1 + self->slots.size * ENGINE_FDS_PER_LOOP;
+
+      fds[0].fd = self->wakeup_fd;
+      fds[0].events = POLLIN;
+      n_fds = 1;
+      deadline = G_MAXINT64;
+
+      // Starting the streams can block, which is why only this thread
+      // touches the loops and no lock is held here
+      n_loops = self->n_loops;
+      for (i = 0; i < n_loops; ++i)
+        {
+          counts[i] = wys_loop_engine_prepare
+            (loops[i], fds + n_fds, fds_size - n_fds, &deadline);
+          n_fds += counts[i];
+        }
+
+      // Nothing but a wakeup gets us out of here while no loop is
+      // streaming, so an idle engine costs nothing.  Timer scheduled
+      // loops have no descriptors, just a deadline, which we round up
+      // so as not to wake before it.
+      timeout = -1;
+      if (deadline != G_MAXINT64)
+        {
+          now = g_get_monotonic_time ();
+          timeout = deadline > now ? (deadline - now + 999) / 1000 : 0;
+        }
+
+      if (poll (fds, n_fds, timeout) < 0)
+        {
+          if (errno != EINTR)
+            {
+              g_warning ("Error polling for audio: %s", g_strerror (errno));
+              break;
+            }
+          continue;
+        }
+
+      if (fds[0].revents & POLLIN)
+        {
+          if (read (self->wakeup_fd, &value, sizeof (value)) < 0)
+            {
+              g_debug ("Error clearing engine wakeup: %s",
+                       g_strerror (errno));
+            }
+        }
+
+      // Loops added or removed while we were polling wait for the
+      // next time round
+      for (i = 0, offset = 1; i < n_loops; offset += counts[i++])
+        {
+          wys_loop_engine_dispatch (loops[i], fds + offset, counts[i]);
+        }
+    }
+
+  drop_commands (self);
+  return NULL;
+}
+
+
+/** Have the engine's thread carry out a command and wait for it.
+ * Returns %FALSE if it couldn't or the thread has gone. */
+static gboolean
+run_command (WysEngine *self,
+             WysLoop   *loop,
+             gboolean   add)
+{
+  struct command command = { NULL, loop, add };
+  guint size;
+
+  g_mutex_lock (&self->lock);
+  for (;;)
+    {
+      if (self->exited)
+        {
+          g_mutex_unlock (&self->lock);
+          slots_clear (&command.slots);
+          return FALSE;
+        }
+
+      // Make sure the thread will have room for the loop by the time
+      // it gets to the command, allocating outside the lock, which
+      // the thread takes, and checking again after
+      if (!add
+          || self->reserved < self->promised
+          || self->reserved < command.slots.size)
+        {
+          break;
+        }
+
+      size = 2 * (self->reserved + 1);
+      g_mutex_unlock (&self->lock);
+      slots_clear (&command.slots);
+      slots_init (&command.slots, size);
+      g_mutex_lock (&self->lock);
+    }
+
+  if (add)
+    {
+      self->reserved++;
+      self->promised = MAX (self->promised, command.slots.size);
+    }
+
+  if (self->last)
+    {
+      self->last->next = &command;
+    }
+  else
+    {
+      self->first = &command;
+    }
+  self->last = &command;
+  g_atomic_int_set (&self->pending, TRUE);
+  g_mutex_unlock (&self->lock);
+
+  wys_engine_wake (self);
+
+  g_mutex_lock (&self->lock);
+  while (!command.done && !self->exited)
+    {
+      g_cond_wait (&self->done, &self->lock);
+    }
+  // Removing a loop that was never added is a no-op, so only count
+  // what the thread actually did
+  if (command.done && add != command.ok)
+    {
+      self->reserved--;
+    }
+  g_mutex_unlock (&self->lock);
+
+  // Either ours, unused, or the thread's old ones
+  slots_clear (&command.slots);
+
+  return command.ok;
+}
+
+
+/**
+ * wys_engine_new:
+ *
+ * Create an engine which moves the audio for any number of loops,
+ * both directions of a call or several calls, from a single
+ * real-time thread polling all of their PCMs.  That saves the
+ * wakeups and context switches of a thread per loop.
+ *
+ * Returns: (nullable): the engine, or %NULL if its thread couldn't be
+ * created
+ */
+WysEngine *
+wys_engine_new (void)
+{
+  WysEngine *self;
+  int err;
+
+  self = g_new0 (WysEngine, 1);
+  slots_init (&self->slots, 2);
+  self->promised = self->slots.size;
+  g_mutex_init (&self->lock);
+  g_cond_init (&self->done);
+  self->running = TRUE;
+
+  self->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (self->wakeup_fd == -1)
+    {
+      g_warning ("Error creating audio engine wakeup: %s",
+                 g_strerror (errno));
+      goto fail;
+    }
+
+  err = wys_rt_spawn (&self->thread,
+                      (gpointer (*) (gpointer)) engine_thread, self);
+  if (err != 0)
+    {
+      g_warning ("Error creating audio engine thread: %s",
+                 g_strerror (err));
+      close (self->wakeup_fd);
+      goto fail;
+    }
+
+  return self;
+
+ fail:
+  g_cond_clear (&self->done);
+  g_mutex_clear (&self->lock);
+  slots_clear (&self->slots);
+  g_free (self);
+  return NULL;
+}
+
+
+/** All loops must have been freed first */
+void
+wys_engine_free (WysEngine *self)
+{
+  g_atomic_int_set (&self->running, FALSE);
+  wys_engine_wake (self);
+  pthread_join (self->thread, NULL);
+  g_warn_if_fail (self->n_loops == 0);
+
+  close (self->wakeup_fd);
+  g_cond_clear (&self->done);
+  g_mutex_clear (&self->lock);
+  slots_clear (&self->slots);
+  g_free (self);
+}
+
+
+/**
+ * wys_engine_add:
+ *
+ * Start serving @loop, whose PCMs must be open.  Called by the loop.
+ *
+ * Returns: %FALSE if the engine's thread has gone
+ */
+gboolean
+wys_engine_add (WysEngine *self,
+                WysLoop   *loop)
+{
+  return run_command (self, loop, TRUE);
+}
+
+
+/** Stop serving @loop.  Once this returns, the engine's thread won't
+ * touch it again. */
+void
+wys_engine_remove (WysEngine *self,
+                   WysLoop   *loop)
+{
+  run_command (self, loop, FALSE);
+}
+
+
+/** Have the engine look at its loops again, say because one has been
+ * started or stopped */
+void
+wys_engine_wake (WysEngine *self)
+{
+  const guint64 value = 1;
+
+  if (write (self->wakeup_fd, &value, sizeof (value)) < 0
+      && errno != EAGAIN)
+    {
+      g_debug ("Error waking audio engine: %s", g_strerror (errno));
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_ENGINE_H__
+#define WYS_ENGINE_H__
+
+#include "wys-loop.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+WysEngine *wys_engine_new    (void);
+void       wys_engine_free   (WysEngine *engine);
+gboolean   wys_engine_add    (WysEngine *engine,
+                              WysLoop   *loop);
+void       wys_engine_remove (WysEngine *engine,
+                              WysLoop   *loop);
+void       wys_engine_wake   (WysEngine *engine);
+
+G_END_DECLS
+
+#endif /* WYS_ENGINE_H__ */
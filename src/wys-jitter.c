@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "wys-jitter.h"
+
+/** How long the queue must stay comfortably deep before the target
+ * is lowered */
+#define QUIET_WINDOW_US   (5 * G_USEC_PER_SEC)
+/** How much the target is lowered by at a time */
+#define STEP_US           1000
+/** How close to empty the playback queue may get */
+#define SAFETY_US         2000
+/** Weight kept by the wakeup lateness peak on each update */
+#define JITTER_DECAY      0.999
+
+#define US_TO_FRAMES(self, us) ((guint)((guint64)(self)->rate * (us) / G_USEC_PER_SEC))
+
+
+struct _WysJitter
+{
+  guint rate;
+  guint period;
+  guint min_depth;
+  guint max_depth;
+  /** The playback queue depth to aim for, in frames */
+  guint target;
+  /** Decaying peak of how late the capture side is serviced, in
+   * frames */
+  gdouble jitter;
+  /** The least queued on the playback side in this window */
+  guint window_low;
+  gint64 window_start;
+};
+
+
+/**
+ * wys_jitter_new:
+ * @rate: the sample rate
+ * @period: the period size, in frames
+ * @min_depth: the lowest target, in frames
+ * @max_depth: the highest target, in frames
+ * @initial_depth: the target to begin with, in frames
+ *
+ * Create a tracker which picks the playback queue depth for a
+ * loopback.  The target is raised as soon as wakeups get later or the
+ * queue gets too close to running dry, and lowered a little at a
+ * time once it has had room to spare for a while.
+ */
+WysJitter *
+wys_jitter_new (guint rate,
+                guint period,
+                guint min_depth,
+                guint max_depth,
+                guint initial_depth)
+{
+  WysJitter *self;
+
+  self = g_new0 (WysJitter, 1);
+  self->rate = rate;
+  self->period = period;
+  self->min_depth = min_depth;
+  self->max_depth = MAX (min_depth, max_depth);
+  self->target = CLAMP (initial_depth, self->min_depth, self->max_depth);
+  self->window_low = G_MAXUINT;
+
+  return self;
+}
+
+
+void
+wys_jitter_free (WysJitter *self)
+{
+  g_free (self);
+}
+
+
+static void
+restart_window (WysJitter *self,
+                gint64     time_us)
+{
+  self->window_low = G_MAXUINT;
+  self->window_start = time_us;
+}
+
+
+/* Runs on the loop's thread, so changes aren't logged; the loop
+ * publishes the target each period with wys_stats_target(), which
+ * counts the changes */
+static void
+set_target (WysJitter *self,
+            guint      target)
+{
+  self->target = CLAMP (target, self->min_depth, self->max_depth);
+}
+
+
+/**
+ * wys_jitter_update:
+ * @time_us: the monotonic time now
+ * @lateness: how many frames more than a period the capture side had
+ * available on waking up
+ * @low_water: how many frames were still queued on the playback side
+ * on waking up, before it was refilled
+ *
+ * Feed the state of one wakeup of the loopback.
+ */
+void
+wys_jitter_update (WysJitter *self,
+                   gint64     time_us,
+                   guint      lateness,
+                   guint      low_water)
+{
+  const guint safety = US_TO_FRAMES (self, SAFETY_US);
+  const guint step = US_TO_FRAMES (self, STEP_US);
+  guint floor;
+
+  if (lateness > self->jitter)
+    {
+      self->jitter = lateness;
+    }
+  else
+    {
+      self->jitter *= JITTER_DECAY;
+    }
+
+  // The queue has to last a period plus however late we may be
+  floor = self->period + (guint)(2.0 * self->jitter) + safety;
+
+  if (self->window_start == 0)
+    {
+      restart_window (self, time_us);
+    }
+
+  if (low_water < safety)
+    {
+      // The queue nearly ran dry
+      set_target (self, self->target + (safety - low_water) + step);
+      restart_window (self, time_us);
+      return;
+    }
+
+  if (self->target < floor)
+    {
+      // Wakeups got later
+      set_target (self, floor);
+      restart_window (self, time_us);
+      return;
+    }
+
+  self->window_low = MIN (self->window_low, low_water);
+
+  if (time_us - self->window_start < QUIET_WINDOW_US)
+    {
+      return;
+    }
+
+  // Only come down when there was clearly room to, so that the
+  // target doesn't flap around the edge
+  if (self->window_low >= safety + 2 * step
+      && self->target >= floor + step)
+    {
+      set_target (self, self->target - step);
+    }
+
+  restart_window (self, time_us);
+}
+
+
+/** Note that the playback side ran dry or the capture side overran */
+void
+wys_jitter_xrun (WysJitter *self,
+                 gint64     time_us)
+{
+  set_target (self, self->target + self->period);
+  restart_window (self, time_us);
+}
+
+
+/** The playback queue depth to aim for, in frames */
+guint
+wys_jitter_get_target (WysJitter *self)
+{
+  return self->target;
+}
+
+
+/** The current peak wakeup lateness, in frames */
+guint
+wys_jitter_get_jitter (WysJitter *self)
+{
+  return (guint)self->jitter;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_JITTER_H__
+#define WYS_JITTER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _WysJitter WysJitter;
+
+WysJitter *wys_jitter_new        (guint      rate,
+                                  guint      period,
+                                  guint      min_depth,
+                                  guint      max_depth,
+                                  guint      initial_depth);
+void       wys_jitter_free       (WysJitter *self);
+void       wys_jitter_update     (WysJitter *self,
+                                  gint64     time_us,
+                                  guint      lateness,
+                                  guint      low_water);
+void       wys_jitter_xrun       (WysJitter *self,
+                                  gint64     time_us);
+guint      wys_jitter_get_target (WysJitter *self);
+guint      wys_jitter_get_jitter (WysJitter *self);
+
+G_END_DECLS
+
+#endif /* WYS_JITTER_H__ */
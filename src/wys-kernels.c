@@ -0,0 +1,844 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "wys-kernels.h"
+
+#include <math.h>
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+# define KERNEL_ISA "sse2"
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+# define KERNEL_ISA "neon"
+#else
+# define KERNEL_ISA "scalar"
+#endif
+
+#define S16_SCALE 32768.0f
+
+
+/* Reference implementations */
+
+void
+wys_kernel_s32_to_s16_ref (const gint32 *in,
+                           gint16       *out,
+                           gsize         samples)
+{
+  gsize i;
+
+  for (i = 0; i < samples; ++i)
+    {
+      out[i] = (gint16)(in[i] >> 16);
+    }
+}
+
+
+void
+wys_kernel_s16_to_s32_ref (const gint16 *in,
+                           gint32       *out,
+                           gsize         samples)
+{
+  gsize i;
+
+  for (i = 0; i < samples; ++i)
+    {
+      out[i] = (gint32)((guint32)(guint16)in[i] << 16);
+    }
+}
+
+
+void
+wys_kernel_float_to_s16_ref (const gfloat *in,
+                             gint16       *out,
+                             gsize         samples)
+{
+  gsize i;
+
+  for (i = 0; i < samples; ++i)
+    {
+      const gfloat v = CLAMP (in[i] * S16_SCALE, -32768.0f, 32767.0f);
+
+      // Rounds to nearest even, like the vector conversions
+      out[i] = (gint16)lrintf (v);
+    }
+}
+
+
+void
+wys_kernel_s16_to_float_ref (const gint16 *in,
+                             gfloat       *out,
+                             gsize         samples)
+{
+  gsize i;
+
+  for (i = 0; i < samples; ++i)
+    {
+      out[i] = in[i] * (1.0f / S16_SCALE);
+    }
+}
+
+
+/** Averages the channels, rounding down */
+void
+wys_kernel_downmix_s16_ref (const gint16 *in,
+                            guint         channels,
+                            gint16       *out,
+                            gsize         frames)
+{
+  const gint32 n = channels;
+  gsize i;
+  guint c;
+
+  for (i = 0; i < frames; ++i)
+    {
+      gint32 sum = 0;
+
+      for (c = 0; c < channels; ++c)
+        {
+          sum += in[i * channels + c];
+        }
+
+      out[i] = (gint16)((sum < 0 ? sum - (n - 1) : sum) / n);
+    }
+}
+
+
+/** Copies each sample to every channel */
+void
+wys_kernel_upmix_s16_ref (const gint16 *in,
+                          gint16       *out,
+                          guint         channels,
+                          gsize         frames)
+{
+  gsize i;
+  guint c;
+
+  for (i = 0; i < frames; ++i)
+    {
+      for (c = 0; c < channels; ++c)
+        {
+          out[i * channels + c] = in[i];
+        }
+    }
+}
+
+
+/** The dot product without saturating, for the vector versions to
+ * finish off with */
+static inline gint64
+dot_s16_wide (const gint16 *a,
+              const gint16 *b,
+              gsize         n)
+{
+  gint64 sum = 0;
+  gsize i;
+
+  for (i = 0; i < n; ++i)
+    {
+      sum += (gint32)a[i] * b[i];
+    }
+
+  return sum;
+}
+
+
+static inline gint32
+saturate_s32 (gint64 v)
+{
+  return (gint32)CLAMP (v, G_MININT32, G_MAXINT32);
+}
+
+
+/** Sums in 64 bits, saturating the result to 32 */
+gint32
+wys_kernel_dot_s16_ref (const gint16 *a,
+                        const gint16 *b,
+                        gsize         n)
+{
+  return saturate_s32 (dot_s16_wide (a, b, n));
+}
+
+
+/** acc += a * b, over n interleaved complex numbers */
+void
+wys_kernel_cmac_f32_ref (const gfloat *a,
+                         const gfloat *b,
+                         gfloat       *acc,
+                         gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i < 2 * n; i += 2)
+    {
+      acc[i] += a[i] * b[i] - a[i + 1] * b[i + 1];
+      acc[i + 1] += a[i] * b[i + 1] + a[i + 1] * b[i];
+    }
+}
+
+
+/** acc += conj(a) * b, over n interleaved complex numbers */
+void
+wys_kernel_cmac_conj_f32_ref (const gfloat *a,
+                              const gfloat *b,
+                              gfloat       *acc,
+                              gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i < 2 * n; i += 2)
+    {
+      acc[i] += a[i] * b[i] + a[i + 1] * b[i + 1];
+      acc[i + 1] += a[i] * b[i + 1] - a[i + 1] * b[i];
+    }
+}
+
+
+/** Radix-2 butterflies: t = b * w, then b = a - t and a = a + t */
+void
+wys_kernel_butterfly_f32_ref (gfloat       *a,
+                              gfloat       *b,
+                              const gfloat *w,
+                              gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i < 2 * n; i += 2)
+    {
+      const gfloat re = b[i] * w[i] - b[i + 1] * w[i + 1];
+      const gfloat im = b[i] * w[i + 1] + b[i + 1] * w[i];
+
+      b[i] = a[i] - re;
+      b[i + 1] = a[i + 1] - im;
+      a[i] += re;
+      a[i + 1] += im;
+    }
+}
+
+
+#if defined(__SSE2__)
+
+void
+wys_kernel_s32_to_s16 (const gint32 *in,
+                       gint16       *out,
+                       gsize         samples)
+{
+  gsize i;
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      const __m128i a = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i *)(in + i)), 16);
+      const __m128i b = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i *)(in + i + 4)), 16);
+
+      _mm_storeu_si128 ((__m128i *)(out + i), _mm_packs_epi32 (a, b));
+    }
+
+  wys_kernel_s32_to_s16_ref (in + i, out + i, samples - i);
+}
+
+
+void
+wys_kernel_s16_to_s32 (const gint16 *in,
+                       gint32       *out,
+                       gsize         samples)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  gsize i;
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      const __m128i v = _mm_loadu_si128 ((const __m128i *)(in + i));
+
+      _mm_storeu_si128 ((__m128i *)(out + i), _mm_unpacklo_epi16 (zero, v));
+      _mm_storeu_si128 ((__m128i *)(out + i + 4), _mm_unpackhi_epi16 (zero, v));
+    }
+
+  wys_kernel_s16_to_s32_ref (in + i, out + i, samples - i);
+}
+
+
+void
+wys_kernel_float_to_s16 (const gfloat *in,
+                         gint16       *out,
+                         gsize         samples)
+{
+  const __m128 scale = _mm_set1_ps (S16_SCALE);
+  const __m128 lo = _mm_set1_ps (-32768.0f);
+  const __m128 hi = _mm_set1_ps (32767.0f);
+  gsize i;
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      __m128 a = _mm_mul_ps (_mm_loadu_ps (in + i), scale);
+      __m128 b = _mm_mul_ps (_mm_loadu_ps (in + i + 4), scale);
+
+      a = _mm_min_ps (_mm_max_ps (a, lo), hi);
+      b = _mm_min_ps (_mm_max_ps (b, lo), hi);
+      _mm_storeu_si128 ((__m128i *)(out + i),
+                        _mm_packs_epi32 (_mm_cvtps_epi32 (a),
+                                         _mm_cvtps_epi32 (b)));
+    }
+
+  wys_kernel_float_to_s16_ref (in + i, out + i, samples - i);
+}
+
+
+void
+wys_kernel_s16_to_float (const gint16 *in,
+                         gfloat       *out,
+                         gsize         samples)
+{
+  const __m128 scale = _mm_set1_ps (1.0f / S16_SCALE);
+  gsize i;
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      const __m128i v = _mm_loadu_si128 ((const __m128i *)(in + i));
+      // Sign-extend by putting each sample in the top half
+      const __m128i a = _mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16);
+      const __m128i b = _mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16);
+
+      _mm_storeu_ps (out + i, _mm_mul_ps (_mm_cvtepi32_ps (a), scale));
+      _mm_storeu_ps (out + i + 4, _mm_mul_ps (_mm_cvtepi32_ps (b), scale));
+    }
+
+  wys_kernel_s16_to_float_ref (in + i, out + i, samples - i);
+}
+
+
+void
+wys_kernel_downmix_s16 (const gint16 *in,
+                        guint         channels,
+                        gint16       *out,
+                        gsize         frames)
+{
+  const __m128i ones = _mm_set1_epi16 (1);
+  gsize i = 0;
+
+  if (channels == 2)
+    {
+      for (; i + 8 <= frames; i += 8)
+        {
+          const __m128i a = _mm_loadu_si128 ((const __m128i *)(in + 2 * i));
+          const __m128i b = _mm_loadu_si128 ((const __m128i *)(in + 2 * i + 8));
+          // Sum each left and right pair into 32 bits
+          const __m128i sa = _mm_srai_epi32 (_mm_madd_epi16 (a, ones), 1);
+          const __m128i sb = _mm_srai_epi32 (_mm_madd_epi16 (b, ones), 1);
+
+          _mm_storeu_si128 ((__m128i *)(out + i), _mm_packs_epi32 (sa, sb));
+        }
+    }
+
+  wys_kernel_downmix_s16_ref (in + i * channels, channels, out + i, frames - i);
+}
+
+
+void
+wys_kernel_upmix_s16 (const gint16 *in,
+                      gint16       *out,
+                      guint         channels,
+                      gsize         frames)
+{
+  gsize i = 0;
+
+  if (channels == 2)
+    {
+      for (; i + 8 <= frames; i += 8)
+        {
+          const __m128i v = _mm_loadu_si128 ((const __m128i *)(in + i));
+
+          _mm_storeu_si128 ((__m128i *)(out + 2 * i), _mm_unpacklo_epi16 (v, v));
+          _mm_storeu_si128 ((__m128i *)(out + 2 * i + 8), _mm_unpackhi_epi16 (v, v));
+        }
+    }
+
+  wys_kernel_upmix_s16_ref (in + i, out + i * channels, channels, frames - i);
+}
+
+
+/** Add the four sums of pairs of products from _mm_madd_epi16 in @v
+ * to the two 64-bit lanes of @acc */
+static inline __m128i
+add_wide (__m128i acc,
+          __m128i v)
+{
+  // The only sum that overflows is 2^31, from four -32768s, which
+  // wraps to -2^31; nothing else comes out that low, so it is taken
+  // as positive
+  const __m128i wrapped = _mm_cmpeq_epi32 (v, _mm_set1_epi32 (G_MININT32));
+  const __m128i sign = _mm_sub_epi32 (_mm_srai_epi32 (v, 31), wrapped);
+
+  acc = _mm_add_epi64 (acc, _mm_unpacklo_epi32 (v, sign));
+  return _mm_add_epi64 (acc, _mm_unpackhi_epi32 (v, sign));
+}
+
+
+gint32
+wys_kernel_dot_s16 (const gint16 *a,
+                    const gint16 *b,
+                    gsize         n)
+{
+  __m128i acc = _mm_setzero_si128 ();
+  gint64 lanes[2];
+  gsize i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      acc = add_wide (acc,
+                      _mm_madd_epi16 (_mm_loadu_si128 ((const __m128i *)(a + i)),
+                                      _mm_loadu_si128 ((const __m128i *)(b + i))));
+    }
+
+  _mm_storeu_si128 ((__m128i *)lanes, acc);
+  return saturate_s32 (lanes[0] + lanes[1]
+                       + dot_s16_wide (a + i, b + i, n - i));
+}
+
+
+/*
+ * Multiplies the two complex numbers in each of a and b, conjugating
+ * a first if asked.  The real and imaginary parts are interleaved.
+ */
+static inline __m128
+complex_mul (__m128   a,
+             __m128   b,
+             gboolean conj)
+{
+  // Negates the odd lanes, or the even ones for the conjugate
+  const __m128 odd = _mm_castsi128_ps (_mm_set_epi32 ((gint)0x80000000, 0,
+                                                      (gint)0x80000000, 0));
+  const __m128 even = _mm_castsi128_ps (_mm_set_epi32 (0, (gint)0x80000000,
+                                                       0, (gint)0x80000000));
+  const __m128 re = _mm_shuffle_ps (a, a, _MM_SHUFFLE (2, 2, 0, 0));
+  const __m128 im = _mm_shuffle_ps (a, a, _MM_SHUFFLE (3, 3, 1, 1));
+  const __m128 swapped = _mm_shuffle_ps (b, b, _MM_SHUFFLE (2, 3, 0, 1));
+  const __m128 cross = _mm_mul_ps (im, swapped);
+
+  if (conj)
+    {
+      return _mm_add_ps (_mm_mul_ps (re, b), _mm_xor_ps (cross, odd));
+    }
+  else
+    {
+      return _mm_add_ps (_mm_mul_ps (re, b), _mm_xor_ps (cross, even));
+    }
+}
+
+
+void
+wys_kernel_cmac_f32 (const gfloat *a,
+                     const gfloat *b,
+                     gfloat       *acc,
+                     gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i + 2 <= n; i += 2)
+    {
+      const __m128 p = complex_mul (_mm_loadu_ps (a + 2 * i),
+                                    _mm_loadu_ps (b + 2 * i), FALSE);
+
+      _mm_storeu_ps (acc + 2 * i, _mm_add_ps (_mm_loadu_ps (acc + 2 * i), p));
+    }
+
+  wys_kernel_cmac_f32_ref (a + 2 * i, b + 2 * i, acc + 2 * i, n - i);
+}
+
+
+void
+wys_kernel_cmac_conj_f32 (const gfloat *a,
+                          const gfloat *b,
+                          gfloat       *acc,
+                          gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i + 2 <= n; i += 2)
+    {
+      const __m128 p = complex_mul (_mm_loadu_ps (a + 2 * i),
+                                    _mm_loadu_ps (b + 2 * i), TRUE);
+
+      _mm_storeu_ps (acc + 2 * i, _mm_add_ps (_mm_loadu_ps (acc + 2 * i), p));
+    }
+
+  wys_kernel_cmac_conj_f32_ref (a + 2 * i, b + 2 * i, acc + 2 * i, n - i);
+}
+
+
+void
+wys_kernel_butterfly_f32 (gfloat       *a,
+                          gfloat       *b,
+                          const gfloat *w,
+                          gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i + 2 <= n; i += 2)
+    {
+      const __m128 va = _mm_loadu_ps (a + 2 * i);
+      const __m128 t = complex_mul (_mm_loadu_ps (w + 2 * i),
+                                    _mm_loadu_ps (b + 2 * i), FALSE);
+
+      _mm_storeu_ps (b + 2 * i, _mm_sub_ps (va, t));
+      _mm_storeu_ps (a + 2 * i, _mm_add_ps (va, t));
+    }
+
+  wys_kernel_butterfly_f32_ref (a + 2 * i, b + 2 * i, w + 2 * i, n - i);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+void
+wys_kernel_s32_to_s16 (const gint32 *in,
+                       gint16       *out,
+                       gsize         samples)
+{
+  gsize i;
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      vst1q_s16 (out + i,
+                 vcombine_s16 (vshrn_n_s32 (vld1q_s32 (in + i), 16),
+                               vshrn_n_s32 (vld1q_s32 (in + i + 4), 16)));
+    }
+
+  wys_kernel_s32_to_s16_ref (in + i, out + i, samples - i);
+}
+
+
+void
+wys_kernel_s16_to_s32 (const gint16 *in,
+                       gint32       *out,
+                       gsize         samples)
+{
+  gsize i;
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      const int16x8_t v = vld1q_s16 (in + i);
+
+      vst1q_s32 (out + i, vshll_n_s16 (vget_low_s16 (v), 16));
+      vst1q_s32 (out + i + 4, vshll_n_s16 (vget_high_s16 (v), 16));
+    }
+
+  wys_kernel_s16_to_s32_ref (in + i, out + i, samples - i);
+}
+
+
+void
+wys_kernel_float_to_s16 (const gfloat *in,
+                         gint16       *out,
+                         gsize         samples)
+{
+  const float32x4_t lo = vdupq_n_f32 (-32768.0f);
+  const float32x4_t hi = vdupq_n_f32 (32767.0f);
+  gsize i;
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      float32x4_t a = vmulq_n_f32 (vld1q_f32 (in + i), S16_SCALE);
+      float32x4_t b = vmulq_n_f32 (vld1q_f32 (in + i + 4), S16_SCALE);
+
+      a = vminq_f32 (vmaxq_f32 (a, lo), hi);
+      b = vminq_f32 (vmaxq_f32 (b, lo), hi);
+      vst1q_s16 (out + i,
+                 vcombine_s16 (vqmovn_s32 (vcvtnq_s32_f32 (a)),
+                               vqmovn_s32 (vcvtnq_s32_f32 (b))));
+    }
+
+  wys_kernel_float_to_s16_ref (in + i, out + i, samples - i);
+}
+
+
+void
+wys_kernel_s16_to_float (const gint16 *in,
+                         gfloat       *out,
+                         gsize         samples)
+{
+  gsize i;
+
+  for (i = 0; i + 8 <= samples; i += 8)
+    {
+      const int16x8_t v = vld1q_s16 (in + i);
+
+      vst1q_f32 (out + i,
+                 vmulq_n_f32 (vcvtq_f32_s32 (vmovl_s16 (vget_low_s16 (v))),
+                              1.0f / S16_SCALE));
+      vst1q_f32 (out + i + 4,
+                 vmulq_n_f32 (vcvtq_f32_s32 (vmovl_s16 (vget_high_s16 (v))),
+                              1.0f / S16_SCALE));
+    }
+
+  wys_kernel_s16_to_float_ref (in + i, out + i, samples - i);
+}
+
+
+void
+wys_kernel_downmix_s16 (const gint16 *in,
+                        guint         channels,
+                        gint16       *out,
+                        gsize         frames)
+{
+  gsize i = 0;
+
+  if (channels == 2)
+    {
+      for (; i + 8 <= frames; i += 8)
+        {
+          const int16x8x2_t v = vld2q_s16 (in + 2 * i);
+
+          // Halving add rounds down, like the reference
+          vst1q_s16 (out + i, vhaddq_s16 (v.val[0], v.val[1]));
+        }
+    }
+
+  wys_kernel_downmix_s16_ref (in + i * channels, channels, out + i, frames - i);
+}
+
+
+void
+wys_kernel_upmix_s16 (const gint16 *in,
+                      gint16       *out,
+                      guint         channels,
+                      gsize         frames)
+{
+  gsize i = 0;
+
+  if (channels == 2)
+    {
+      for (; i + 8 <= frames; i += 8)
+        {
+          const int16x8_t v = vld1q_s16 (in + i);
+          const int16x8x2_t pair = { { v, v } };
+
+          vst2q_s16 (out + 2 * i, pair);
+        }
+    }
+
+  wys_kernel_upmix_s16_ref (in + i, out + i * channels, channels, frames - i);
+}
+
+
+gint32
+wys_kernel_dot_s16 (const gint16 *a,
+                    const gint16 *b,
+                    gsize         n)
+{
+  int64x2_t acc = vdupq_n_s64 (0);
+  gsize i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      const int16x8_t va = vld1q_s16 (a + i);
+      const int16x8_t vb = vld1q_s16 (b + i);
+
+      acc = vpadalq_s32 (acc, vmull_s16 (vget_low_s16 (va), vget_low_s16 (vb)));
+      acc = vpadalq_s32 (acc, vmull_s16 (vget_high_s16 (va), vget_high_s16 (vb)));
+    }
+
+  return saturate_s32 (vaddvq_s64 (acc) + dot_s16_wide (a + i, b + i, n - i));
+}
+
+
+void
+wys_kernel_cmac_f32 (const gfloat *a,
+                     const gfloat *b,
+                     gfloat       *acc,
+                     gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      const float32x4x2_t va = vld2q_f32 (a + 2 * i);
+      const float32x4x2_t vb = vld2q_f32 (b + 2 * i);
+      float32x4x2_t v = vld2q_f32 (acc + 2 * i);
+
+      v.val[0] = vmlaq_f32 (v.val[0], va.val[0], vb.val[0]);
+      v.val[0] = vmlsq_f32 (v.val[0], va.val[1], vb.val[1]);
+      v.val[1] = vmlaq_f32 (v.val[1], va.val[0], vb.val[1]);
+      v.val[1] = vmlaq_f32 (v.val[1], va.val[1], vb.val[0]);
+      vst2q_f32 (acc + 2 * i, v);
+    }
+
+  wys_kernel_cmac_f32_ref (a + 2 * i, b + 2 * i, acc + 2 * i, n - i);
+}
+
+
+void
+wys_kernel_cmac_conj_f32 (const gfloat *a,
+                          const gfloat *b,
+                          gfloat       *acc,
+                          gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      const float32x4x2_t va = vld2q_f32 (a + 2 * i);
+      const float32x4x2_t vb = vld2q_f32 (b + 2 * i);
+      float32x4x2_t v = vld2q_f32 (acc + 2 * i);
+
+      v.val[0] = vmlaq_f32 (v.val[0], va.val[0], vb.val[0]);
+      v.val[0] = vmlaq_f32 (v.val[0], va.val[1], vb.val[1]);
+      v.val[1] = vmlaq_f32 (v.val[1], va.val[0], vb.val[1]);
+      v.val[1] = vmlsq_f32 (v.val[1], va.val[1], vb.val[0]);
+      vst2q_f32 (acc + 2 * i, v);
+    }
+
+  wys_kernel_cmac_conj_f32_ref (a + 2 * i, b + 2 * i, acc + 2 * i, n - i);
+}
+
+
+void
+wys_kernel_butterfly_f32 (gfloat       *a,
+                          gfloat       *b,
+                          const gfloat *w,
+                          gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      float32x4x2_t va = vld2q_f32 (a + 2 * i);
+      float32x4x2_t vb = vld2q_f32 (b + 2 * i);
+      const float32x4x2_t vw = vld2q_f32 (w + 2 * i);
+      const float32x4_t re = vmlsq_f32 (vmulq_f32 (vb.val[0], vw.val[0]),
+                                        vb.val[1], vw.val[1]);
+      const float32x4_t im = vmlaq_f32 (vmulq_f32 (vb.val[0], vw.val[1]),
+                                        vb.val[1], vw.val[0]);
+
+      vb.val[0] = vsubq_f32 (va.val[0], re);
+      vb.val[1] = vsubq_f32 (va.val[1], im);
+      va.val[0] = vaddq_f32 (va.val[0], re);
+      va.val[1] = vaddq_f32 (va.val[1], im);
+      vst2q_f32 (b + 2 * i, vb);
+      vst2q_f32 (a + 2 * i, va);
+    }
+
+  wys_kernel_butterfly_f32_ref (a + 2 * i, b + 2 * i, w + 2 * i, n - i);
+}
+
+#else
+
+void
+wys_kernel_s32_to_s16 (const gint32 *in,
+                       gint16       *out,
+                       gsize         samples)
+{
+  wys_kernel_s32_to_s16_ref (in, out, samples);
+}
+
+
+void
+wys_kernel_s16_to_s32 (const gint16 *in,
+                       gint32       *out,
+                       gsize         samples)
+{
+  wys_kernel_s16_to_s32_ref (in, out, samples);
+}
+
+
+void
+wys_kernel_float_to_s16 (const gfloat *in,
+                         gint16       *out,
+                         gsize         samples)
+{
+  wys_kernel_float_to_s16_ref (in, out, samples);
+}
+
+
+void
+wys_kernel_s16_to_float (const gint16 *in,
+                         gfloat       *out,
+                         gsize         samples)
+{
+  wys_kernel_s16_to_float_ref (in, out, samples);
+}
+
+
+void
+wys_kernel_downmix_s16 (const gint16 *in,
+                        guint         channels,
+                        gint16       *out,
+                        gsize         frames)
+{
+  wys_kernel_downmix_s16_ref (in, channels, out, frames);
+}
+
+
+void
+wys_kernel_upmix_s16 (const gint16 *in,
+                      gint16       *out,
+                      guint         channels,
+                      gsize         frames)
+{
+  wys_kernel_upmix_s16_ref (in, out, channels, frames);
+}
+
+
+gint32
+wys_kernel_dot_s16 (const gint16 *a,
+                    const gint16 *b,
+                    gsize         n)
+{
+  return wys_kernel_dot_s16_ref (a, b, n);
+}
+
+
+void
+wys_kernel_cmac_f32 (const gfloat *a,
+                     const gfloat *b,
+                     gfloat       *acc,
+                     gsize         n)
+{
+  wys_kernel_cmac_f32_ref (a, b, acc, n);
+}
+
+
+void
+wys_kernel_cmac_conj_f32 (const gfloat *a,
+                          const gfloat *b,
+                          gfloat       *acc,
+                          gsize         n)
+{
+  wys_kernel_cmac_conj_f32_ref (a, b, acc, n);
+}
+
+
+void
+wys_kernel_butterfly_f32 (gfloat       *a,
+                          gfloat       *b,
+                          const gfloat *w,
+                          gsize         n)
+{
+  wys_kernel_butterfly_f32_ref (a, b, w, n);
+}
+
+#endif
+
+
+const gchar *
+wys_kernel_isa (void)
+{
+  return KERNEL_ISA;
+}
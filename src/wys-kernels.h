@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_KERNELS_H__
+#define WYS_KERNELS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Sample conversion and filtering kernels.  Each one has a scalar
+ * reference implementation, suffixed _ref, which the vectorised
+ * version must match exactly, or to within rounding for the floating
+ * point filter kernels.  Counts are in samples for format conversion,
+ * in frames for channel mixing and in complex numbers, stored as
+ * interleaved real and imaginary parts, for the complex kernels.
+ */
+
+void   wys_kernel_s32_to_s16        (const gint32 *in,
+                                     gint16       *out,
+                                     gsize         samples);
+void   wys_kernel_s16_to_s32        (const gint16 *in,
+                                     gint32       *out,
+                                     gsize         samples);
+void   wys_kernel_float_to_s16      (const gfloat *in,
+                                     gint16       *out,
+                                     gsize         samples);
+void   wys_kernel_s16_to_float      (const gint16 *in,
+                                     gfloat       *out,
+                                     gsize         samples);
+void   wys_kernel_downmix_s16       (const gint16 *in,
+                                     guint         channels,
+                                     gint16       *out,
+                                     gsize         frames);
+void   wys_kernel_upmix_s16         (const gint16 *in,
+                                     gint16       *out,
+                                     guint         channels,
+                                     gsize         frames);
+gint32 wys_kernel_dot_s16           (const gint16 *a,
+                                     const gint16 *b,
+                                     gsize         n);
+void   wys_kernel_cmac_f32          (const gfloat *a,
+                                     const gfloat *b,
+                                     gfloat       *acc,
+                                     gsize         n);
+void   wys_kernel_cmac_conj_f32     (const gfloat *a,
+                                     const gfloat *b,
+                                     gfloat       *acc,
+                                     gsize         n);
+void   wys_kernel_butterfly_f32     (gfloat       *a,
+                                     gfloat       *b,
+                                     const gfloat *w,
+                                     gsize         n);
+
+void   wys_kernel_s32_to_s16_ref    (const gint32 *in,
+                                     gint16       *out,
+                                     gsize         samples);
+void   wys_kernel_s16_to_s32_ref    (const gint16 *in,
+                                     gint32       *out,
+                                     gsize         samples);
+void   wys_kernel_float_to_s16_ref  (const gfloat *in,
+                                     gint16       *out,
+                                     gsize         samples);
+void   wys_kernel_s16_to_float_ref  (const gint16 *in,
+                                     gfloat       *out,
+                                     gsize         samples);
+void   wys_kernel_downmix_s16_ref   (const gint16 *in,
+                                     guint         channels,
+                                     gint16       *out,
+                                     gsize         frames);
+void   wys_kernel_upmix_s16_ref     (const gint16 *in,
+                                     gint16       *out,
+                                     guint         channels,
+                                     gsize         frames);
+gint32 wys_kernel_dot_s16_ref       (const gint16 *a,
+                                     const gint16 *b,
+                                     gsize         n);
+void   wys_kernel_cmac_f32_ref      (const gfloat *a,
+                                     const gfloat *b,
+                                     gfloat       *acc,
+                                     gsize         n);
+void   wys_kernel_cmac_conj_f32_ref (const gfloat *a,
+                                     const gfloat *b,
+                                     gfloat       *acc,
+                                     gsize         n);
+void   wys_kernel_butterfly_f32_ref (gfloat       *a,
+                                     gfloat       *b,
+                                     const gfloat *w,
+                                     gsize         n);
+
+/** The instruction set the kernels were built for */
+const gchar *wys_kernel_isa (void);
+
+G_END_DECLS
+
+#endif /* WYS_KERNELS_H__ */
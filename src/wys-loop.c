@@ -0,0 +1,2068 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "wys-loop.h"
+#include "wys-resampler.h"
+#include "wys-jitter.h"
+#include "wys-kernels.h"
+#include "wys-polyphase.h"
+#include "wys-dsp.h"
+#include "wys-echo.h"
+#include "wys-stats.h"
+#include "wys-engine.h"
+#include "wys-rt.h"
+#include "wys-pcm-cache.h"
+
+#include <alsa/asoundlib.h>
+
+#include <errno.h>
+
+/** What audio is resampled in; PCMs which can't do this are
+ * converted to and from it */
+#define LOOP_FORMAT       SND_PCM_FORMAT_S16_LE
+#define LOOP_CHANNELS     1
+#define LOOP_RATE         WYS_LOOP_RATE
+/** Bounds and starting point for the playback queue depth, in
+ * microseconds */
+#define LOOP_MIN_LATENCY  15000
+#define LOOP_MAX_LATENCY  60000
+#define LOOP_LATENCY      25000   /* half of wys-connect's buffer */
+#define LOOP_PERIOD_TIME  10000   /* microseconds, by default */
+#define LOOP_WAIT_MS      100
+/** Keeps a timer-scheduled loop from spinning when its queue is
+ * shallow */
+#define TIMER_MIN_SLEEP_US 1000
+/** How long to wait for a device change before trying anyway, in
+ * case a device becomes usable without its node changing */
+#define DEVICE_WAIT_US    (2 * G_USEC_PER_SEC)
+
+#define US_TO_FRAMES(us)  ((snd_pcm_uframes_t)(LOOP_RATE / 1000) * (us) / 1000)
+
+
+/** Used when no PCM name templates are given */
+static const gchar * const DEFAULT_PCMS[] = { WYS_LOOP_PCM_CARD, NULL };
+
+/** What the PCMs may be configured with if they can't use the loop's
+ * own format and rate, in order of preference.  The rates must
+ * divide LOOP_RATE. */
+static const snd_pcm_format_t PCM_FORMATS[] =
+  { LOOP_FORMAT, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_FLOAT_LE };
+static const guint PCM_RATES[] = { LOOP_RATE, 16000, 8000 };
+
+
+/** How a PCM is asked to be configured */
+struct pcm_request
+{
+  /** In microseconds */
+  guint buffer_time;
+  guint period_time;
+  /** Whether to turn off period interrupts, if the driver can */
+  gboolean timer_scheduling;
+};
+
+
+/** How a PCM has been configured */
+struct pcm_params
+{
+  snd_pcm_format_t format;
+  guint channels;
+  guint rate;
+  snd_pcm_uframes_t period_size;
+  snd_pcm_uframes_t buffer_size;
+  /** Whether period interrupts are off, so only timers wake us */
+  gboolean timer_scheduling;
+};
+
+
+struct _WysLoop
+{
+  /** ALSA card names */
+  gchar *capture_name;
+  gchar *playback_name;
+  /** PCM name templates to try */
+  gchar **capture_pcms;
+  gchar **playback_pcms;
+  /** PCM handles, owned by the thread */
+  snd_pcm_t *capture;
+  snd_pcm_t *playback;
+  struct pcm_params capture_params;
+  struct pcm_params playback_params;
+  /** Bounds on the playback queue depth, in microseconds */
+  guint min_latency;
+  guint max_latency;
+  /** The period asked of both PCMs, in microseconds */
+  guint period_time;
+  /** Whether to wake on timers rather than period interrupts, where
+   * the capture PCM allows */
+  gboolean timer_scheduling;
+  /** With timer scheduling, the most the playback queue is filled to,
+   * in loop frames, and when to next move audio */
+  snd_pcm_uframes_t max_depth;
+  gint64 wakeup_time;
+  /** Frames moved through each PCM since the streams were started */
+  guint64 capture_position;
+  guint64 playback_position;
+  /** Compensates for the two cards' clocks drifting apart */
+  WysResampler *resampler;
+  /** Processing applied to the resampled audio, or NULL */
+  WysDsp *dsp;
+  /** Whether to play silence while keeping the streams running */
+  gint muted;
+  /** Echo canceller shared with the loop in the other direction, and
+   * whether this loop feeds it the far-end audio or has the echo
+   * removed from its capture */
+  WysEcho *echo;
+  gboolean echo_reference;
+  /** The echo timeline frame of loop frame 0, once known */
+  gint64 echo_origin;
+  gboolean have_echo_origin;
+  /** Capture position up to which the echo has been cancelled */
+  guint64 echo_position;
+  /** Glitch counters, or NULL */
+  WysStats *stats;
+  /** Picks how much to keep queued, created once the PCMs are open */
+  WysJitter *jitter;
+  /** Set up when either PCM isn't in the loop's format */
+  gboolean convert;
+  WysPolyphase *upsampler;
+  WysPolyphase *downsampler;
+  /** Captured audio converted to the loop's format and rate, waiting
+   * to be resampled */
+  gint16 *staged;
+  gsize n_staged;
+  gsize staged_size;
+  /** Resampled audio on its way to the playback PCM */
+  gint16 *resampled;
+  gsize resampled_size;
+  /** Conversion space, mono and with all of a PCM's channels */
+  gint16 *mono;
+  gint16 *wide;
+  /** The drift estimate in thousandths of a ppm, for other threads */
+  gint drift_mppm;
+  /** Moves the audio if set, otherwise the loop's own thread does */
+  WysEngine *engine;
+  /** Set once the thread has opened the PCMs and handed the loop to
+   * the engine */
+  gboolean ready;
+  /** The engine's view of the streams: whether they have been started
+   * and whether they can't be */
+  gboolean streaming;
+  gboolean failed;
+  /** Whether audio has flowed since the loop was started, and when
+   * the current run of xruns began */
+  gboolean flowing;
+  gint64 xrun_time;
+  /** Opens the PCMs, then transfers audio unless there's an engine */
+  pthread_t thread;
+  gboolean have_thread;
+  /** Cleared to ask the thread to exit */
+  gint running;
+  /** Set while audio should flow, otherwise the PCMs are only kept
+   * open and configured */
+  gint started;
+  /** Bumped whenever the sound devices change */
+  gint devices_serial;
+  GMutex lock;
+  GCond cond;
+  /** When the loop was started, for setup latency */
+  gint64 start_time;
+};
+
+
+/** Pick the most preferred of PCM_FORMATS that the PCM supports */
+static int
+pick_format (snd_pcm_t           *pcm,
+             snd_pcm_hw_params_t *hw,
+             snd_pcm_format_t    *format)
+{
+  guint i;
+  int err = -EINVAL;
+
+  for (i = 0; i < G_N_ELEMENTS (PCM_FORMATS); ++i)
+    {
+      err = snd_pcm_hw_params_test_format (pcm, hw, PCM_FORMATS[i]);
+      if (err == 0)
+        {
+          *format = PCM_FORMATS[i];
+          break;
+        }
+    }
+
+  return err;
+}
+
+
+/** Pick the most preferred of PCM_RATES that the PCM supports */
+static int
+pick_rate (snd_pcm_t           *pcm,
+           snd_pcm_hw_params_t *hw,
+           guint               *rate)
+{
+  guint i;
+  int err = -EINVAL;
+
+  for (i = 0; i < G_N_ELEMENTS (PCM_RATES); ++i)
+    {
+      err = snd_pcm_hw_params_test_rate (pcm, hw, PCM_RATES[i], 0);
+      if (err == 0)
+        {
+          *rate = PCM_RATES[i];
+          break;
+        }
+    }
+
+  return err;
+}
+
+
+static int
+set_hw_params (snd_pcm_t                *pcm,
+               const struct pcm_request *request,
+               struct pcm_params        *params)
+{
+  snd_pcm_hw_params_t *hw;
+  guint period_time = request->period_time;
+  guint buffer_time = request->buffer_time;
+  int err;
+
+  snd_pcm_hw_params_alloca (&hw);
+
+#define try_set(call)                           \
+  err = call;                                   \
+  if (err < 0)                                  \
+    {                                           \
+      return err;                               \
+    }
+
+  try_set (snd_pcm_hw_params_any (pcm, hw));
+  // Frames are moved directly between the two ring buffers
+  try_set (snd_pcm_hw_params_set_access (pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED));
+  // Whatever the hardware does natively, so that no plug layer is
+  // needed in between
+  try_set (pick_format (pcm, hw, &params->format));
+  try_set (snd_pcm_hw_params_set_format (pcm, hw, params->format));
+  params->channels = LOOP_CHANNELS;
+  try_set (snd_pcm_hw_params_set_channels_near (pcm, hw, &params->channels));
+  try_set (pick_rate (pcm, hw, &params->rate));
+  try_set (snd_pcm_hw_params_set_rate (pcm, hw, params->rate, 0));
+  try_set (snd_pcm_hw_params_set_period_time_near (pcm, hw, &period_time, NULL));
+  try_set (snd_pcm_hw_params_set_buffer_time_near (pcm, hw, &buffer_time, NULL));
+  params->timer_scheduling = request->timer_scheduling
+    && snd_pcm_hw_params_can_disable_period_wakeup (hw);
+  if (params->timer_scheduling)
+    {
+      try_set (snd_pcm_hw_params_set_period_wakeup (pcm, hw, 0));
+    }
+  try_set (snd_pcm_hw_params (pcm, hw));
+
+#undef try_set
+
+  snd_pcm_hw_params_get_period_size (hw, &params->period_size, NULL);
+  snd_pcm_hw_params_get_buffer_size (hw, &params->buffer_size);
+
+  return 0;
+}
+
+
+static int
+set_sw_params (snd_pcm_t         *pcm,
+               snd_pcm_uframes_t  period_size)
+{
+  snd_pcm_sw_params_t *sw;
+  snd_pcm_uframes_t boundary;
+  int err;
+
+  snd_pcm_sw_params_alloca (&sw);
+
+  err = snd_pcm_sw_params_current (pcm, sw);
+  if (err < 0)
+    {
+      return err;
+    }
+
+  // We start both streams explicitly
+  snd_pcm_sw_params_get_boundary (sw, &boundary);
+  snd_pcm_sw_params_set_start_threshold (pcm, sw, boundary);
+  snd_pcm_sw_params_set_avail_min (pcm, sw, period_size);
+  // Hardware timestamps drive the drift estimate
+  snd_pcm_sw_params_set_tstamp_mode (pcm, sw, SND_PCM_TSTAMP_ENABLE);
+  snd_pcm_sw_params_set_tstamp_type (pcm, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+
+  return snd_pcm_sw_params (pcm, sw);
+}
+
+
+static int
+open_pcm (const gchar               *name,
+          snd_pcm_stream_t           stream,
+          const struct pcm_request  *request,
+          snd_pcm_t                **pcm_out,
+          struct pcm_params         *params)
+{
+  snd_pcm_t *pcm;
+  int err;
+
+  // Don't block in open() if the device is busy
+  err = snd_pcm_open (&pcm, name, stream, SND_PCM_NONBLOCK);
+  if (err < 0)
+    {
+      return err;
+    }
+
+  err = snd_pcm_nonblock (pcm, 0);
+  if (err >= 0)
+    {
+      err = set_hw_params (pcm, request, params);
+    }
+  if (err >= 0)
+    {
+      err = set_sw_params (pcm, params->period_size);
+    }
+
+  if (err < 0)
+    {
+      snd_pcm_close (pcm);
+      return err;
+    }
+
+  *pcm_out = pcm;
+  return 0;
+}
+
+
+static void
+get_request (WysLoop            *self,
+             struct pcm_request *request)
+{
+  // Enough for the deepest queue we may aim for, plus a period being
+  // transferred and a period of lateness
+  request->buffer_time = self->max_latency + 2 * self->period_time;
+  request->period_time = self->period_time;
+  request->timer_scheduling = self->timer_scheduling;
+}
+
+
+static void
+debug_pcm (const gchar             *what,
+           const gchar             *name,
+           const struct pcm_params *params)
+{
+  g_debug ("%s `%s': %s, %u channel(s), %u Hz, period size %lu",
+           what, name, snd_pcm_format_name (params->format),
+           params->channels, params->rate,
+           (unsigned long)params->period_size);
+}
+
+
+static gboolean
+open_pair (WysLoop     *self,
+           const gchar *capture,
+           const gchar *playback)
+{
+  struct pcm_request request;
+  int err;
+
+  get_request (self, &request);
+
+  err = open_pcm (capture, SND_PCM_STREAM_CAPTURE, &request,
+                  &self->capture, &self->capture_params);
+  if (err < 0)
+    {
+      g_debug ("Could not open capture PCM `%s': %s",
+               capture, snd_strerror (err));
+      return FALSE;
+    }
+
+  err = open_pcm (playback, SND_PCM_STREAM_PLAYBACK, &request,
+                  &self->playback, &self->playback_params);
+  if (err < 0)
+    {
+      g_debug ("Could not open playback PCM `%s': %s",
+               playback, snd_strerror (err));
+      snd_pcm_close (self->capture);
+      self->capture = NULL;
+      return FALSE;
+    }
+
+  debug_pcm ("Looping from", capture, &self->capture_params);
+  debug_pcm ("Looping to", playback, &self->playback_params);
+  return TRUE;
+}
+
+
+/** Fill in a PCM name template, see #WYS_LOOP_PCM_CARD */
+gchar *
+wys_loop_expand_pcm (const gchar *pcm,
+                     const gchar *card)
+{
+  gchar **parts;
+  gchar *name;
+
+  parts = g_strsplit (pcm, WYS_LOOP_PCM_CARD, -1);
+  name = g_strjoinv (card, parts);
+  g_strfreev (parts);
+
+  return name;
+}
+
+
+struct probe
+{
+  gchar *name;
+  snd_pcm_stream_t stream;
+  struct pcm_request request;
+  int err;
+  snd_pcm_t *pcm;
+  struct pcm_params params;
+  pthread_t thread;
+  gboolean have_thread;
+};
+
+
+static gpointer
+probe_thread (gpointer data)
+{
+  struct probe *probe = data;
+  const gint64 start = g_get_monotonic_time ();
+
+  probe->err = open_pcm (probe->name, probe->stream, &probe->request,
+                         &probe->pcm, &probe->params);
+
+  g_debug ("Probing PCM `%s' took %" G_GINT64_FORMAT " us: %s",
+           probe->name, g_get_monotonic_time () - start,
+           probe->err < 0 ? snd_strerror (probe->err) : "ok");
+  return NULL;
+}
+
+
+/** The most preferred probe that worked, or -1 */
+static gint
+best_probe (struct probe *probes,
+            guint         n_probes)
+{
+  guint i;
+
+  for (i = 0; i < n_probes; ++i)
+    {
+      if (probes[i].err == 0)
+        {
+          return i;
+        }
+    }
+
+  return -1;
+}
+
+
+/** A PCM can fail only because another one sharing its hardware was
+ * being probed at the same time.  Probe any busy ones that are more
+ * preferred than @best, or all of them when @best is -1, again one at
+ * a time with nothing else open. */
+static gint
+reprobe_busy (struct probe *probes,
+              guint         n_probes,
+              gint          best)
+{
+  const gint end = best < 0 ? (gint)n_probes : best;
+  gint i, first_busy = -1;
+
+  for (i = 0; i < end; ++i)
+    {
+      if (probes[i].err == -EBUSY)
+        {
+          first_busy = i;
+          break;
+        }
+    }
+
+  if (first_busy < 0)
+    {
+      return best;
+    }
+
+  if (best >= 0)
+    {
+      g_clear_pointer (&probes[best].pcm, snd_pcm_close);
+    }
+
+  for (i = first_busy; i < end; ++i)
+    {
+      if (probes[i].err != -EBUSY)
+        {
+          continue;
+        }
+      probe_thread (&probes[i]);
+      if (probes[i].err == 0)
+        {
+          return i;
+        }
+    }
+
+  if (best >= 0)
+    {
+      probe_thread (&probes[best]);
+      if (probes[best].err == 0)
+        {
+          return best;
+        }
+    }
+
+  return -1;
+}
+
+
+/** Open and configure all of @pcms at the same time and keep the most
+ * preferred one that works */
+static gint
+probe_pcms (gchar                    **pcms,
+            const gchar               *card,
+            snd_pcm_stream_t           stream,
+            const struct pcm_request  *request,
+            snd_pcm_t                **pcm,
+            struct pcm_params         *params)
+{
+  const guint n_probes = g_strv_length (pcms);
+  g_autofree struct probe *probes = NULL;
+  gint best;
+  guint i;
+
+  probes = g_new0 (struct probe, n_probes);
+
+  for (i = 0; i < n_probes; ++i)
+    {
+      probes[i].name = wys_loop_expand_pcm (pcms[i], card);
+      probes[i].stream = stream;
+      probes[i].request = *request;
+      probes[i].have_thread =
+        wys_rt_spawn (&probes[i].thread, probe_thread, &probes[i]) == 0;
+      if (!probes[i].have_thread)
+        {
+          probe_thread (&probes[i]);
+        }
+    }
+
+  for (i = 0; i < n_probes; ++i)
+    {
+      if (probes[i].have_thread)
+        {
+          pthread_join (probes[i].thread, NULL);
+        }
+    }
+
+  best = best_probe (probes, n_probes);
+  if (best > 0)
+    {
+      for (i = best + 1; i < n_probes; ++i)
+        {
+          g_clear_pointer (&probes[i].pcm, snd_pcm_close);
+        }
+    }
+  if (best != 0)
+    {
+      // Even when none worked, a sibling may have kept one busy
+      best = reprobe_busy (probes, n_probes, best);
+    }
+
+  for (i = 0; i < n_probes; ++i)
+    {
+      if ((gint)i == best)
+        {
+          *pcm = probes[i].pcm;
+          *params = probes[i].params;
+        }
+      else if (probes[i].pcm)
+        {
+          snd_pcm_close (probes[i].pcm);
+        }
+      g_free (probes[i].name);
+    }
+
+  return best;
+}
+
+
+static gboolean
+search_pcms (WysLoop *self)
+{
+  g_autofree gchar *capture = NULL;
+  g_autofree gchar *playback = NULL;
+  struct pcm_request request;
+  gint c, p;
+
+  get_request (self, &request);
+
+  c = probe_pcms (self->capture_pcms, self->capture_name,
+                  SND_PCM_STREAM_CAPTURE, &request,
+                  &self->capture, &self->capture_params);
+  if (c < 0)
+    {
+      return FALSE;
+    }
+
+  p = probe_pcms (self->playback_pcms, self->playback_name,
+                  SND_PCM_STREAM_PLAYBACK, &request,
+                  &self->playback, &self->playback_params);
+  if (p < 0)
+    {
+      g_clear_pointer (&self->capture, snd_pcm_close);
+      return FALSE;
+    }
+
+  capture = wys_loop_expand_pcm (self->capture_pcms[c],
+                                 self->capture_name);
+  playback = wys_loop_expand_pcm (self->playback_pcms[p],
+                                  self->playback_name);
+
+  debug_pcm ("Looping from", capture, &self->capture_params);
+  debug_pcm ("Looping to", playback, &self->playback_params);
+  wys_pcm_cache_store (self->capture_name, self->playback_name,
+                       capture, playback);
+  return TRUE;
+}
+
+
+static gboolean
+try_open_pcms (WysLoop *self)
+{
+  g_autofree gchar *capture = NULL;
+  g_autofree gchar *playback = NULL;
+
+  // Try whatever worked last time first
+  if (wys_pcm_cache_lookup (self->capture_name, self->playback_name,
+                            &capture, &playback)
+      && open_pair (self, capture, playback))
+    {
+      return TRUE;
+    }
+
+  return search_pcms (self);
+}
+
+
+/** Block until the sound devices have changed since @serial, the loop
+ * is freed or, as a fallback, a while has passed */
+static void
+wait_for_devices (WysLoop *self,
+                  gint     serial)
+{
+  const gint64 end_time = g_get_monotonic_time () + DEVICE_WAIT_US;
+
+  g_mutex_lock (&self->lock);
+  while (g_atomic_int_get (&self->running)
+         && g_atomic_int_get (&self->devices_serial) == serial)
+    {
+      if (!g_cond_wait_until (&self->cond, &self->lock, end_time))
+        {
+          break;
+        }
+    }
+  g_mutex_unlock (&self->lock);
+}
+
+
+static gboolean
+open_pcms (WysLoop *self)
+{
+  gint serial;
+
+  for (;;)
+    {
+      if (!g_atomic_int_get (&self->running))
+        {
+          return FALSE;
+        }
+
+      serial = g_atomic_int_get (&self->devices_serial);
+
+      if (try_open_pcms (self))
+        {
+          return TRUE;
+        }
+
+      // The modem's device may not be ready yet
+      g_debug ("No usable PCMs for `%s' -> `%s' yet, waiting"
+               " for the sound devices to change",
+               self->capture_name, self->playback_name);
+      wait_for_devices (self, serial);
+    }
+}
+
+
+static void
+close_pcms (WysLoop *self)
+{
+  if (self->playback)
+    {
+      snd_pcm_drop (self->playback);
+      snd_pcm_close (self->playback);
+      self->playback = NULL;
+    }
+
+  if (self->capture)
+    {
+      snd_pcm_drop (self->capture);
+      snd_pcm_close (self->capture);
+      self->capture = NULL;
+    }
+}
+
+
+/** How many loop frames each frame of a PCM amounts to */
+static inline guint
+rate_factor (const struct pcm_params *params)
+{
+  return LOOP_RATE / params->rate;
+}
+
+
+static inline gboolean
+is_loop_format (const struct pcm_params *params)
+{
+  return params->format == LOOP_FORMAT
+    && params->channels == LOOP_CHANNELS
+    && params->rate == LOOP_RATE;
+}
+
+
+/** Allocate what's needed to convert between the PCMs' formats and
+ * the loop's, if they differ */
+static void
+set_up_conversion (WysLoop *self)
+{
+  const struct pcm_params *capture = &self->capture_params;
+  const struct pcm_params *playback = &self->playback_params;
+  gsize frames, samples;
+
+  self->convert = !is_loop_format (capture) || !is_loop_format (playback);
+  if (!self->convert)
+    {
+      return;
+    }
+
+  if (capture->rate != LOOP_RATE)
+    {
+      self->upsampler = wys_polyphase_new (rate_factor (capture), 1);
+    }
+  if (playback->rate != LOOP_RATE)
+    {
+      self->downsampler = wys_polyphase_new (1, rate_factor (playback));
+    }
+
+  // A whole capture buffer, with room for what the resampler leaves
+  self->staged_size = 2 * capture->buffer_size * rate_factor (capture);
+  self->staged = g_new (gint16, self->staged_size);
+  self->resampled_size = playback->buffer_size * rate_factor (playback);
+  self->resampled = g_new (gint16, self->resampled_size);
+
+  frames = MAX (capture->buffer_size, playback->buffer_size);
+  samples = MAX (capture->buffer_size * capture->channels,
+                 playback->buffer_size * playback->channels);
+  self->mono = g_new (gint16, frames);
+  // S32 and float samples are converted into S16 space
+  self->wide = g_new (gint16, samples);
+}
+
+
+static void
+free_conversion (WysLoop *self)
+{
+  g_clear_pointer (&self->upsampler, wys_polyphase_free);
+  g_clear_pointer (&self->downsampler, wys_polyphase_free);
+  g_clear_pointer (&self->staged, g_free);
+  g_clear_pointer (&self->resampled, g_free);
+  g_clear_pointer (&self->mono, g_free);
+  g_clear_pointer (&self->wide, g_free);
+}
+
+
+static inline gpointer
+area_frames (const snd_pcm_channel_area_t *areas,
+             snd_pcm_uframes_t             offset)
+{
+  // Interleaved, so the first area covers whole frames
+  return (guint8 *)areas[0].addr
+    + areas[0].first / 8
+    + offset * areas[0].step / 8;
+}
+
+
+/** Remove the echo from captured loop frames starting at @position */
+static void
+cancel_echo (WysLoop *self,
+             gint16  *frames,
+             guint64  position,
+             gsize    n_frames)
+{
+  gsize skip;
+
+  if (!self->echo || self->echo_reference || !self->have_echo_origin)
+    {
+      return;
+    }
+
+  // The resampler may have left some frames which are done already
+  if (self->echo_position > position)
+    {
+      skip = MIN (n_frames, self->echo_position - position);
+      frames += skip;
+      position += skip;
+      n_frames -= skip;
+    }
+
+  wys_echo_cancel (self->echo, self->echo_origin + position,
+                   frames, n_frames);
+  self->echo_position = position + n_frames;
+}
+
+
+/** Pass loop frames about to be played, starting at @position, to
+ * the echo canceller */
+static void
+feed_echo (WysLoop      *self,
+           const gint16 *frames,
+           guint64       position,
+           gsize         n_frames)
+{
+  if (self->echo && self->echo_reference && self->have_echo_origin)
+    {
+      wys_echo_write_reference (self->echo, self->echo_origin + position,
+                                frames, n_frames);
+    }
+}
+
+
+/** Silence @n_frames loop frames on their way to playback if the
+ * loop is muted */
+static inline void
+mute (WysLoop *self,
+      gint16  *frames,
+      gsize    n_frames)
+{
+  if (G_UNLIKELY (g_atomic_int_get (&self->muted)))
+    {
+      memset (frames, 0, n_frames * sizeof (gint16));
+    }
+}
+
+
+/** Move frames from the capture ring buffer to the playback ring
+ * buffer, through the resampler, until either side runs out.  Both
+ * PCMs must be in the loop's format. */
+static snd_pcm_sframes_t
+mmap_transfer (WysLoop           *self,
+               snd_pcm_uframes_t  capture_frames,
+               snd_pcm_uframes_t  playback_frames)
+{
+  const snd_pcm_channel_area_t *capture_areas, *playback_areas;
+  snd_pcm_uframes_t capture_offset, playback_offset;
+  snd_pcm_uframes_t capture_size, playback_size;
+  snd_pcm_sframes_t committed;
+  gsize consumed, produced;
+  snd_pcm_uframes_t done = 0;
+  int err;
+
+  while (capture_frames > 0 && playback_frames > 0)
+    {
+      capture_size = capture_frames;
+      err = snd_pcm_mmap_begin (self->capture, &capture_areas,
+                                &capture_offset, &capture_size);
+      if (err < 0)
+        {
+          return err;
+        }
+
+      playback_size = playback_frames;
+      err = snd_pcm_mmap_begin (self->playback, &playback_areas,
+                                &playback_offset, &playback_size);
+      if (err < 0)
+        {
+          return err;
+        }
+
+      cancel_echo (self, area_frames (capture_areas, capture_offset),
+                   self->capture_position, capture_size);
+
+      consumed = capture_size;
+      produced = wys_resampler_process
+        (self->resampler,
+         area_frames (capture_areas, capture_offset), &consumed,
+         area_frames (playback_areas, playback_offset), playback_size);
+
+      if (self->dsp)
+        {
+          wys_dsp_process (self->dsp,
+                           area_frames (playback_areas, playback_offset),
+                           produced);
+        }
+      mute (self, area_frames (playback_areas, playback_offset), produced);
+      feed_echo (self, area_frames (playback_areas, playback_offset),
+                 self->playback_position, produced);
+
+      committed = snd_pcm_mmap_commit (self->playback,
+                                       playback_offset, produced);
+      if (committed >= 0)
+        {
+          committed = snd_pcm_mmap_commit (self->capture,
+                                           capture_offset, consumed);
+        }
+      if (committed < 0)
+        {
+          return committed;
+        }
+
+      self->capture_position += consumed;
+      self->playback_position += produced;
+      capture_frames -= consumed;
+      playback_frames -= produced;
+      done += produced;
+
+      if (consumed == 0 && produced == 0)
+        {
+          break;
+        }
+    }
+
+  return done;
+}
+
+
+/** Convert @frames captured frames at @in to the loop's format and
+ * rate and add them to the staged frames */
+static void
+stage_capture (WysLoop       *self,
+               gconstpointer  in,
+               gsize          frames)
+{
+  const struct pcm_params *params = &self->capture_params;
+  gint16 *out = self->staged + self->n_staged;
+  const gint16 *s16 = in;
+  const gint16 *mono;
+
+  switch (params->format)
+    {
+    case SND_PCM_FORMAT_S32_LE:
+      wys_kernel_s32_to_s16 (in, self->wide, frames * params->channels);
+      s16 = self->wide;
+      break;
+    case SND_PCM_FORMAT_FLOAT_LE:
+      wys_kernel_float_to_s16 (in, self->wide, frames * params->channels);
+      s16 = self->wide;
+      break;
+    default:
+      break;
+    }
+
+  mono = s16;
+  if (params->channels > 1)
+    {
+      gint16 *mix = self->upsampler ? self->mono : out;
+
+      wys_kernel_downmix_s16 (s16, params->channels, mix, frames);
+      mono = mix;
+    }
+
+  if (self->upsampler)
+    {
+      frames = wys_polyphase_process (self->upsampler, mono, frames, out);
+    }
+  else if (mono != out)
+    {
+      memcpy (out, mono, frames * sizeof (gint16));
+    }
+
+  cancel_echo (self, out,
+               self->capture_position * rate_factor (params), frames);
+  self->n_staged += frames;
+}
+
+
+/** Convert @frames resampled frames to the playback PCM's format and
+ * rate at @out.  Returns the number of frames written to @out. */
+static gsize
+unstage_playback (WysLoop      *self,
+                  const gint16 *in,
+                  gsize         frames,
+                  gpointer      out)
+{
+  const struct pcm_params *params = &self->playback_params;
+  const gsize samples_per_frame = params->channels;
+  const gint16 *mono = in;
+  const gint16 *s16;
+
+  if (self->downsampler)
+    {
+      frames = wys_polyphase_process (self->downsampler, in, frames,
+                                      self->mono);
+      mono = self->mono;
+    }
+
+  if (params->format == LOOP_FORMAT && params->channels == 1)
+    {
+      memcpy (out, mono, frames * sizeof (gint16));
+      return frames;
+    }
+
+  s16 = mono;
+  if (params->channels > 1)
+    {
+      gint16 *wide = params->format == LOOP_FORMAT ? out : self->wide;
+
+      wys_kernel_upmix_s16 (mono, wide, params->channels, frames);
+      s16 = wide;
+    }
+
+  switch (params->format)
+    {
+    case SND_PCM_FORMAT_S32_LE:
+      wys_kernel_s16_to_s32 (s16, out, frames * samples_per_frame);
+      break;
+    case SND_PCM_FORMAT_FLOAT_LE:
+      wys_kernel_s16_to_float (s16, out, frames * samples_per_frame);
+      break;
+    default:
+      break;
+    }
+
+  return frames;
+}
+
+
+/** Like mmap_transfer() but with either PCM in another format or at
+ * another rate.  The captured audio is converted into a staging
+ * buffer first, then resampled and converted for playback. */
+static snd_pcm_sframes_t
+convert_transfer (WysLoop           *self,
+                  snd_pcm_uframes_t  capture_frames,
+                  snd_pcm_uframes_t  playback_frames)
+{
+  const guint capture_factor = rate_factor (&self->capture_params);
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t offset, size;
+  snd_pcm_sframes_t committed;
+  gsize consumed, produced, want;
+  snd_pcm_uframes_t done = 0;
+  int err;
+
+  while (capture_frames > 0)
+    {
+      size = MIN (capture_frames,
+                  (self->staged_size - self->n_staged) / capture_factor);
+      if (size == 0)
+        {
+          break;
+        }
+
+      err = snd_pcm_mmap_begin (self->capture, &areas, &offset, &size);
+      if (err < 0)
+        {
+          return err;
+        }
+
+      stage_capture (self, area_frames (areas, offset), size);
+
+      committed = snd_pcm_mmap_commit (self->capture, offset, size);
+      if (committed < 0)
+        {
+          return committed;
+        }
+
+      self->capture_position += size;
+      capture_frames -= size;
+    }
+
+  while (playback_frames > 0)
+    {
+      size = playback_frames;
+      err = snd_pcm_mmap_begin (self->playback, &areas, &offset, &size);
+      if (err < 0)
+        {
+          return err;
+        }
+
+      want = self->downsampler
+        ? wys_polyphase_max_input (self->downsampler, size)
+        : size;
+      want = MIN (want, self->resampled_size);
+
+      consumed = self->n_staged;
+      produced = wys_resampler_process (self->resampler,
+                                        self->staged, &consumed,
+                                        self->resampled, want);
+      self->n_staged -= consumed;
+      memmove (self->staged, self->staged + consumed,
+               self->n_staged * sizeof (gint16));
+
+      if (self->dsp)
+        {
+          wys_dsp_process (self->dsp, self->resampled, produced);
+        }
+      mute (self, self->resampled, produced);
+      feed_echo (self, self->resampled,
+                 self->playback_position
+                 * rate_factor (&self->playback_params),
+                 produced);
+
+      size = unstage_playback (self, self->resampled, produced,
+                               area_frames (areas, offset));
+
+      committed = snd_pcm_mmap_commit (self->playback, offset, size);
+      if (committed < 0)
+        {
+          return committed;
+        }
+
+      self->playback_position += size;
+      playback_frames -= size;
+      done += size;
+
+      if (produced == 0)
+        {
+          break;
+        }
+    }
+
+  return done;
+}
+
+
+static snd_pcm_sframes_t
+write_silence (WysLoop           *self,
+               snd_pcm_uframes_t  frames)
+{
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t offset, size;
+  snd_pcm_sframes_t committed;
+  snd_pcm_uframes_t done = 0;
+  int err;
+
+  while (done < frames)
+    {
+      size = frames - done;
+      err = snd_pcm_mmap_begin (self->playback, &areas, &offset, &size);
+      if (err < 0)
+        {
+          return err;
+        }
+      if (size == 0)
+        {
+          break;
+        }
+
+      snd_pcm_areas_silence (areas, offset,
+                             self->playback_params.channels,
+                             size, self->playback_params.format);
+
+      committed = snd_pcm_mmap_commit (self->playback, offset, size);
+      if (committed < 0)
+        {
+          return committed;
+        }
+
+      self->playback_position += size;
+      done += size;
+    }
+
+  return done;
+}
+
+
+/** Whether the capture PCM's period interrupts are off, so we wake
+ * on timers */
+static inline gboolean
+timer_scheduled (WysLoop *self)
+{
+  return self->capture_params.timer_scheduling;
+}
+
+
+/** The playback queue depth to aim for after moving audio, in loop
+ * frames.  With timer scheduling the queue is topped up to the bound
+ * so that we can sleep until it drains to a safe depth. */
+static guint
+target_depth (WysLoop *self)
+{
+  return timer_scheduled (self)
+    ? self->max_depth : wys_jitter_get_target (self->jitter);
+}
+
+
+/** (Re)start both streams with the playback buffer primed with
+ * silence so that the capture side has time to deliver the first
+ * period */
+static int
+start_streams (WysLoop *self)
+{
+  const guint target = target_depth (self);
+  snd_pcm_sframes_t written;
+  int err;
+
+  snd_pcm_drop (self->capture);
+  snd_pcm_drop (self->playback);
+
+  err = snd_pcm_prepare (self->capture);
+  if (err >= 0)
+    {
+      err = snd_pcm_prepare (self->playback);
+    }
+  if (err < 0)
+    {
+      return err;
+    }
+
+  // Hardware positions start again from zero
+  self->capture_position = self->playback_position = 0;
+  wys_resampler_reset (self->resampler);
+  wys_resampler_set_target_depth (self->resampler, target);
+
+  if (self->dsp)
+    {
+      wys_dsp_reset (self->dsp);
+    }
+
+  self->have_echo_origin = FALSE;
+  self->echo_position = 0;
+
+  self->n_staged = 0;
+  if (self->upsampler)
+    {
+      wys_polyphase_reset (self->upsampler);
+    }
+  if (self->downsampler)
+    {
+      wys_polyphase_reset (self->downsampler);
+    }
+
+  written = write_silence (self,
+                           target / rate_factor (&self->playback_params));
+  if (written < 0)
+    {
+      return (int)written;
+    }
+
+  err = snd_pcm_start (self->playback);
+  if (err >= 0)
+    {
+      err = snd_pcm_start (self->capture);
+    }
+
+  self->wakeup_time = g_get_monotonic_time () + self->period_time;
+
+  return err;
+}
+
+
+static inline gint64
+timestamp_ns (const snd_htimestamp_t *ts)
+{
+  return (gint64)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+
+/** Place the stream on the echo canceller's timeline, given that it
+ * was at loop frame @position at @time_ns.  Both directions are on
+ * the same card as far as the canceller is concerned, so once placed
+ * the streams stay lined up. */
+static void
+set_echo_origin (WysLoop *self,
+                 guint64  position,
+                 gint64   time_ns)
+{
+  if (self->echo && !self->have_echo_origin)
+    {
+      self->echo_origin = wys_echo_timeline (self->echo, time_ns)
+        - (gint64)position;
+      self->have_echo_origin = TRUE;
+    }
+}
+
+
+/** Clock positions are fed to the resampler in loop frames */
+static void
+update_clocks (WysLoop *self)
+{
+  const struct pcm_params *playback = &self->playback_params;
+  snd_pcm_uframes_t avail;
+  snd_htimestamp_t ts;
+
+  guint64 position;
+
+  if (snd_pcm_htimestamp (self->capture, &avail, &ts) == 0)
+    {
+      position = (self->capture_position + avail)
+        * rate_factor (&self->capture_params);
+      wys_resampler_update_clock (self->resampler, WYS_RESAMPLER_INPUT,
+                                  position, timestamp_ns (&ts));
+      if (!self->echo_reference)
+        {
+          set_echo_origin (self, position, timestamp_ns (&ts));
+        }
+    }
+
+  if (snd_pcm_htimestamp (self->playback, &avail, &ts) == 0
+      && avail <= playback->buffer_size)
+    {
+      position = (self->playback_position
+                  - (playback->buffer_size - avail))
+        * rate_factor (playback);
+      wys_resampler_update_clock (self->resampler, WYS_RESAMPLER_OUTPUT,
+                                  position, timestamp_ns (&ts));
+      if (self->echo_reference)
+        {
+          set_echo_origin (self, position, timestamp_ns (&ts));
+        }
+    }
+}
+
+
+/** Publish the drift, depth target and jitter for the main thread,
+ * which logs them; this thread mustn't */
+static void
+report (WysLoop *self)
+{
+  const gdouble ppm = wys_resampler_get_drift_ppm (self->resampler);
+
+  g_atomic_int_set (&self->drift_mppm, (gint)(ppm * 1000.0));
+
+  if (self->stats)
+    {
+      wys_stats_target (self->stats,
+                        (gint64)wys_jitter_get_target (self->jitter)
+                        * G_USEC_PER_SEC / LOOP_RATE,
+                        (gint64)wys_jitter_get_jitter (self->jitter)
+                        * G_USEC_PER_SEC / LOOP_RATE,
+                        ppm);
+    }
+}
+
+
+/** With timer scheduling, plan to wake when the playback queue, now
+ * @queued loop frames deep, has drained to the depth the jitter
+ * tracker thinks is safe.  That is sooner if the capture buffer would
+ * fill up first. */
+static void
+schedule_wakeup (WysLoop           *self,
+                 gint64             now,
+                 snd_pcm_uframes_t  queued)
+{
+  const snd_pcm_uframes_t safe = wys_jitter_get_target (self->jitter);
+  const struct pcm_params *capture = &self->capture_params;
+  const snd_pcm_uframes_t headroom =
+    (capture->buffer_size - capture->period_size) * rate_factor (capture);
+  snd_pcm_uframes_t sleep;
+
+  sleep = queued > safe ? queued - safe : 0;
+  sleep = MIN (sleep, headroom);
+
+  self->wakeup_time = now + MAX (sleep * G_USEC_PER_SEC / LOOP_RATE,
+                                 TIMER_MIN_SLEEP_US);
+}
+
+
+static snd_pcm_sframes_t
+transfer (WysLoop *self)
+{
+  const struct pcm_params *capture = &self->capture_params;
+  const struct pcm_params *playback = &self->playback_params;
+  const gint64 now = g_get_monotonic_time ();
+  snd_pcm_sframes_t capture_avail, playback_avail, moved;
+  snd_pcm_uframes_t late, queued;
+
+  capture_avail = snd_pcm_avail_update (self->capture);
+  if (capture_avail < 0)
+    {
+      return capture_avail;
+    }
+
+  playback_avail = snd_pcm_avail_update (self->playback);
+  if (playback_avail < 0)
+    {
+      return playback_avail;
+    }
+
+  update_clocks (self);
+
+  // How we're doing before refilling is what matters for xruns.  On
+  // a timer we're late if we woke after we meant to, rather than
+  // after a period's worth had arrived.
+  if (timer_scheduled (self))
+    {
+      late = US_TO_FRAMES (MAX (now - self->wakeup_time, 0));
+    }
+  else
+    {
+      late = (snd_pcm_uframes_t)capture_avail > capture->period_size
+        ? (capture_avail - capture->period_size) * rate_factor (capture)
+        : 0;
+    }
+  queued = (snd_pcm_uframes_t)playback_avail < playback->buffer_size
+    ? playback->buffer_size - playback_avail : 0;
+  wys_jitter_update (self->jitter, now, late,
+                     queued * rate_factor (playback));
+  if (self->stats)
+    {
+      wys_stats_depth (self->stats,
+                       queued * G_USEC_PER_SEC / playback->rate);
+    }
+  wys_resampler_set_target_depth (self->resampler, target_depth (self));
+
+  moved = self->convert
+    ? convert_transfer (self, capture_avail, playback_avail)
+    : mmap_transfer (self, capture_avail, playback_avail);
+  if (moved < 0)
+    {
+      return moved;
+    }
+
+  // What is now queued on the playback side
+  queued = (playback->buffer_size - (playback_avail - moved))
+    * rate_factor (playback);
+  wys_resampler_update_depth (self->resampler, queued);
+  if (timer_scheduled (self))
+    {
+      schedule_wakeup (self, now, queued);
+    }
+  report (self);
+
+  return moved;
+}
+
+
+static void
+make_realtime (WysLoop *self)
+{
+  g_autofree gchar *what = NULL;
+
+  what = g_strdup_printf ("loopback `%s' -> `%s'",
+                          self->capture_name, self->playback_name);
+  wys_rt_make_realtime (what);
+}
+
+
+/** Block until the loop is started.  Returns %FALSE if it is freed
+ * instead. */
+static gboolean
+wait_for_start (WysLoop *self)
+{
+  gboolean running;
+
+  g_mutex_lock (&self->lock);
+  while (g_atomic_int_get (&self->running)
+         && !g_atomic_int_get (&self->started))
+    {
+      g_cond_wait (&self->cond, &self->lock);
+    }
+  running = g_atomic_int_get (&self->running);
+  g_mutex_unlock (&self->lock);
+
+  return running;
+}
+
+
+/** Count an xrun against whichever side ran out */
+static void
+count_xrun (WysLoop           *self,
+            snd_pcm_sframes_t  err)
+{
+  WysStatsXrun xrun = WYS_STATS_ERROR;
+
+  if (!self->stats)
+    {
+      return;
+    }
+
+  if (err == -EPIPE)
+    {
+      if (snd_pcm_state (self->playback) == SND_PCM_STATE_XRUN)
+        {
+          xrun = WYS_STATS_UNDERRUN;
+        }
+      else if (snd_pcm_state (self->capture) == SND_PCM_STATE_XRUN)
+        {
+          xrun = WYS_STATS_OVERRUN;
+        }
+    }
+
+  wys_stats_xrun (self->stats, xrun);
+}
+
+
+/** Note a problem for the main thread to log from the stats, which
+ * WysAudio always sets, as logging here could block a real-time
+ * thread */
+static void
+report_failure (WysLoop     *self,
+                const gchar *what,
+                int          err)
+{
+  if (self->stats)
+    {
+      wys_stats_failed (self->stats, what, err);
+    }
+}
+
+
+static gboolean
+begin_streaming (WysLoop *self)
+{
+  int err;
+
+  err = start_streams (self);
+  if (err < 0)
+    {
+      report_failure (self, "Error starting loopback", err);
+      return FALSE;
+    }
+
+  self->streaming = TRUE;
+  self->flowing = FALSE;
+  self->xrun_time = 0;
+  return TRUE;
+}
+
+
+/** Back to just prepared */
+static void
+end_streaming (WysLoop *self)
+{
+  snd_pcm_drop (self->capture);
+  snd_pcm_drop (self->playback);
+  self->streaming = FALSE;
+}
+
+
+/** Move the audio which has arrived, or recover from the error @err
+ * waiting for it.  Returns %FALSE on an unrecoverable error. */
+static gboolean
+service (WysLoop *self,
+         int      err)
+{
+  snd_pcm_sframes_t frames;
+
+  if (self->stats)
+    {
+      wys_stats_wakeup (self->stats);
+    }
+
+  frames = err < 0 ? err : transfer (self);
+  if (frames < 0)
+    {
+      count_xrun (self, frames);
+      wys_jitter_xrun (self->jitter, g_get_monotonic_time ());
+      // Recovery is timed from the first of a run of xruns
+      if (!self->xrun_time)
+        {
+          self->xrun_time = g_get_monotonic_time ();
+        }
+
+      err = start_streams (self);
+      if (err < 0)
+        {
+          report_failure (self, "Error restarting loopback", err);
+          return FALSE;
+        }
+      return TRUE;
+    }
+
+  if (self->xrun_time && frames > 0)
+    {
+      if (self->stats)
+        {
+          wys_stats_recovered (self->stats,
+                               g_get_monotonic_time () - self->xrun_time);
+        }
+      self->xrun_time = 0;
+    }
+
+  if (!self->flowing && frames > 0)
+    {
+      if (self->stats)
+        {
+          wys_stats_flowing (self->stats,
+                             g_get_monotonic_time () - self->start_time);
+        }
+      self->flowing = TRUE;
+    }
+
+  return TRUE;
+}
+
+
+/** Sleep until it's time to move audio or the loop is stopped.
+ * Returns 1 if it's time, like snd_pcm_wait(). */
+static int
+wait_for_timer (WysLoop *self)
+{
+  g_mutex_lock (&self->lock);
+  while (g_atomic_int_get (&self->running)
+         && g_atomic_int_get (&self->started)
+         && g_cond_wait_until (&self->cond, &self->lock, self->wakeup_time))
+    {
+    }
+  g_mutex_unlock (&self->lock);
+
+  return g_get_monotonic_time () >= self->wakeup_time ? 1 : 0;
+}
+
+
+/** Move audio until the loop is stopped.  Returns %FALSE on an
+ * unrecoverable error. */
+static gboolean
+run (WysLoop *self)
+{
+  int err;
+
+  if (!begin_streaming (self))
+    {
+      return FALSE;
+    }
+
+  while (g_atomic_int_get (&self->running)
+         && g_atomic_int_get (&self->started))
+    {
+      // Wait with a timeout so that we notice being stopped
+      err = timer_scheduled (self)
+        ? wait_for_timer (self)
+        : snd_pcm_wait (self->capture, LOOP_WAIT_MS);
+      if (err == 0)
+        {
+          continue;
+        }
+
+      if (!service (self, err))
+        {
+          return FALSE;
+        }
+    }
+
+  end_streaming (self);
+  return TRUE;
+}
+
+
+/**
+ * wys_loop_engine_prepare:
+ * @fds: where to store the descriptors
+ * @space: how many descriptors there is room for
+ * @deadline: (inout): lowered to when the loop next needs servicing,
+ * in monotonic time, if it's timer scheduled
+ *
+ * Called by the engine, from its thread, before it polls.  Starts or
+ * stops the streams to match wys_loop_start() and wys_loop_stop().
+ *
+ * Returns: the number of descriptors to poll for the loop, which may
+ * be 0
+ */
+guint
+wys_loop_engine_prepare (WysLoop       *self,
+                         struct pollfd *fds,
+                         guint          space,
+                         gint64        *deadline)
+{
+  const gboolean started = g_atomic_int_get (&self->started);
+  int count;
+
+  if (!g_atomic_int_get (&self->ready) || self->failed)
+    {
+      return 0;
+    }
+
+  if (started && !self->streaming)
+    {
+      self->failed = !begin_streaming (self);
+    }
+  else if (!started && self->streaming)
+    {
+      end_streaming (self);
+    }
+
+  if (!self->streaming)
+    {
+      return 0;
+    }
+
+  if (timer_scheduled (self))
+    {
+      *deadline = MIN (*deadline, self->wakeup_time);
+      return 0;
+    }
+
+  // Audio is moved when the capture side has a period; the playback
+  // side is kept deep enough not to need waking for
+  count = snd_pcm_poll_descriptors_count (self->capture);
+  if (count <= 0 || (guint)count > space)
+    {
+      report_failure (self, "Too many descriptors to poll", 0);
+      end_streaming (self);
+      self->failed = TRUE;
+      return 0;
+    }
+
+  return snd_pcm_poll_descriptors (self->capture, fds, count);
+}
+
+
+/**
+ * wys_loop_engine_dispatch:
+ * @fds: the descriptors from wys_loop_engine_prepare(), after polling
+ *
+ * Called by the engine, from its thread, after polling, to move any
+ * audio that has arrived or is due.
+ */
+void
+wys_loop_engine_dispatch (WysLoop       *self,
+                          struct pollfd *fds,
+                          guint          n_fds)
+{
+  unsigned short revents = 0;
+  int err = 1;
+
+  if (!self->streaming || self->failed)
+    {
+      return;
+    }
+
+  if (timer_scheduled (self))
+    {
+      if (g_get_monotonic_time () < self->wakeup_time)
+        {
+          return;
+        }
+    }
+  else if (n_fds == 0)
+    {
+      return;
+    }
+  else
+    {
+      err = snd_pcm_poll_descriptors_revents (self->capture, fds, n_fds,
+                                              &revents);
+      if (err >= 0 && !(revents & (POLLIN | POLLERR)))
+        {
+          return;
+        }
+    }
+
+  if (!service (self, err < 0 ? err : 1))
+    {
+      end_streaming (self);
+      self->failed = TRUE;
+    }
+}
+
+
+/** The jitter tracker works in loop frames */
+static WysJitter *
+new_jitter (WysLoop *self)
+{
+  const struct pcm_params *playback = &self->playback_params;
+  const snd_pcm_uframes_t period = self->capture_params.period_size
+    * rate_factor (&self->capture_params);
+  const snd_pcm_uframes_t buffer = playback->buffer_size
+    * rate_factor (playback);
+  snd_pcm_uframes_t max_depth = US_TO_FRAMES (self->max_latency);
+
+  // We may not have got as big a buffer as we asked for
+  if (buffer < max_depth + 2 * period)
+    {
+      max_depth = buffer > 2 * period ? buffer - 2 * period : period;
+    }
+
+  self->max_depth = max_depth;
+
+  return wys_jitter_new (LOOP_RATE, period,
+                         US_TO_FRAMES (self->min_latency), max_depth,
+                         US_TO_FRAMES (LOOP_LATENCY));
+}
+
+
+static gpointer
+loop_thread (WysLoop *self)
+{
+  // Only fails when the loop is freed
+  if (!open_pcms (self))
+    {
+      return NULL;
+    }
+
+  self->jitter = new_jitter (self);
+  set_up_conversion (self);
+
+  // From here on the engine's thread owns the loop
+  if (self->engine)
+    {
+      g_atomic_int_set (&self->ready, TRUE);
+      if (wys_engine_add (self->engine, self))
+        {
+          return NULL;
+        }
+
+      report_failure (self, "Audio engine not running, using a thread"
+                      " of its own", 0);
+    }
+
+  make_realtime (self);
+
+  while (wait_for_start (self))
+    {
+      if (!run (self))
+        {
+          break;
+        }
+    }
+
+  close_pcms (self);
+  return NULL;
+}
+
+
+/**
+ * wys_loop_new:
+ * @capture: the ALSA card name to capture from
+ * @playback: the ALSA card name to play back to
+ * @capture_pcms: (allow-none): PCM name templates to try for
+ * capture, in order of preference
+ * @playback_pcms: (allow-none): PCM name templates to try for
+ * playback, in order of preference
+ * @min_latency: the least audio to keep queued for playback, in
+ * microseconds, or 0 for the default
+ * @max_latency: the most audio to keep queued for playback, in
+ * microseconds, or 0 for the default
+ * @period_time: how often to move audio, in microseconds, or 0 for
+ * the default
+ * @timer_scheduling: whether to turn off period interrupts where the
+ * driver allows and wake on timers instead, as late as the playback
+ * queue allows
+ * @dsp: (allow-none): processing stages to run the audio through, as
+ * for wys_dsp_new()
+ * @engine: (allow-none): the engine to move the audio in, or %NULL
+ * for the loop to have a thread of its own
+ *
+ * Create a loopback and start opening and configuring its PCMs in the
+ * background.  No audio flows until wys_loop_start() is called, so
+ * the loop can be created as soon as a call is likely.
+ *
+ * The PCM name templates have #WYS_LOOP_PCM_CARD replaced with the
+ * card name.  The first pair that works is cached and tried first
+ * the next time.
+ *
+ * How much is kept queued for playback grows, up to @max_latency, if
+ * the loop isn't serviced in time.  When it has had
+ * room to spare for a while it shrinks again, down to @min_latency.
+ */
+WysLoop *
+wys_loop_new (const gchar         *capture,
+              const gchar         *playback,
+              const gchar * const *capture_pcms,
+              const gchar * const *playback_pcms,
+              guint                min_latency,
+              guint                max_latency,
+              guint                period_time,
+              gboolean             timer_scheduling,
+              const gchar * const *dsp,
+              WysEngine           *engine)
+{
+  WysLoop *self;
+  int err;
+
+  self = g_new0 (WysLoop, 1);
+  self->capture_name = g_strdup (capture);
+  self->playback_name = g_strdup (playback);
+  self->capture_pcms = g_strdupv
+    ((gchar **)(capture_pcms ? capture_pcms : DEFAULT_PCMS));
+  self->playback_pcms = g_strdupv
+    ((gchar **)(playback_pcms ? playback_pcms : DEFAULT_PCMS));
+  self->min_latency = min_latency ? min_latency : LOOP_MIN_LATENCY;
+  self->max_latency = MAX (self->min_latency,
+                           max_latency ? max_latency : LOOP_MAX_LATENCY);
+  self->period_time = period_time ? period_time : LOOP_PERIOD_TIME;
+  self->timer_scheduling = timer_scheduling;
+  self->engine = engine;
+  self->running = TRUE;
+  g_mutex_init (&self->lock);
+  g_cond_init (&self->cond);
+  self->resampler = wys_resampler_new (LOOP_CHANNELS, LOOP_RATE,
+                                       US_TO_FRAMES (LOOP_LATENCY));
+  self->dsp = wys_dsp_new (dsp, LOOP_RATE);
+
+  err = wys_rt_spawn (&self->thread,
+                      (gpointer (*) (gpointer)) loop_thread, self);
+  if (err != 0)
+    {
+      g_warning ("Error creating loopback thread: %s",
+                 g_strerror (err));
+      wys_loop_free (self);
+      return NULL;
+    }
+  self->have_thread = TRUE;
+
+  return self;
+}
+
+
+void
+wys_loop_free (WysLoop *self)
+{
+  if (self->have_thread)
+    {
+      g_mutex_lock (&self->lock);
+      g_atomic_int_set (&self->running, FALSE);
+      g_cond_signal (&self->cond);
+      g_mutex_unlock (&self->lock);
+
+      pthread_join (self->thread, NULL);
+    }
+
+  if (self->engine)
+    {
+      // No-op if the thread never got as far as adding the loop, in
+      // which case it has closed any PCMs itself
+      wys_engine_remove (self->engine, self);
+      if (self->capture && self->streaming)
+        {
+          end_streaming (self);
+        }
+      close_pcms (self);
+    }
+
+  g_cond_clear (&self->cond);
+  g_mutex_clear (&self->lock);
+  g_clear_pointer (&self->jitter, wys_jitter_free);
+  free_conversion (self);
+  g_clear_pointer (&self->dsp, wys_dsp_free);
+  wys_resampler_free (self->resampler);
+  g_strfreev (self->playback_pcms);
+  g_strfreev (self->capture_pcms);
+  g_free (self->playback_name);
+  g_free (self->capture_name);
+  g_free (self);
+}
+
+
+/** Let audio flow, as soon as the PCMs are open */
+void
+wys_loop_start (WysLoop *self)
+{
+  g_mutex_lock (&self->lock);
+  if (!g_atomic_int_get (&self->started))
+    {
+      self->start_time = g_get_monotonic_time ();
+      g_atomic_int_set (&self->started, TRUE);
+      g_cond_signal (&self->cond);
+    }
+  g_mutex_unlock (&self->lock);
+
+  if (self->engine)
+    {
+      wys_engine_wake (self->engine);
+    }
+}
+
+
+/** Stop audio flowing but keep the PCMs open and configured */
+void
+wys_loop_stop (WysLoop *self)
+{
+  g_mutex_lock (&self->lock);
+  g_atomic_int_set (&self->started, FALSE);
+  // A timer-scheduled loop may be asleep on this
+  g_cond_signal (&self->cond);
+  g_mutex_unlock (&self->lock);
+
+  if (self->engine)
+    {
+      wys_engine_wake (self->engine);
+    }
+}
+
+
+/**
+ * wys_loop_set_echo:
+ * @echo: (allow-none): the echo canceller
+ * @reference: %TRUE if this loop plays the far-end audio, %FALSE if
+ * it captures the microphone
+ *
+ * Share an echo canceller between the loops in both directions.  Must
+ * be called before wys_loop_start().  The canceller must outlive the
+ * loop.
+ */
+void
+wys_loop_set_echo (WysLoop  *self,
+                   WysEcho  *echo,
+                   gboolean  reference)
+{
+  g_mutex_lock (&self->lock);
+  self->echo = echo;
+  self->echo_reference = reference;
+  g_mutex_unlock (&self->lock);
+}
+
+
+/**
+ * wys_loop_set_stats:
+ * @stats: (allow-none): the counters
+ *
+ * Count the loop's glitches in @stats.  Must be called before
+ * wys_loop_start().  The counters must outlive the loop.
+ */
+void
+wys_loop_set_stats (WysLoop  *self,
+                    WysStats *stats)
+{
+  g_mutex_lock (&self->lock);
+  self->stats = stats;
+  g_mutex_unlock (&self->lock);
+}
+
+
+/**
+ * wys_loop_set_muted:
+ *
+ * Play silence instead of the captured audio, or stop doing so.  The
+ * streams keep running either way, so audio resumes without the
+ * delay of restarting them.  May be called at any time.
+ */
+void
+wys_loop_set_muted (WysLoop  *self,
+                    gboolean  muted)
+{
+  g_atomic_int_set (&self->muted, muted);
+}
+
+
+/** Tell a loop which is still looking for usable PCMs to try again */
+void
+wys_loop_devices_changed (WysLoop *self)
+{
+  g_mutex_lock (&self->lock);
+  g_atomic_int_inc (&self->devices_serial);
+  g_cond_signal (&self->cond);
+  g_mutex_unlock (&self->lock);
+}
+
+
+/** The estimated drift of the capture clock relative to the playback
+ * clock, in parts per million.  May be called from any thread. */
+gdouble
+wys_loop_get_drift_ppm (WysLoop *self)
+{
+  return g_atomic_int_get (&self->drift_mppm) / 1000.0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_LOOP_H__
+#define WYS_LOOP_H__
+
+#include "wys-echo.h"
+#include "wys-stats.h"
+
+#include <glib.h>
+
+#include <poll.h>
+
+G_BEGIN_DECLS
+
+/** The rate audio is looped at, whatever the PCMs' rates */
+#define WYS_LOOP_RATE 48000
+
+/** Replaced with the card name in PCM name templates */
+#define WYS_LOOP_PCM_CARD "{card}"
+
+typedef struct _WysLoop WysLoop;
+/** Moves the audio for several loops, see wys-engine.h */
+typedef struct _WysEngine WysEngine;
+
+WysLoop *wys_loop_new             (const gchar         *capture,
+                                   const gchar         *playback,
+                                   const gchar * const *capture_pcms,
+                                   const gchar * const *playback_pcms,
+                                   guint                min_latency,
+                                   guint                max_latency,
+                                   guint                period_time,
+                                   gboolean             timer_scheduling,
+                                   const gchar * const *dsp,
+                                   WysEngine           *engine);
+void     wys_loop_free            (WysLoop             *loop);
+void     wys_loop_start           (WysLoop             *loop);
+void     wys_loop_stop            (WysLoop             *loop);
+void     wys_loop_set_echo        (WysLoop             *loop,
+                                   WysEcho             *echo,
+                                   gboolean             reference);
+void     wys_loop_set_stats       (WysLoop             *loop,
+                                   WysStats            *stats);
+void     wys_loop_set_muted       (WysLoop             *loop,
+                                   gboolean             muted);
+void     wys_loop_devices_changed (WysLoop             *loop);
+gdouble  wys_loop_get_drift_ppm   (WysLoop             *loop);
+gchar   *wys_loop_expand_pcm      (const gchar         *pcm,
+                                   const gchar         *card);
+
+/* For the engine's thread only */
+guint    wys_loop_engine_prepare  (WysLoop             *loop,
+                                   struct pollfd       *fds,
+                                   guint                space,
+                                   gint64              *deadline);
+void     wys_loop_engine_dispatch (WysLoop             *loop,
+                                   struct pollfd       *fds,
+                                   guint                n_fds);
+
+G_END_DECLS
+
+#endif /* WYS_LOOP_H__ */
@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2019 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Bob Ham <bob.ham@puri.sm>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "wys-machine-conf.h"
+#include "wys-machine-db.h"
+#include "config.h"
+#include "mchk-machine-check.h"
+
+#include <glib/gstdio.h>
+#include <gio/gunixinputstream.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+
+/** Compiled from all the directories, so that a lookup doesn't have
+ * to try each of them; opened on first use */
+static WysMachineDb *machine_db;
+static gboolean machine_db_opened;
+
+
+static WysMachineDb *
+get_machine_db (void)
+{
+  if (!machine_db_opened)
+    {
+      machine_db = wys_machine_db_open ();
+      machine_db_opened = TRUE;
+    }
+
+  return machine_db;
+}
+
+
+/** This function will close @fd */
+static gchar **
+read_machine_conf_file (const gchar *filename,
+                        int          fd)
+{
+  GInputStream *unix_stream;
+  GDataInputStream *data_stream;
+  GPtrArray *lines;
+  gchar *line;
+  GError *error = NULL;
+
+  g_debug ("Reading machine configuration file `%s'", filename);
+
+  unix_stream = g_unix_input_stream_new (fd, TRUE);
+  g_assert (unix_stream != NULL);
+
+  data_stream = g_data_input_stream_new (unix_stream);
+  g_assert (data_stream != NULL);
+  g_object_unref (unix_stream);
+
+  lines = g_ptr_array_new ();
+
+  for (;;)
+    {
+      line = g_data_input_stream_read_line_utf8
+        (data_stream, NULL, NULL, &error);
+
+      if (error)
+        {
+          g_warning ("Error reading from machine"
+                     " configuration file `%s': %s",
+                     filename, error->message);
+          g_error_free (error);
+          break;
+        }
+      else if (!line) // EOF
+        {
+          break;
+        }
+
+      g_strstrip (line);
+
+      // Skip comments and empty lines
+      if (line[0] == '#' || line[0] == '\0')
+        {
+          g_free (line);
+          continue;
+        }
+
+      g_ptr_array_add (lines, line);
+    }
+
+  g_object_unref (data_stream);
+
+  if (lines->len == 0)
+    {
+      g_ptr_array_free (lines, TRUE);
+      return NULL;
+    }
+
+  g_ptr_array_add (lines, NULL);
+  return (gchar **)g_ptr_array_free (lines, FALSE);
+}
+
+
+static gchar **
+dir_machine_conf (const gchar *dir,
+                  const gchar *machine,
+                  const gchar *key)
+{
+  gchar *filename;
+  int fd;
+  gchar **value = NULL;
+
+  filename = g_build_filename (dir, APP_DATA_NAME,
+                               "machine-conf",
+                               machine, key, NULL);
+
+  g_debug ("Trying machine configuration file `%s'",
+           filename);
+
+  fd = g_open (filename, O_RDONLY, 0);
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          // The error isn't that the file doesn't exist
+          g_warning ("Error opening machine"
+                     " configuration file `%s': %s",
+                     filename, g_strerror (errno));
+        }
+    }
+  else
+    {
+      value = read_machine_conf_file (filename, fd);
+    }
+
+  g_free (filename);
+  return value;
+}
+
+
+/**
+ * wys_machine_conf_lines:
+ * @machine: the machine name
+ * @key: the configuration key
+ *
+ * Look up the machine configuration file @key for @machine and read
+ * all of its lines, leaving out comments and empty lines.
+ *
+ * Returns: (nullable) (transfer full): the lines or %NULL if there
+ * is no such file or it is empty.
+ */
+gchar **
+wys_machine_conf_lines (const gchar *machine,
+                        const gchar *key)
+{
+  gchar **value = NULL;
+  const gchar * const *dirs, * const *dir;
+  WysMachineDb *db;
+
+  db = get_machine_db ();
+  if (db)
+    {
+      return wys_machine_db_conf_lines (db, machine, key);
+    }
+
+#define try_dir(d)                                      \
+  value = dir_machine_conf (d, machine, key);           \
+  if (value)                                            \
+    {                                                   \
+      return value;                                     \
+    }
+
+
+  try_dir (g_get_user_config_dir ());
+
+  dirs = g_get_system_config_dirs ();
+  for (dir = dirs; *dir; ++dir)
+    {
+      try_dir (*dir);
+    }
+
+  try_dir (SYSCONFDIR);
+  try_dir (DATADIR);
+
+  dirs = g_get_system_data_dirs ();
+  for (dir = dirs; *dir; ++dir)
+    {
+      try_dir (*dir);
+    }
+
+#undef try_dir
+
+  return NULL;
+}
+
+
+/**
+ * wys_machine_conf:
+ * @machine: the machine name
+ * @key: the configuration key
+ *
+ * Like wys_machine_conf_lines() but only returns the first line.
+ *
+ * Returns: (nullable) (transfer full): the value or %NULL.
+ */
+gchar *
+wys_machine_conf (const gchar *machine,
+                  const gchar *key)
+{
+  gchar **lines;
+  gchar *value;
+
+  lines = wys_machine_conf_lines (machine, key);
+  if (!lines)
+    {
+      return NULL;
+    }
+
+  value = g_strdup (lines[0]);
+  g_strfreev (lines);
+  return value;
+}
+
+
+/**
+ * wys_machine_conf_save:
+ * @machine: the machine name
+ * @key: the configuration key
+ * @value: the value, a single line
+ * @comment: (allow-none): a comment to precede it with
+ * @error: return location for a #GError
+ *
+ * Write @value to the machine configuration file @key for @machine in
+ * the user's configuration directory, where wys_machine_conf_lines()
+ * looks first.
+ *
+ * Returns: whether the file was written
+ */
+gboolean
+wys_machine_conf_save (const gchar  *machine,
+                       const gchar  *key,
+                       const gchar  *value,
+                       const gchar  *comment,
+                       GError      **error)
+{
+  g_autofree gchar *dir = NULL;
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *contents = NULL;
+
+  dir = g_build_filename (g_get_user_config_dir (), APP_DATA_NAME,
+                          "machine-conf", machine, NULL);
+  if (g_mkdir_with_parents (dir, 0755) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                   "Error creating machine configuration directory `%s': %s",
+                   dir, g_strerror (errno));
+      return FALSE;
+    }
+
+  filename = g_build_filename (dir, key, NULL);
+  if (comment)
+    {
+      contents = g_strdup_printf ("# %s\n%s\n", comment, value);
+    }
+  else
+    {
+      contents = g_strdup_printf ("%s\n", value);
+    }
+
+  if (!g_file_set_contents (filename, contents, -1, error))
+    {
+      return FALSE;
+    }
+
+  // The database is now stale
+  g_clear_pointer (&machine_db, wys_machine_db_free);
+  machine_db_opened = FALSE;
+  return TRUE;
+}
+
+
+/**
+ * wys_machine_conf_check:
+ * @machine: (allow-none): the machine name, or %NULL to read it
+ * @passed: (out): return location for the check result
+ * @error: return location for a #GError
+ *
+ * Check @machine against wys's machine-check whitelist and
+ * blacklist, as mchk_check_machine() does.
+ *
+ * Returns: %FALSE on error
+ */
+gboolean
+wys_machine_conf_check (const gchar  *machine,
+                        gboolean     *passed,
+                        GError      **error)
+{
+  WysMachineDb *db;
+
+  db = machine ? get_machine_db () : NULL;
+  if (db)
+    {
+      *passed = wys_machine_db_check (db, APP_DATA_NAME, machine);
+      return TRUE;
+    }
+
+  return mchk_check_machine (APP_DATA_NAME, machine, passed, error);
+}
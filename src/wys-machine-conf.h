@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2019 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Bob Ham <bob.ham@puri.sm>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_MACHINE_CONF_H__
+#define WYS_MACHINE_CONF_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/** The pseudo-machine whose entries apply when a machine has none */
+#define WYS_MACHINE_CONF_DEFAULT "default"
+
+gchar    *wys_machine_conf       (const gchar  *machine,
+                                  const gchar  *key);
+gchar   **wys_machine_conf_lines (const gchar  *machine,
+                                  const gchar  *key);
+gboolean  wys_machine_conf_save  (const gchar  *machine,
+                                  const gchar  *key,
+                                  const gchar  *value,
+                                  const gchar  *comment,
+                                  GError      **error);
+gboolean  wys_machine_conf_check (const gchar  *machine,
+                                  gboolean     *passed,
+                                  GError      **error);
+
+G_END_DECLS
+
+#endif /* WYS_MACHINE_CONF_H__ */
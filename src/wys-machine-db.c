@@ -0,0 +1,661 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "wys-machine-db.h"
+#include "config.h"
+
+#include <glib/gstdio.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+
+#define DB_MAGIC      "WYSMDB1"
+/** Keys the entries are found by */
+#define KEY_DIRS      "dirs"
+#define KEY_CONF      "conf\n%s\n%s"
+#define KEY_CHECK     "check\n%s\n%s"
+#define KEY_CHECK_ANY "check\n%s"
+
+
+/* The database is a cache private to the user, so it's in native
+ * byte order.  It's laid out as the header, the stamps, the hash
+ * slots, the entries and then the strings, which all offsets are
+ * relative to. */
+struct db_header
+{
+  gchar magic[8];
+  guint32 n_stamps;
+  guint32 n_slots;
+  guint32 n_entries;
+  guint32 strings_size;
+};
+
+/** A file or directory the database was compiled from, and its
+ * modification time in nanoseconds or -1 if it didn't exist */
+struct db_stamp
+{
+  guint32 path;
+  guint32 reserved;
+  gint64 mtime;
+};
+
+struct db_entry
+{
+  guint32 hash;
+  guint32 key;
+  guint32 value;
+  guint32 reserved;
+};
+
+
+struct _WysMachineDb
+{
+  GBytes *bytes;
+  const struct db_header *header;
+  const struct db_stamp *stamps;
+  /** Open addressed, holding entry indices plus one, 0 if empty */
+  const guint32 *slots;
+  const struct db_entry *entries;
+  const gchar *strings;
+};
+
+
+/** What's found while walking the directories */
+struct compiler
+{
+  /** Keys to values, the first found winning */
+  GHashTable *values;
+  GPtrArray *paths;
+  GArray *mtimes;
+  /** Machine-check parameters whose whitelist has been found, which
+   * settles them for all machines */
+  GHashTable *settled;
+};
+
+
+/** FNV-1a, which unlike g_str_hash() is fixed for files on disk */
+static guint32
+hash_key (const gchar *key)
+{
+  guint32 hash = 2166136261u;
+
+  for (; *key; ++key)
+    {
+      hash = (hash ^ (guchar)*key) * 16777619u;
+    }
+
+  return hash;
+}
+
+
+/** In the same order as wys_machine_conf_lines() and
+ * mchk_check_machine() look in them */
+static GPtrArray *
+search_dirs (void)
+{
+  GPtrArray *dirs = g_ptr_array_new ();
+  const gchar * const *dir;
+
+  g_ptr_array_add (dirs, (gpointer)g_get_user_config_dir ());
+  for (dir = g_get_system_config_dirs (); *dir; ++dir)
+    {
+      g_ptr_array_add (dirs, (gpointer)*dir);
+    }
+  g_ptr_array_add (dirs, SYSCONFDIR);
+  g_ptr_array_add (dirs, DATADIR);
+  for (dir = g_get_system_data_dirs (); *dir; ++dir)
+    {
+      g_ptr_array_add (dirs, (gpointer)*dir);
+    }
+  g_ptr_array_add (dirs, NULL);
+
+  return dirs;
+}
+
+
+static gint64
+path_mtime (const gchar *path)
+{
+  struct stat st;
+
+  if (stat (path, &st) != 0)
+    {
+      return -1;
+    }
+
+  return st.st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000)
+    + st.st_mtim.tv_nsec;
+}
+
+
+/** Record @path as a source of the database.  Returns whether it
+ * exists. */
+static gboolean
+stamp (struct compiler *c,
+       const gchar     *path)
+{
+  const gint64 mtime = path_mtime (path);
+
+  g_ptr_array_add (c->paths, g_strdup (path));
+  g_array_append_val (c->mtimes, mtime);
+
+  return mtime != -1;
+}
+
+
+/** Read the lines of @path which aren't comments or empty, as for
+ * wys_machine_conf_lines() */
+static gchar **
+read_lines (const gchar *path)
+{
+  g_autofree gchar *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  GPtrArray *kept;
+  GError *error = NULL;
+  gchar **line;
+
+  if (!g_file_get_contents (path, &contents, NULL, &error))
+    {
+      g_warning ("Error reading `%s': %s", path, error->message);
+      g_error_free (error);
+      return NULL;
+    }
+
+  kept = g_ptr_array_new ();
+  lines = g_strsplit (contents, "\n", -1);
+  for (line = lines; *line; ++line)
+    {
+      g_strstrip (*line);
+      if ((*line)[0] != '#' && (*line)[0] != '\0')
+        {
+          g_ptr_array_add (kept, g_strdup (*line));
+        }
+    }
+
+  if (kept->len == 0)
+    {
+      g_ptr_array_free (kept, TRUE);
+      return NULL;
+    }
+
+  g_ptr_array_add (kept, NULL);
+  return (gchar **)g_ptr_array_free (kept, FALSE);
+}
+
+
+static void
+add_value (struct compiler *c,
+           gchar           *key,
+           const gchar     *value)
+{
+  if (g_hash_table_contains (c->values, key))
+    {
+      g_free (key);
+      return;
+    }
+
+  g_hash_table_insert (c->values, key, g_strdup (value));
+}
+
+
+static void
+compile_conf (struct compiler *c,
+              const gchar     *base)
+{
+  g_autofree gchar *root = NULL;
+  GDir *machines, *keys;
+  const gchar *machine, *key;
+
+  root = g_build_filename (base, APP_DATA_NAME, "machine-conf", NULL);
+  if (!stamp (c, root) || !(machines = g_dir_open (root, 0, NULL)))
+    {
+      return;
+    }
+
+  while ((machine = g_dir_read_name (machines)))
+    {
+      g_autofree gchar *dir = g_build_filename (root, machine, NULL);
+
+      if (!stamp (c, dir) || !(keys = g_dir_open (dir, 0, NULL)))
+        {
+          continue;
+        }
+
+      while ((key = g_dir_read_name (keys)))
+        {
+          g_autofree gchar *path = g_build_filename (dir, key, NULL);
+          g_auto(GStrv) lines = NULL;
+          g_autofree gchar *value = NULL;
+
+          stamp (c, path);
+          lines = read_lines (path);
+          if (lines)
+            {
+              value = g_strjoinv ("\n", lines);
+              add_value (c, g_strdup_printf (KEY_CONF, machine, key),
+                         value);
+            }
+        }
+      g_dir_close (keys);
+    }
+  g_dir_close (machines);
+}
+
+
+/** Record @result for the machines in @list, unless already decided.
+ * Returns whether the list exists. */
+static gboolean
+compile_list (struct compiler *c,
+              const gchar     *dir,
+              const gchar     *list,
+              const gchar     *param,
+              const gchar     *result)
+{
+  g_autofree gchar *path = g_build_filename (dir, list, NULL);
+  g_auto(GStrv) lines = NULL;
+  gchar **line;
+
+  if (!stamp (c, path))
+    {
+      return FALSE;
+    }
+
+  lines = read_lines (path);
+  for (line = lines; line && *line; ++line)
+    {
+      add_value (c, g_strdup_printf (KEY_CHECK, param, *line), result);
+    }
+
+  return TRUE;
+}
+
+
+/** Mirror mchk_check_machine(): the first blacklist a machine is in
+ * fails it, unless a whitelist came first, and the first whitelist
+ * settles every machine */
+static void
+compile_check (struct compiler *c,
+               const gchar     *base)
+{
+  g_autofree gchar *root = NULL;
+  GDir *params;
+  const gchar *param;
+
+  root = g_build_filename (base, "machine-check", NULL);
+  if (!stamp (c, root) || !(params = g_dir_open (root, 0, NULL)))
+    {
+      return;
+    }
+
+  while ((param = g_dir_read_name (params)))
+    {
+      g_autofree gchar *dir = g_build_filename (root, param, NULL);
+
+      if (!stamp (c, dir) || g_hash_table_contains (c->settled, param))
+        {
+          continue;
+        }
+
+      compile_list (c, dir, "blacklist", param, "0");
+      if (compile_list (c, dir, "whitelist", param, "1"))
+        {
+          add_value (c, g_strdup_printf (KEY_CHECK_ANY, param), "0");
+          g_hash_table_add (c->settled, g_strdup (param));
+        }
+    }
+  g_dir_close (params);
+}
+
+
+static guint32
+add_string (GString     *strings,
+            const gchar *str)
+{
+  const guint32 offset = strings->len;
+
+  g_string_append_len (strings, str, strlen (str) + 1);
+  return offset;
+}
+
+
+static GBytes *
+serialize (struct compiler *c)
+{
+  struct db_header header = { DB_MAGIC };
+  g_autofree struct db_stamp *stamps = NULL;
+  g_autofree guint32 *slots = NULL;
+  g_autofree struct db_entry *entries = NULL;
+  GString *strings = g_string_new (NULL);
+  GByteArray *data;
+  GHashTableIter iter;
+  gpointer key, value;
+  guint32 i, slot;
+
+  header.n_stamps = c->paths->len;
+  header.n_entries = g_hash_table_size (c->values);
+  // At most half full, so probes are short
+  header.n_slots = 8;
+  while (header.n_slots < 2 * header.n_entries)
+    {
+      header.n_slots *= 2;
+    }
+
+  stamps = g_new0 (struct db_stamp, header.n_stamps);
+  for (i = 0; i < header.n_stamps; ++i)
+    {
+      stamps[i].path = add_string (strings, c->paths->pdata[i]);
+      stamps[i].mtime = g_array_index (c->mtimes, gint64, i);
+    }
+
+  slots = g_new0 (guint32, header.n_slots);
+  entries = g_new0 (struct db_entry, header.n_entries);
+  g_hash_table_iter_init (&iter, c->values);
+  for (i = 0; g_hash_table_iter_next (&iter, &key, &value); ++i)
+    {
+      entries[i].hash = hash_key (key);
+      entries[i].key = add_string (strings, key);
+      entries[i].value = add_string (strings, value);
+
+      slot = entries[i].hash & (header.n_slots - 1);
+      while (slots[slot])
+        {
+          slot = (slot + 1) & (header.n_slots - 1);
+        }
+      slots[slot] = i + 1;
+    }
+  header.strings_size = strings->len;
+
+  data = g_byte_array_new ();
+  g_byte_array_append (data, (guint8 *)&header, sizeof (header));
+  g_byte_array_append (data, (guint8 *)stamps,
+                       header.n_stamps * sizeof (*stamps));
+  g_byte_array_append (data, (guint8 *)slots,
+                       header.n_slots * sizeof (*slots));
+  g_byte_array_append (data, (guint8 *)entries,
+                       header.n_entries * sizeof (*entries));
+  g_byte_array_append (data, (guint8 *)strings->str, strings->len);
+  g_string_free (strings, TRUE);
+
+  return g_byte_array_free_to_bytes (data);
+}
+
+
+static GBytes *
+compile (const gchar * const *dirs,
+         const gchar         *dirs_key)
+{
+  struct compiler c;
+  const gchar * const *dir;
+  GBytes *bytes;
+
+  c.values = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                    g_free, g_free);
+  c.paths = g_ptr_array_new_with_free_func (g_free);
+  c.mtimes = g_array_new (FALSE, FALSE, sizeof (gint64));
+  c.settled = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                     g_free, NULL);
+
+  add_value (&c, g_strdup (KEY_DIRS), dirs_key);
+  for (dir = dirs; *dir; ++dir)
+    {
+      compile_conf (&c, *dir);
+      compile_check (&c, *dir);
+    }
+
+  bytes = serialize (&c);
+
+  g_debug ("Compiled machine database from %u files and directories,"
+           " %u entries", c.paths->len, g_hash_table_size (c.values) - 1);
+
+  g_hash_table_unref (c.settled);
+  g_array_free (c.mtimes, TRUE);
+  g_ptr_array_free (c.paths, TRUE);
+  g_hash_table_unref (c.values);
+
+  return bytes;
+}
+
+
+/** Takes @bytes.  Returns %NULL if they aren't a database. */
+static WysMachineDb *
+db_new (GBytes *bytes)
+{
+  WysMachineDb *self;
+  const struct db_header *header;
+  gsize size;
+  const guint8 *data = g_bytes_get_data (bytes, &size);
+  guint64 expected;
+
+  header = (const struct db_header *)data;
+  if (size < sizeof (*header)
+      || memcmp (header->magic, DB_MAGIC, sizeof (header->magic)) != 0
+      || header->n_slots == 0
+      || (header->n_slots & (header->n_slots - 1)) != 0
+      || header->strings_size == 0)
+    {
+      g_bytes_unref (bytes);
+      return NULL;
+    }
+
+  expected = sizeof (*header)
+    + (guint64)header->n_stamps * sizeof (struct db_stamp)
+    + (guint64)header->n_slots * sizeof (guint32)
+    + (guint64)header->n_entries * sizeof (struct db_entry)
+    + header->strings_size;
+  if (size != expected || data[size - 1] != '\0')
+    {
+      g_bytes_unref (bytes);
+      return NULL;
+    }
+
+  self = g_new0 (WysMachineDb, 1);
+  self->bytes = bytes;
+  self->header = header;
+  self->stamps = (const struct db_stamp *)(header + 1);
+  self->slots = (const guint32 *)(self->stamps + header->n_stamps);
+  self->entries = (const struct db_entry *)(self->slots + header->n_slots);
+  self->strings = (const gchar *)(self->entries + header->n_entries);
+
+  return self;
+}
+
+
+static const gchar *
+db_string (WysMachineDb *self,
+           guint32       offset)
+{
+  // The strings end with a NUL, so any offset within them is safe
+  return offset < self->header->strings_size
+    ? self->strings + offset : "";
+}
+
+
+static const gchar *
+lookup (WysMachineDb *self,
+        const gchar  *key)
+{
+  const guint32 hash = hash_key (key);
+  const guint32 mask = self->header->n_slots - 1;
+  const struct db_entry *entry;
+  guint32 slot, i, index;
+
+  for (i = 0, slot = hash & mask; i <= mask; ++i, slot = (slot + 1) & mask)
+    {
+      index = self->slots[slot];
+      if (index == 0 || index > self->header->n_entries)
+        {
+          return NULL;
+        }
+
+      entry = &self->entries[index - 1];
+      if (entry->hash == hash
+          && strcmp (db_string (self, entry->key), key) == 0)
+        {
+          return db_string (self, entry->value);
+        }
+    }
+
+  return NULL;
+}
+
+
+/** Whether nothing the database was compiled from has changed,
+ * which costs a stat() per file rather than an open() per lookup */
+static gboolean
+fresh (WysMachineDb *self,
+       const gchar  *dirs_key)
+{
+  guint32 i;
+
+  if (g_strcmp0 (lookup (self, KEY_DIRS), dirs_key) != 0)
+    {
+      return FALSE;
+    }
+
+  for (i = 0; i < self->header->n_stamps; ++i)
+    {
+      if (path_mtime (db_string (self, self->stamps[i].path))
+          != self->stamps[i].mtime)
+        {
+          g_debug ("Machine database stale, `%s' changed",
+                   db_string (self, self->stamps[i].path));
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+
+static void
+save (const gchar *filename,
+      GBytes      *bytes)
+{
+  g_autofree gchar *dirname = g_path_get_dirname (filename);
+  gsize size;
+  gconstpointer data = g_bytes_get_data (bytes, &size);
+  GError *error = NULL;
+
+  if (g_mkdir_with_parents (dirname, 0755) != 0)
+    {
+      g_warning ("Error creating machine database directory `%s': %s",
+                 dirname, g_strerror (errno));
+      return;
+    }
+
+  if (!g_file_set_contents (filename, data, size, &error))
+    {
+      g_warning ("Error saving machine database `%s': %s",
+                 filename, error->message);
+      g_error_free (error);
+    }
+}
+
+
+/**
+ * wys_machine_db_open:
+ *
+ * Map the machine database from the user's cache directory, first
+ * compiling it if any of the machine configuration or machine-check
+ * files have changed since it was.  The database merges all of the
+ * directories wys_machine_conf_lines() and mchk_check_machine() would
+ * otherwise search on every lookup.
+ *
+ * Returns: (nullable): the database, or %NULL if it couldn't be
+ * compiled
+ */
+WysMachineDb *
+wys_machine_db_open (void)
+{
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *dirs_key = NULL;
+  g_autoptr(GPtrArray) dirs = search_dirs ();
+  GMappedFile *mapped;
+  WysMachineDb *self = NULL;
+  GBytes *bytes;
+
+  filename = g_build_filename (g_get_user_cache_dir (), APP_DATA_NAME,
+                               "machine-db", NULL);
+  dirs_key = g_strjoinv ("\n", (gchar **)dirs->pdata);
+
+  mapped = g_mapped_file_new (filename, FALSE, NULL);
+  if (mapped)
+    {
+      self = db_new (g_mapped_file_get_bytes (mapped));
+      g_mapped_file_unref (mapped);
+    }
+
+  if (self && fresh (self, dirs_key))
+    {
+      g_debug ("Using machine database `%s'", filename);
+      return self;
+    }
+  g_clear_pointer (&self, wys_machine_db_free);
+
+  bytes = compile ((const gchar * const *)dirs->pdata, dirs_key);
+  save (filename, bytes);
+
+  return db_new (bytes);
+}
+
+
+void
+wys_machine_db_free (WysMachineDb *self)
+{
+  g_bytes_unref (self->bytes);
+  g_free (self);
+}
+
+
+/** Like wys_machine_conf_lines() */
+gchar **
+wys_machine_db_conf_lines (WysMachineDb *self,
+                           const gchar  *machine,
+                           const gchar  *key)
+{
+  g_autofree gchar *db_key = g_strdup_printf (KEY_CONF, machine, key);
+  const gchar *value = lookup (self, db_key);
+
+  return value ? g_strsplit (value, "\n", -1) : NULL;
+}
+
+
+/** Like mchk_check_machine().  Returns whether @machine passed. */
+gboolean
+wys_machine_db_check (WysMachineDb *self,
+                      const gchar  *param,
+                      const gchar  *machine)
+{
+  g_autofree gchar *db_key = g_strdup_printf (KEY_CHECK, param, machine);
+  g_autofree gchar *any_key = g_strdup_printf (KEY_CHECK_ANY, param);
+  const gchar *value;
+
+  value = lookup (self, db_key);
+  if (!value)
+    {
+      value = lookup (self, any_key);
+    }
+
+  return !value || value[0] == '1';
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_MACHINE_DB_H__
+#define WYS_MACHINE_DB_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _WysMachineDb WysMachineDb;
+
+WysMachineDb *wys_machine_db_open       (void);
+void          wys_machine_db_free       (WysMachineDb *db);
+gchar       **wys_machine_db_conf_lines (WysMachineDb *db,
+                                         const gchar  *machine,
+                                         const gchar  *key);
+gboolean      wys_machine_db_check      (WysMachineDb *db,
+                                         const gchar  *param,
+                                         const gchar  *machine);
+
+G_END_DECLS
+
+#endif /* WYS_MACHINE_DB_H__ */
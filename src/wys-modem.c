@@ -35,6 +35,8 @@ static const gchar * const WYS_MODEM_HAS_AUDIO[] =
    [WYS_DIRECTION_FROM_NETWORK] = "wys-has-audio-from-network",
    [WYS_DIRECTION_TO_NETWORK]   = "wys-has-audio-to-network"
   };
+static const gchar * const WYS_MODEM_NEEDS_PCMS = "wys-needs-pcms";
+static const gchar * const WYS_MODEM_AUDIBLE = "wys-audible";
 
 struct _WysModem
 {
@@ -43,8 +45,22 @@ struct _WysModem
   MMModemVoice *voice;
   /** Map of D-Bus object paths to MMCall objects */
   GHashTable *calls;
+  /** Paths of new calls whose proxies are being created, and a way
+   * to stop that */
+  GHashTable *pending_calls;
+  GCancellable *cancel;
   /** How many calls have audio, in each direction */
   guint audio_count[2];
+  /** How many calls are in a state where audio is likely soon */
+  guint prepare_count;
+  /** How many calls with audio aren't on hold */
+  guint audible_count;
+  /** What the signals last said, and the idle source which brings
+   * them up to date with the counts */
+  gboolean audio_present[2];
+  gboolean audio_prepared;
+  gboolean audio_audible;
+  guint settle_id;
 };
 
 G_DEFINE_TYPE(WysModem, wys_modem, G_TYPE_OBJECT)
@@ -59,11 +75,18 @@ static GParamSpec *props[PROP_LAST_PROP];
 enum {
   SIGNAL_AUDIO_PRESENT,
   SIGNAL_AUDIO_ABSENT,
+  SIGNAL_AUDIO_PREPARE,
+  SIGNAL_AUDIO_UNPREPARE,
+  SIGNAL_AUDIO_AUDIBLE,
+  SIGNAL_AUDIO_INAUDIBLE,
   SIGNAL_LAST_SIGNAL,
 };
 static guint signals [SIGNAL_LAST_SIGNAL];
 
 
+/** Held calls keep their audio paths, muted, so that taking them off
+ * hold or swapping between calls doesn't tear the paths down and
+ * build them up again */
 static gboolean
 call_state_has_audio (WysDirection direction,
                       MMCallState  state)
@@ -75,6 +98,43 @@ call_state_has_audio (WysDirection direction,
         (direction == WYS_DIRECTION_FROM_NETWORK)
         ? TRUE : FALSE;
     case MM_CALL_STATE_ACTIVE:
+    case MM_CALL_STATE_HELD:
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+
+/** Whether there is audio to be heard, as opposed to the silence of a
+ * held call */
+static gboolean
+call_state_audible (MMCallState state)
+{
+  switch (state)
+    {
+    case MM_CALL_STATE_RINGING_OUT:
+    case MM_CALL_STATE_ACTIVE:
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+
+/** Whether audio is either flowing or about to, so the PCMs should
+ * be opened ahead of time */
+static gboolean
+call_state_needs_pcms (MMCallState state)
+{
+  switch (state)
+    {
+    case MM_CALL_STATE_DIALING:
+    case MM_CALL_STATE_RINGING_OUT:
+    case MM_CALL_STATE_RINGING_IN:
+    case MM_CALL_STATE_ACTIVE:
+    case MM_CALL_STATE_HELD:
+    case MM_CALL_STATE_WAITING:
       return TRUE;
     default:
       return FALSE;
@@ -83,29 +143,164 @@ call_state_has_audio (WysDirection direction,
 
 
 static void
-update_audio_count (WysModem     *self,
-                    WysDirection  direction,
-                    gint          delta)
+settle_present (WysModem     *self,
+                WysDirection  direction,
+                gboolean      present)
 {
-  const guint old_count = self->audio_count[direction];
+  if (self->audio_present[direction] == present
+      || (self->audio_count[direction] > 0) != present)
+    {
+      return;
+    }
 
-  g_assert (delta >= 0 || self->audio_count[direction] > 0);
+  g_debug ("Modem `%s' audio %s now %s",
+           mm_modem_voice_get_path (self->voice),
+           wys_direction_get_description (direction),
+           present ? "present" : "absent");
+  self->audio_present[direction] = present;
+  g_signal_emit_by_name (self, present ? "audio-present" : "audio-absent",
+                         direction);
+}
 
-  self->audio_count[direction] += delta;
 
-  if (self->audio_count[direction] > 0 && old_count == 0)
+static void
+settle_audible (WysModem *self,
+                gboolean  audible)
+{
+  if (self->audio_audible == audible
+      || (self->audible_count > 0) != audible)
     {
-      g_debug ("Modem `%s' audio %s now present",
-               mm_modem_voice_get_path (self->voice),
-               wys_direction_get_description (direction));
-      g_signal_emit_by_name (self, "audio-present", direction);
+      return;
     }
-  else if (self->audio_count[direction] == 0 && old_count > 0)
+
+  g_debug ("Modem `%s' audio now %s",
+           mm_modem_voice_get_path (self->voice),
+           audible ? "audible" : "on hold");
+  self->audio_audible = audible;
+  g_signal_emit_by_name (self,
+                         audible ? "audio-audible" : "audio-inaudible");
+}
+
+
+static void
+settle_prepared (WysModem *self,
+                 gboolean  prepared)
+{
+  if (self->audio_prepared == prepared
+      || (self->prepare_count > 0) != prepared)
     {
-      g_debug ("Modem `%s' audio now absent",
-               mm_modem_voice_get_path (self->voice));
-      g_signal_emit_by_name (self, "audio-absent", direction);
+      return;
     }
+
+  g_debug ("Modem `%s' audio now %s",
+           mm_modem_voice_get_path (self->voice),
+           prepared ? "likely" : "unlikely");
+  self->audio_prepared = prepared;
+  g_signal_emit_by_name (self,
+                         prepared ? "audio-prepare" : "audio-unprepare");
+}
+
+
+/** Bring the signals up to date with the counts.  Several calls
+ * change state at once when calls are swapped or put on hold, in
+ * separate D-Bus signals, so looking at the counts only once those
+ * have all been handled keeps one call going inactive just before
+ * another goes active from tearing down the audio. */
+static gboolean
+settle_cb (WysModem *self)
+{
+  self->settle_id = 0;
+
+  // Things are set up in the order they're needed and torn down in
+  // reverse
+  settle_prepared (self, TRUE);
+  settle_audible (self, TRUE);
+  settle_present (self, WYS_DIRECTION_FROM_NETWORK, TRUE);
+  settle_present (self, WYS_DIRECTION_TO_NETWORK, TRUE);
+  settle_present (self, WYS_DIRECTION_TO_NETWORK, FALSE);
+  settle_present (self, WYS_DIRECTION_FROM_NETWORK, FALSE);
+  settle_audible (self, FALSE);
+  settle_prepared (self, FALSE);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+queue_settle (WysModem *self)
+{
+  if (!self->settle_id)
+    {
+      self->settle_id = g_idle_add ((GSourceFunc)settle_cb, self);
+    }
+}
+
+
+static void
+update_prepare_count (WysModem *self,
+                      gint      delta)
+{
+  g_assert (delta >= 0 || self->prepare_count > 0);
+
+  self->prepare_count += delta;
+  queue_settle (self);
+}
+
+
+static void
+update_prepare_state (WysModem    *self,
+                      MMCall      *mm_call,
+                      MMCallState  new_state)
+{
+  const gboolean had_pcms =
+    GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (mm_call),
+                                         WYS_MODEM_NEEDS_PCMS));
+  const gboolean needs_pcms = call_state_needs_pcms (new_state);
+
+  if (had_pcms == needs_pcms)
+    {
+      return;
+    }
+
+  g_object_set_data (G_OBJECT (mm_call), WYS_MODEM_NEEDS_PCMS,
+                     GUINT_TO_POINTER ((guint)needs_pcms));
+  update_prepare_count (self, needs_pcms ? +1 : -1);
+}
+
+
+static void
+update_audible_state (WysModem    *self,
+                      MMCall      *mm_call,
+                      MMCallState  new_state)
+{
+  const gboolean was_audible =
+    GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (mm_call),
+                                         WYS_MODEM_AUDIBLE));
+  const gboolean audible = call_state_audible (new_state);
+
+  if (was_audible == audible)
+    {
+      return;
+    }
+
+  g_assert (audible || self->audible_count > 0);
+
+  g_object_set_data (G_OBJECT (mm_call), WYS_MODEM_AUDIBLE,
+                     GUINT_TO_POINTER ((guint)audible));
+  self->audible_count += audible ? +1 : -1;
+  queue_settle (self);
+}
+
+
+static void
+update_audio_count (WysModem     *self,
+                    WysDirection  direction,
+                    gint          delta)
+{
+  g_assert (delta >= 0 || self->audio_count[direction] > 0);
+
+  self->audio_count[direction] += delta;
+  queue_settle (self);
 }
 
 
@@ -177,9 +372,10 @@ call_state_changed_cb (MmGdbusCall       *mm_gdbus_call,
   g_debug ("Call `%s' state changed, new: %i, old: %i",
            path, (int)new_state, (int)old_state);
 
-  // FIXME: deal with calls being put on hold (one call goes
-  // non-audio, another call goes audio after)
-
+  // The signals only go out once every call's changes are in, see
+  // settle_cb()
+  update_prepare_state (self, mm_call, new_state);
+  update_audible_state (self, mm_call, new_state);
   update_direction_state (self, mm_call, path,
                           WYS_DIRECTION_FROM_NETWORK,
                           old_state, new_state);
@@ -223,6 +419,8 @@ add_call (WysModem *self,
                     self);
 
   state = mm_call_get_state (mm_call);
+  update_prepare_state (self, mm_call, state);
+  update_audible_state (self, mm_call, state);
   init_call_direction (self, mm_call, state,
                        WYS_DIRECTION_FROM_NETWORK);
   init_call_direction (self, mm_call, state,
@@ -240,61 +438,43 @@ struct WysModemCallAddedData
 
 
 static void
-call_added_list_calls_cb (MMModemVoice                 *voice,
-                          GAsyncResult                 *res,
-                          struct WysModemCallAddedData *data)
+call_added_new_call_cb (GObject                      *source,
+                        GAsyncResult                 *res,
+                        struct WysModemCallAddedData *data)
 {
-  GList *calls;
+  GObject *object;
   GError *error = NULL;
 
-  calls = mm_modem_voice_list_calls_finish (voice, res, &error);
-  if (!calls)
+  object = g_async_initable_new_finish (G_ASYNC_INITABLE (source),
+                                        res, &error);
+  if (!object)
     {
-      if (error)
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
         {
-          g_warning ("Error listing calls on MMModemVoice"
-                     " after call-added signal: %s",
-                     error->message);
-          g_error_free (error);
-        }
-      else
-        {
-          g_warning ("No calls on MMModemVoice"
-                     " after call-added signal");
+          g_warning ("Error creating proxy for new call `%s': %s",
+                     data->path, error->message);
+          g_hash_table_remove (data->self->pending_calls, data->path);
         }
+      g_error_free (error);
+    }
+  else if (!g_hash_table_remove (data->self->pending_calls, data->path))
+    {
+      g_debug ("Call `%s' removed before it was added", data->path);
     }
   else
     {
-      GList *node;
-      MMCall *call;
-      gboolean found = FALSE;
-
-      for (node = calls; node; node = node->next)
-        {
-          call = MM_CALL (node->data);
-
-          if (g_strcmp0 (mm_call_get_path (call), data->path) == 0)
-            {
-              add_call (data->self, call);
-              found = TRUE;
-            }
-        }
-
-      if (!found)
-        {
-          g_warning ("Could not find new call `%s' in call list"
-                     " on MMModemVoice after call-added signal",
-                     data->path);
-        }
-
-      g_list_free_full (calls, g_object_unref);
+      add_call (data->self, MM_CALL (object));
     }
 
+  g_clear_object (&object);
   g_free (data->path);
   g_free (data);
 }
 
 
+/** Build the call's proxy straight from its path, as libmm-glib does
+ * for each call when listing them, rather than listing every call to
+ * find the new one */
 static void
 call_added_cb (MMModemVoice  *voice,
                gchar         *path,
@@ -302,22 +482,32 @@ call_added_cb (MMModemVoice  *voice,
 {
   struct WysModemCallAddedData *data;
 
-  if (g_hash_table_contains (self->calls, path))
+  if (g_hash_table_contains (self->calls, path)
+      || g_hash_table_contains (self->pending_calls, path))
     {
       g_warning ("Received call-added signal for"
                  " existing call object path `%s'", path);
       return;
     }
 
+  g_hash_table_add (self->pending_calls, g_strdup (path));
+
   data = g_new0 (struct WysModemCallAddedData, 1);
   data->self = self;
   data->path = g_strdup (path);
 
-  mm_modem_voice_list_calls
-    (voice,
-     NULL,
-     (GAsyncReadyCallback) call_added_list_calls_cb,
-     data);
+  g_async_initable_new_async
+    (MM_TYPE_CALL,
+     G_PRIORITY_DEFAULT,
+     self->cancel,
+     (GAsyncReadyCallback) call_added_new_call_cb,
+     data,
+     "g-flags", G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+     "g-name", MM_DBUS_SERVICE,
+     "g-connection", g_dbus_proxy_get_connection (G_DBUS_PROXY (voice)),
+     "g-object-path", path,
+     "g-interface-name", MM_DBUS_INTERFACE_CALL,
+     NULL);
 }
 
 
@@ -345,6 +535,11 @@ call_deleted_cb (MMModemVoice *voice,
 
   g_debug ("Removing call `%s'", path);
 
+  if (g_hash_table_remove (self->pending_calls, path))
+    {
+      return;
+    }
+
   mm_call = g_hash_table_lookup (self->calls, path);
   if (!mm_call)
     {
@@ -356,6 +551,8 @@ call_deleted_cb (MMModemVoice *voice,
                         WYS_DIRECTION_FROM_NETWORK);
   clear_call_direction (self, mm_call,
                         WYS_DIRECTION_TO_NETWORK);
+  update_audible_state (self, mm_call, MM_CALL_STATE_UNKNOWN);
+  update_prepare_state (self, mm_call, MM_CALL_STATE_UNKNOWN);
 
   g_hash_table_remove (self->calls, path);
 
@@ -441,17 +638,24 @@ dispose (GObject *object)
   GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
   WysModem *self = WYS_MODEM (object);
 
+  g_cancellable_cancel (self->cancel);
+  g_hash_table_remove_all (self->pending_calls);
+
   if (g_hash_table_size (self->calls) > 0)
     {
       g_hash_table_remove_all (self->calls);
-      if (self->audio_count[WYS_DIRECTION_FROM_NETWORK] > 0 ||
-          self->audio_count[WYS_DIRECTION_TO_NETWORK] > 0)
-        {
-          self->audio_count[WYS_DIRECTION_FROM_NETWORK] =
-            self->audio_count[WYS_DIRECTION_TO_NETWORK] = 0;
-          g_signal_emit_by_name (self, "audio-absent");
-        }
+      self->audio_count[WYS_DIRECTION_FROM_NETWORK] =
+        self->audio_count[WYS_DIRECTION_TO_NETWORK] = 0;
+      self->audible_count = 0;
+      self->prepare_count = 0;
+    }
+
+  // Take back whatever the signals have said
+  if (self->settle_id)
+    {
+      g_source_remove (self->settle_id);
     }
+  settle_cb (self);
 
   g_clear_object (&self->voice);
 
@@ -465,7 +669,9 @@ finalize (GObject *object)
   GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
   WysModem *self = WYS_MODEM (object);
 
+  g_hash_table_unref (self->pending_calls);
   g_hash_table_unref (self->calls);
+  g_object_unref (self->cancel);
 
   parent_class->finalize (object);
 }
@@ -522,6 +728,67 @@ wys_modem_class_init (WysModemClass *klass)
                   G_TYPE_NONE,
                   1,
                   WYS_TYPE_DIRECTION);
+
+  /**
+   * WysModem::audio-audible:
+   * @self: The #WysModem instance.
+   *
+   * This signal is emitted when one of the modem's calls with audio
+   * is not on hold.
+   */
+  signals[SIGNAL_AUDIO_AUDIBLE] =
+    g_signal_new ("audio-audible",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE,
+                  0);
+
+  /**
+   * WysModem::audio-inaudible:
+   * @self: The #WysModem instance.
+   *
+   * This signal is emitted when all of the modem's calls with audio
+   * are on hold, or there are none left.
+   */
+  signals[SIGNAL_AUDIO_INAUDIBLE] =
+    g_signal_new ("audio-inaudible",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE,
+                  0);
+
+  /**
+   * WysModem::audio-prepare:
+   * @self: The #WysModem instance.
+   *
+   * This signal is emitted when one of the modem's calls enters a
+   * state where audio is present or likely to be present soon, such
+   * as when dialling or ringing.
+   */
+  signals[SIGNAL_AUDIO_PREPARE] =
+    g_signal_new ("audio-prepare",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE,
+                  0);
+
+  /**
+   * WysModem::audio-unprepare:
+   * @self: The #WysModem instance.
+   *
+   * This signal is emitted when none of the modem's calls are in a
+   * state where audio is present or likely.
+   */
+  signals[SIGNAL_AUDIO_UNPREPARE] =
+    g_signal_new ("audio-unprepare",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE,
+                  0);
 }
 
 
@@ -530,6 +797,9 @@ wys_modem_init (WysModem *self)
 {
   self->calls = g_hash_table_new_full (g_str_hash, g_str_equal,
                                        g_free, g_object_unref);
+  self->pending_calls = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+  self->cancel = g_cancellable_new ();
 }
 
 
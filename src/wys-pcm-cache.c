@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "wys-pcm-cache.h"
+#include "config.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+
+#define KEY_CAPTURE   "capture"
+#define KEY_PLAYBACK  "playback"
+
+/* Loops for both directions may use the cache at the same time */
+static GMutex cache_lock;
+
+
+static gchar *
+cache_filename (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), APP_DATA_NAME,
+                           "pcm-cache", NULL);
+}
+
+
+static gchar *
+cache_group (const gchar *capture_card,
+             const gchar *playback_card)
+{
+  return g_strdup_printf ("%s -> %s", capture_card, playback_card);
+}
+
+
+/** Must be called with the lock held */
+static GKeyFile *
+load_cache (const gchar *filename)
+{
+  GKeyFile *key_file;
+  GError *error = NULL;
+
+  key_file = g_key_file_new ();
+
+  if (!g_key_file_load_from_file (key_file, filename,
+                                  G_KEY_FILE_KEEP_COMMENTS,
+                                  &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_warning ("Error loading PCM cache `%s': %s",
+                     filename, error->message);
+        }
+      g_error_free (error);
+    }
+
+  return key_file;
+}
+
+
+/** Must be called with the lock held */
+static void
+save_cache (const gchar *filename,
+            GKeyFile    *key_file)
+{
+  g_autofree gchar *dirname = NULL;
+  GError *error = NULL;
+
+  dirname = g_path_get_dirname (filename);
+  if (g_mkdir_with_parents (dirname, 0755) != 0)
+    {
+      g_warning ("Error creating PCM cache directory `%s': %s",
+                 dirname, g_strerror (errno));
+      return;
+    }
+
+  if (!g_key_file_save_to_file (key_file, filename, &error))
+    {
+      g_warning ("Error saving PCM cache `%s': %s",
+                 filename, error->message);
+      g_error_free (error);
+    }
+}
+
+
+/**
+ * wys_pcm_cache_lookup:
+ * @capture_card: the ALSA card name being captured from
+ * @playback_card: the ALSA card name being played back to
+ * @capture_pcm: (out): return location for the capture PCM name
+ * @playback_pcm: (out): return location for the playback PCM name
+ *
+ * Look up the PCM names which last worked for a pair of cards.
+ *
+ * Returns: %TRUE if a pair was found.
+ */
+gboolean
+wys_pcm_cache_lookup (const gchar  *capture_card,
+                      const gchar  *playback_card,
+                      gchar       **capture_pcm,
+                      gchar       **playback_pcm)
+{
+  g_autofree gchar *filename = cache_filename ();
+  g_autofree gchar *group = cache_group (capture_card, playback_card);
+  GKeyFile *key_file;
+
+  g_mutex_lock (&cache_lock);
+  key_file = load_cache (filename);
+  g_mutex_unlock (&cache_lock);
+
+  *capture_pcm = g_key_file_get_string (key_file, group,
+                                        KEY_CAPTURE, NULL);
+  *playback_pcm = g_key_file_get_string (key_file, group,
+                                         KEY_PLAYBACK, NULL);
+  g_key_file_free (key_file);
+
+  if (!*capture_pcm || !*playback_pcm)
+    {
+      g_clear_pointer (capture_pcm, g_free);
+      g_clear_pointer (playback_pcm, g_free);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/** Remember the PCM names which worked for a pair of cards */
+void
+wys_pcm_cache_store (const gchar *capture_card,
+                     const gchar *playback_card,
+                     const gchar *capture_pcm,
+                     const gchar *playback_pcm)
+{
+  g_autofree gchar *filename = cache_filename ();
+  g_autofree gchar *group = cache_group (capture_card, playback_card);
+  GKeyFile *key_file;
+
+  g_mutex_lock (&cache_lock);
+
+  key_file = load_cache (filename);
+  g_key_file_set_string (key_file, group, KEY_CAPTURE, capture_pcm);
+  g_key_file_set_string (key_file, group, KEY_PLAYBACK, playback_pcm);
+  save_cache (filename, key_file);
+  g_key_file_free (key_file);
+
+  g_mutex_unlock (&cache_lock);
+}
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "wys-polyphase.h"
+#include "wys-kernels.h"
+
+#include <math.h>
+#include <string.h>
+
+/** Filter length per sample at the lower rate */
+#define TAPS_PER_PHASE  16
+/** Where the pass band ends, relative to the lower rate's Nyquist
+ * frequency */
+#define PASS_BAND       0.9
+/** Input frames filtered per block */
+#define BLOCK_FRAMES    256
+
+
+struct _WysPolyphase
+{
+  guint up;
+  guint down;
+  /** Q15 coefficients, one reversed set of TAPS_PER_PHASE per output
+   * phase when upsampling, or a single reversed set of
+   * TAPS_PER_PHASE * down when downsampling */
+  gint16 *coeffs;
+  guint n_taps;
+  /** Past input followed by the current block */
+  gint16 *buf;
+  guint history;
+  /** Input frames since the last output, when downsampling */
+  guint phase;
+};
+
+
+/** A windowed-sinc low-pass filter for a rate change by @factor,
+ * normalised to a DC gain of @gain */
+static gdouble *
+design_filter (guint   factor,
+               gdouble gain)
+{
+  const guint n = TAPS_PER_PHASE * factor;
+  const gdouble cutoff = PASS_BAND * 0.5 / factor;
+  const gdouble centre = (n - 1) / 2.0;
+  gdouble *h, sum = 0.0;
+  guint k;
+
+  h = g_new (gdouble, n);
+
+  for (k = 0; k < n; ++k)
+    {
+      const gdouble x = k - centre;
+      const gdouble sinc = x == 0.0
+        ? 2.0 * cutoff
+        : sin (2.0 * G_PI * cutoff * x) / (G_PI * x);
+      const gdouble window = 0.42
+        - 0.5 * cos (2.0 * G_PI * k / (n - 1))
+        + 0.08 * cos (4.0 * G_PI * k / (n - 1));
+
+      h[k] = sinc * window;
+      sum += h[k];
+    }
+
+  for (k = 0; k < n; ++k)
+    {
+      h[k] *= gain / sum;
+    }
+
+  return h;
+}
+
+
+static inline gint16
+to_q15 (gdouble v)
+{
+  return (gint16)CLAMP (lround (v * 32768.0), -32767, 32767);
+}
+
+
+/**
+ * wys_polyphase_new:
+ * @up: the factor to raise the rate by, or 1
+ * @down: the factor to lower the rate by, or 1
+ *
+ * Create a polyphase FIR filter for changing the sample rate of mono
+ * S16 audio by an integer factor, such as 8 or 16 kHz to 48 kHz and
+ * back.  Only one of @up and @down may be more than 1.
+ */
+WysPolyphase *
+wys_polyphase_new (guint up,
+                   guint down)
+{
+  WysPolyphase *self;
+  gdouble *h;
+  guint p, j;
+
+  g_return_val_if_fail (up >= 1 && down >= 1, NULL);
+  g_return_val_if_fail (up == 1 || down == 1, NULL);
+
+  self = g_new0 (WysPolyphase, 1);
+  self->up = up;
+  self->down = down;
+
+  if (up > 1)
+    {
+      // Zero stuffing loses a factor of up in gain
+      h = design_filter (up, up);
+      self->n_taps = TAPS_PER_PHASE;
+      self->coeffs = g_new (gint16, TAPS_PER_PHASE * up);
+      for (p = 0; p < up; ++p)
+        {
+          for (j = 0; j < TAPS_PER_PHASE; ++j)
+            {
+              self->coeffs[p * TAPS_PER_PHASE + j] =
+                to_q15 (h[(TAPS_PER_PHASE - 1 - j) * up + p]);
+            }
+        }
+    }
+  else
+    {
+      h = design_filter (down, 1.0);
+      self->n_taps = TAPS_PER_PHASE * down;
+      self->coeffs = g_new (gint16, self->n_taps);
+      for (j = 0; j < self->n_taps; ++j)
+        {
+          self->coeffs[j] = to_q15 (h[self->n_taps - 1 - j]);
+        }
+    }
+  g_free (h);
+
+  self->history = self->n_taps - 1;
+  self->buf = g_new0 (gint16, self->history + BLOCK_FRAMES);
+
+  return self;
+}
+
+
+void
+wys_polyphase_free (WysPolyphase *self)
+{
+  g_free (self->buf);
+  g_free (self->coeffs);
+  g_free (self);
+}
+
+
+/** Forget past input */
+void
+wys_polyphase_reset (WysPolyphase *self)
+{
+  memset (self->buf, 0, self->history * sizeof (gint16));
+  self->phase = 0;
+}
+
+
+/** How many input frames can be passed to wys_polyphase_process()
+ * without producing more than @out_frames */
+gsize
+wys_polyphase_max_input (WysPolyphase *self,
+                         gsize         out_frames)
+{
+  if (self->up > 1)
+    {
+      return out_frames / self->up;
+    }
+
+  return out_frames * self->down - self->phase;
+}
+
+
+static inline gint16
+filter (const gint16 *window,
+        const gint16 *coeffs,
+        guint         n_taps)
+{
+  const gint64 v = ((gint64)wys_kernel_dot_s16 (window, coeffs, n_taps)
+                    + (1 << 14)) >> 15;
+
+  return (gint16)CLAMP (v, G_MININT16, G_MAXINT16);
+}
+
+
+/**
+ * wys_polyphase_process:
+ * @in: mono input frames
+ * @in_frames: the number of frames at @in
+ * @out: where to write the output, which must have room for the
+ * number of frames wys_polyphase_max_input() allows
+ *
+ * Returns: the number of frames written to @out.
+ */
+gsize
+wys_polyphase_process (WysPolyphase *self,
+                       const gint16 *in,
+                       gsize         in_frames,
+                       gint16       *out)
+{
+  gint16 *block = self->buf + self->history;
+  gsize produced = 0;
+  gsize n, i;
+  guint p;
+
+  while (in_frames > 0)
+    {
+      n = MIN (in_frames, BLOCK_FRAMES);
+      memcpy (block, in, n * sizeof (gint16));
+
+      for (i = 0; i < n; ++i)
+        {
+          // The filter's window, ending with input frame i
+          const gint16 *window = self->buf + i;
+
+          if (self->up > 1)
+            {
+              for (p = 0; p < self->up; ++p)
+                {
+                  out[produced++] = filter (window,
+                                            self->coeffs + p * self->n_taps,
+                                            self->n_taps);
+                }
+            }
+          else if (++self->phase == self->down)
+            {
+              out[produced++] = filter (window, self->coeffs, self->n_taps);
+              self->phase = 0;
+            }
+        }
+
+      memmove (self->buf, self->buf + n, self->history * sizeof (gint16));
+      in += n;
+      in_frames -= n;
+    }
+
+  return produced;
+}
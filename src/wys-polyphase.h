@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_POLYPHASE_H__
+#define WYS_POLYPHASE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _WysPolyphase WysPolyphase;
+
+WysPolyphase *wys_polyphase_new       (guint          up,
+                                       guint          down);
+void          wys_polyphase_free      (WysPolyphase  *self);
+void          wys_polyphase_reset     (WysPolyphase  *self);
+gsize         wys_polyphase_max_input (WysPolyphase  *self,
+                                       gsize          out_frames);
+gsize         wys_polyphase_process   (WysPolyphase  *self,
+                                       const gint16  *in,
+                                       gsize          in_frames,
+                                       gint16        *out);
+
+G_END_DECLS
+
+#endif /* WYS_POLYPHASE_H__ */
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "wys-resampler.h"
+
+#include <string.h>
+
+/** How long a clock must be observed before its rate is trusted */
+#define MIN_WINDOW_NS     G_GINT64_CONSTANT (1000000000)
+/** Weight of each new depth sample in the smoothed depth */
+#define DEPTH_SMOOTHING   0.01
+/** Relative rate correction per second of depth error */
+#define DEPTH_GAIN        0.05
+/** Limit on the depth correction, relative */
+#define MAX_CORRECTION    0.005
+
+
+struct clock_track
+{
+  gboolean valid;
+  /** Reference point */
+  guint64 position0;
+  gint64 time0;
+  /** Frames per second, 0 until known */
+  gdouble rate;
+};
+
+
+struct _WysResampler
+{
+  guint channels;
+  guint rate;
+  guint target_depth;
+
+  /** Input and output clocks */
+  struct clock_track clocks[2];
+  /** Input rate / output rate - 1 */
+  gdouble drift;
+
+  /** Smoothed output queue depth, in frames */
+  gdouble depth;
+  gboolean have_depth;
+
+  /** Input frames per output frame */
+  gdouble step;
+  /** Position of the next output frame relative to the first input
+   * frame, -1 being the last frame of the previous input */
+  gdouble pos;
+  gint16 *last;
+};
+
+
+static void
+update_step (WysResampler *self)
+{
+  gdouble correction = 0.0;
+
+  if (self->have_depth)
+    {
+      // Too much queued means we produce too much, so take bigger steps
+      correction = DEPTH_GAIN
+        * (self->depth - (gdouble)self->target_depth)
+        / (gdouble)self->rate;
+      correction = CLAMP (correction, -MAX_CORRECTION, MAX_CORRECTION);
+    }
+
+  self->step = (1.0 + self->drift) * (1.0 + correction);
+}
+
+
+/**
+ * wys_resampler_new:
+ * @channels: the number of interleaved channels
+ * @rate: the nominal rate of both sides
+ * @target_depth: the output queue depth, in frames, to aim for
+ *
+ * Create an asynchronous resampler which converts between two clocks
+ * with the same nominal rate.  The ratio is driven by the clock rates
+ * measured with wys_resampler_update_clock() and corrected so that
+ * the queue depth reported with wys_resampler_update_depth() stays
+ * at @target_depth.
+ */
+WysResampler *
+wys_resampler_new (guint channels,
+                   guint rate,
+                   guint target_depth)
+{
+  WysResampler *self;
+
+  self = g_new0 (WysResampler, 1);
+  self->channels = channels;
+  self->rate = rate;
+  self->target_depth = target_depth;
+  self->last = g_new0 (gint16, channels);
+
+  wys_resampler_reset (self);
+
+  return self;
+}
+
+
+void
+wys_resampler_free (WysResampler *self)
+{
+  g_free (self->last);
+  g_free (self);
+}
+
+
+/** Forget the clock and depth history, for example after an xrun */
+void
+wys_resampler_reset (WysResampler *self)
+{
+  memset (self->clocks, 0, sizeof (self->clocks));
+  memset (self->last, 0, self->channels * sizeof (gint16));
+  self->drift = 0.0;
+  self->have_depth = FALSE;
+  self->pos = 0.0;
+  update_step (self);
+}
+
+
+/**
+ * wys_resampler_update_clock:
+ * @clock: which side @position belongs to
+ * @position: the hardware position, in frames
+ * @time_ns: the monotonic time at which the hardware was at @position
+ *
+ * Feed a hardware timestamp of one side to the drift estimator.
+ */
+void
+wys_resampler_update_clock (WysResampler      *self,
+                            WysResamplerClock  clock,
+                            guint64            position,
+                            gint64             time_ns)
+{
+  struct clock_track *track = &self->clocks[clock];
+  struct clock_track *in = &self->clocks[WYS_RESAMPLER_INPUT];
+  struct clock_track *out = &self->clocks[WYS_RESAMPLER_OUTPUT];
+  gint64 window;
+
+  if (!track->valid)
+    {
+      track->position0 = position;
+      track->time0 = time_ns;
+      track->valid = TRUE;
+      return;
+    }
+
+  window = time_ns - track->time0;
+  if (window < MIN_WINDOW_NS || position < track->position0)
+    {
+      return;
+    }
+
+  // The whole history is used, so the estimate keeps getting better
+  track->rate = (gdouble)(position - track->position0)
+    * 1e9 / (gdouble)window;
+
+  if (in->rate > 0.0 && out->rate > 0.0)
+    {
+      self->drift = in->rate / out->rate - 1.0;
+      update_step (self);
+    }
+}
+
+
+/** Feed the current output queue depth, in frames */
+void
+wys_resampler_update_depth (WysResampler *self,
+                            guint         depth)
+{
+  if (self->have_depth)
+    {
+      self->depth += DEPTH_SMOOTHING * ((gdouble)depth - self->depth);
+    }
+  else
+    {
+      self->depth = depth;
+      self->have_depth = TRUE;
+    }
+
+  update_step (self);
+}
+
+
+/** Change the output queue depth to aim for, in frames */
+void
+wys_resampler_set_target_depth (WysResampler *self,
+                                guint         target_depth)
+{
+  self->target_depth = target_depth;
+  update_step (self);
+}
+
+
+/** The estimated drift of the input clock relative to the output
+ * clock, in parts per million */
+gdouble
+wys_resampler_get_drift_ppm (WysResampler *self)
+{
+  return self->drift * 1e6;
+}
+
+
+static inline gint16
+interpolate (gint16  a,
+             gint16  b,
+             gdouble frac)
+{
+  const gdouble v = a + (b - a) * frac;
+
+  return (gint16)(v >= 0.0 ? v + 0.5 : v - 0.5);
+}
+
+
+/**
+ * wys_resampler_process:
+ * @in: interleaved input frames
+ * @in_frames: (inout): the number of frames at @in, set to the
+ * number of frames consumed
+ * @out: where to write interleaved output frames
+ * @out_frames: the space at @out, in frames
+ *
+ * Returns: the number of frames written to @out.
+ */
+gsize
+wys_resampler_process (WysResampler *self,
+                       const gint16 *in,
+                       gsize        *in_frames,
+                       gint16       *out,
+                       gsize         out_frames)
+{
+  const guint channels = self->channels;
+  const gint64 n = *in_frames;
+  gdouble pos = self->pos;
+  gsize produced = 0;
+  gint64 consumed;
+  guint c;
+
+  while (produced < out_frames)
+    {
+      // pos is never less than -1
+      const gint64 i = (gint64)(pos + 1.0) - 1;
+      const gdouble frac = pos - (gdouble)i;
+      const gint16 *a, *b;
+
+      if (i + 1 >= n)
+        {
+          break;
+        }
+
+      a = (i < 0) ? self->last : in + i * channels;
+      b = in + (i + 1) * channels;
+
+      for (c = 0; c < channels; ++c)
+        {
+          out[produced * channels + c] = interpolate (a[c], b[c], frac);
+        }
+
+      ++produced;
+      pos += self->step;
+    }
+
+  // Keep the frame before the next output position
+  consumed = MIN ((gint64)(pos + 1.0), n);
+  if (consumed > 0)
+    {
+      memcpy (self->last, in + (consumed - 1) * channels,
+              channels * sizeof (gint16));
+      pos -= consumed;
+    }
+
+  self->pos = pos;
+  *in_frames = consumed;
+  return produced;
+}
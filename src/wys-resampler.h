@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_RESAMPLER_H__
+#define WYS_RESAMPLER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  WYS_RESAMPLER_INPUT = 0,
+  WYS_RESAMPLER_OUTPUT
+} WysResamplerClock;
+
+typedef struct _WysResampler WysResampler;
+
+WysResampler *wys_resampler_new              (guint               channels,
+                                              guint               rate,
+                                              guint               target_depth);
+void          wys_resampler_free             (WysResampler       *self);
+void          wys_resampler_reset            (WysResampler       *self);
+void          wys_resampler_update_clock     (WysResampler       *self,
+                                              WysResamplerClock   clock,
+                                              guint64             position,
+                                              gint64              time_ns);
+void          wys_resampler_update_depth     (WysResampler       *self,
+                                              guint               depth);
+void          wys_resampler_set_target_depth (WysResampler       *self,
+                                              guint               target_depth);
+gdouble       wys_resampler_get_drift_ppm    (WysResampler       *self);
+gsize         wys_resampler_process          (WysResampler       *self,
+                                              const gint16       *in,
+                                              gsize              *in_frames,
+                                              gint16             *out,
+                                              gsize               out_frames);
+
+G_END_DECLS
+
+#endif /* WYS_RESAMPLER_H__ */
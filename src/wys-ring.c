@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** Keeps the producer's and consumer's positions from sharing a
+ * cache line */
+#define CACHE_LINE 64
+
+
+struct _WysRing
+{
+  /** Written only by the producer: one past the last frame written */
+  gsize write_position __attribute__ ((aligned (CACHE_LINE)));
+  /** The producer's last look at read_position, so it doesn't have
+   * to touch the consumer's cache line every time */
+  gsize cached_read_position;
+
+  /** Written only by the consumer: one past the last frame read */
+  gsize read_position __attribute__ ((aligned (CACHE_LINE)));
+  gsize cached_write_position;
+
+  /** Read only, after construction */
+  gsize frame_size __attribute__ ((aligned (CACHE_LINE)));
+  /** A power of two */
+  gsize n_frames;
+  guint8 *data;
+};
+
+
+/**
+ * wys_ring_new:
+ * @frame_size: the size of a frame, in bytes
+ * @n_frames: the least number of frames the ring must hold; rounded
+ * up to a power of two
+ *
+ * Create a ring buffer for passing frames from one thread to
+ * another.  Exactly one thread may write to it and exactly one other
+ * thread may read from it; neither ever blocks or takes a lock.
+ */
+WysRing *
+wys_ring_new (gsize frame_size,
+              gsize n_frames)
+{
+  gpointer memory = NULL;
+  WysRing *self;
+
+  g_return_val_if_fail (frame_size > 0 && n_frames > 0, NULL);
+
+  if (posix_memalign (&memory, CACHE_LINE, sizeof (WysRing)) != 0)
+    {
+      g_error ("Error allocating ring buffer");
+    }
+
+  self = memset (memory, 0, sizeof (WysRing));
+  self->frame_size = frame_size;
+  self->n_frames = 1;
+  while (self->n_frames < n_frames)
+    {
+      self->n_frames <<= 1;
+    }
+  self->data = g_malloc0 (self->n_frames * frame_size);
+
+  return self;
+}
+
+
+void
+wys_ring_free (WysRing *self)
+{
+  g_free (self->data);
+  free (self);
+}
+
+
+/** Copy @n frames between @frames and the ring starting at
+ * @position, wrapping around its end */
+static void
+copy_frames (WysRing  *self,
+             gsize     position,
+             guint8   *frames,
+             gsize     n,
+             gboolean  to_ring)
+{
+  const gsize offset = position & (self->n_frames - 1);
+  const gsize first = MIN (n, self->n_frames - offset);
+  guint8 *ring = self->data + offset * self->frame_size;
+
+  if (to_ring)
+    {
+      memcpy (ring, frames, first * self->frame_size);
+      memcpy (self->data, frames + first * self->frame_size,
+              (n - first) * self->frame_size);
+    }
+  else
+    {
+      memcpy (frames, ring, first * self->frame_size);
+      memcpy (frames + first * self->frame_size, self->data,
+              (n - first) * self->frame_size);
+    }
+}
+
+
+/**
+ * wys_ring_write:
+ *
+ * Append as many of @n_frames @frames as there is room for.  Only
+ * the producer may call this.
+ *
+ * Returns: the number of frames written
+ */
+gsize
+wys_ring_write (WysRing       *self,
+                gconstpointer  frames,
+                gsize          n_frames)
+{
+  const gsize position = self->write_position;
+  gsize space;
+
+  space = self->n_frames - (position - self->cached_read_position);
+  if (space < n_frames)
+    {
+      self->cached_read_position =
+        __atomic_load_n (&self->read_position, __ATOMIC_ACQUIRE);
+      space = self->n_frames - (position - self->cached_read_position);
+    }
+
+  n_frames = MIN (n_frames, space);
+  copy_frames (self, position, (guint8 *)frames, n_frames, TRUE);
+
+  __atomic_store_n (&self->write_position, position + n_frames,
+                    __ATOMIC_RELEASE);
+
+  return n_frames;
+}
+
+
+/**
+ * wys_ring_read:
+ *
+ * Take up to @n_frames frames from the ring into @frames.  Only the
+ * consumer may call this.
+ *
+ * Returns: the number of frames read
+ */
+gsize
+wys_ring_read (WysRing  *self,
+               gpointer  frames,
+               gsize     n_frames)
+{
+  const gsize position = self->read_position;
+  gsize fill;
+
+  fill = self->cached_write_position - position;
+  if (fill < n_frames)
+    {
+      self->cached_write_position =
+        __atomic_load_n (&self->write_position, __ATOMIC_ACQUIRE);
+      fill = self->cached_write_position - position;
+    }
+
+  n_frames = MIN (n_frames, fill);
+  copy_frames (self, position, frames, n_frames, FALSE);
+
+  __atomic_store_n (&self->read_position, position + n_frames,
+                    __ATOMIC_RELEASE);
+
+  return n_frames;
+}
+
+
+/**
+ * wys_ring_skip:
+ *
+ * Drop up to @n_frames frames from the ring without copying them.
+ * Only the consumer may call this.
+ *
+ * Returns: the number of frames dropped
+ */
+gsize
+wys_ring_skip (WysRing *self,
+               gsize    n_frames)
+{
+  const gsize position = self->read_position;
+  gsize fill;
+
+  fill = self->cached_write_position - position;
+  if (fill < n_frames)
+    {
+      self->cached_write_position =
+        __atomic_load_n (&self->write_position, __ATOMIC_ACQUIRE);
+      fill = self->cached_write_position - position;
+    }
+
+  n_frames = MIN (n_frames, fill);
+  __atomic_store_n (&self->read_position, position + n_frames,
+                    __ATOMIC_RELEASE);
+
+  return n_frames;
+}
+
+
+/**
+ * wys_ring_get_fill:
+ *
+ * The number of frames waiting to be read, for a drift controller to
+ * steer by.  Either side, or any other thread, may call this; the
+ * answer may be out of date by the time it returns.
+ */
+gsize
+wys_ring_get_fill (WysRing *self)
+{
+  // Loading the read position first means the write position can't
+  // be behind it
+  const gsize read = __atomic_load_n (&self->read_position,
+                                      __ATOMIC_ACQUIRE);
+  const gsize write = __atomic_load_n (&self->write_position,
+                                       __ATOMIC_ACQUIRE);
+
+  return write - read;
+}
+
+
+/** The number of frames that could be written now */
+gsize
+wys_ring_get_space (WysRing *self)
+{
+  return self->n_frames - wys_ring_get_fill (self);
+}
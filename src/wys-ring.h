@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_RING_H__
+#define WYS_RING_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _WysRing WysRing;
+
+WysRing *wys_ring_new       (gsize          frame_size,
+                             gsize          n_frames);
+void     wys_ring_free      (WysRing       *self);
+gsize    wys_ring_write     (WysRing       *self,
+                             gconstpointer  frames,
+                             gsize          n_frames);
+gsize    wys_ring_read      (WysRing       *self,
+                             gpointer       frames,
+                             gsize          n_frames);
+gsize    wys_ring_skip      (WysRing       *self,
+                             gsize          n_frames);
+gsize    wys_ring_get_fill  (WysRing       *self);
+gsize    wys_ring_get_space (WysRing       *self);
+
+G_END_DECLS
+
+#endif /* WYS_RING_H__ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-rt.h"
+
+#include <sys/mman.h>
+#include <sched.h>
+#include <errno.h>
+
+#define RT_PRIORITY    10
+#define RT_STACK_SIZE  (64 * 1024)
+
+/** Whether the process's memory is locked */
+static gint locked;
+
+
+/**
+ * wys_rt_spawn:
+ *
+ * Create a thread to move audio in, or to help set up for doing so.
+ * GThread doesn't let us set the stack size, which matters because
+ * once memory is locked, all of a new thread's stack gets locked.
+ *
+ * Returns: 0 or an errno value
+ */
+int
+wys_rt_spawn (pthread_t *thread,
+              gpointer (*func) (gpointer),
+              gpointer   data)
+{
+  pthread_attr_t attr;
+  int err;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setstacksize (&attr, RT_STACK_SIZE);
+  err = pthread_create (thread, &attr, func, data);
+  pthread_attr_destroy (&attr);
+
+  return err;
+}
+
+
+/**
+ * wys_rt_make_realtime:
+ * @what: what the calling thread does, for messages
+ *
+ * Give the calling thread real-time priority and keep the process's
+ * memory resident, as far as we're allowed to.
+ */
+void
+wys_rt_make_realtime (const gchar *what)
+{
+  struct sched_param param = { 0 };
+  int err;
+
+  // Keep our pages, including this thread's stack, resident
+  if (g_atomic_int_compare_and_exchange (&locked, FALSE, TRUE))
+    {
+      if (mlockall (MCL_CURRENT | MCL_FUTURE) != 0)
+        {
+          g_debug ("Could not lock memory: %s", g_strerror (errno));
+        }
+    }
+
+  param.sched_priority = RT_PRIORITY;
+  err = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+  if (err != 0)
+    {
+      g_debug ("Could not make %s real-time: %s", what, g_strerror (err));
+    }
+}
+
+
+/**
+ * wys_rt_unlock_memory:
+ *
+ * Let the process's memory be paged out again once no real-time
+ * threads are left, so that what is allocated while there are no
+ * calls isn't locked too.  The next real-time thread locks it again.
+ */
+void
+wys_rt_unlock_memory (void)
+{
+  if (g_atomic_int_compare_and_exchange (&locked, TRUE, FALSE))
+    {
+      munlockall ();
+    }
+}
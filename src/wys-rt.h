@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_RT_H__
+#define WYS_RT_H__
+
+#include <glib.h>
+
+#include <pthread.h>
+
+G_BEGIN_DECLS
+
+int  wys_rt_spawn         (pthread_t    *thread,
+                           gpointer    (*func) (gpointer),
+                           gpointer      data);
+void wys_rt_make_realtime (const gchar  *what);
+void wys_rt_unlock_memory (void);
+
+G_END_DECLS
+
+#endif /* WYS_RT_H__ */
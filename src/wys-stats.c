@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-stats.h"
+
+/** Histogram buckets double in width from the first */
+#define BUCKETS         16
+/** The upper bound of the first bucket, as a power of two
+ * microseconds: 128 us for queue depths, 1 ms for recovery */
+#define DEPTH_SHIFT     7
+#define RECOVERY_SHIFT  10
+
+static const gchar * const XRUN_NAMES[] =
+  { "underruns", "overruns", "errors" };
+
+
+struct counts
+{
+  guint wakeups;
+  /** Changes of the playback queue depth target */
+  guint retargets;
+  guint xruns[G_N_ELEMENTS (XRUN_NAMES)];
+  guint recovery[BUCKETS];
+  guint depth[BUCKETS];
+};
+
+
+/* The loop thread adds to the counts while the main thread reads
+ * them.  Each count is atomic on its own, which is all that's needed
+ * for a rough picture; the set as a whole may be slightly torn. */
+struct _WysStats
+{
+  guint calls;
+  /** Monotonic times the current or last call began and ended, the
+   * end being 0 during a call */
+  gint64 call_begin;
+  gint64 call_end;
+  /** The loop's latest playback queue depth target, peak wakeup
+   * lateness and drift in thousandths of a ppm */
+  gint64 target_us;
+  gint64 jitter_us;
+  gint drift_mppm;
+  /** How long the current or last call's audio took to flow, or -1
+   * if it hasn't */
+  gint64 startup_us;
+  /** What the loop last failed to do and its error, until the main
+   * thread takes them; a static string, or NULL */
+  const gchar *failure;
+  gint failure_err;
+  /** Since the current or last call began */
+  struct counts call;
+  /** Since the daemon started */
+  struct counts total;
+};
+
+
+/**
+ * wys_stats_new:
+ *
+ * Create counters for glitches in one direction of call audio.  The
+ * loop moving the audio updates them from its own thread, cheaply
+ * enough to do so every period.
+ */
+WysStats *
+wys_stats_new (void)
+{
+  return g_new0 (WysStats, 1);
+}
+
+
+void
+wys_stats_free (WysStats *self)
+{
+  g_free (self);
+}
+
+
+static inline void
+add (guint *count)
+{
+  __atomic_fetch_add (count, 1, __ATOMIC_RELAXED);
+}
+
+
+static inline guint
+get (const guint *count)
+{
+  return __atomic_load_n (count, __ATOMIC_RELAXED);
+}
+
+
+/** Bucket 0 holds values below 1 << @shift, and each after it twice
+ * the range of the last */
+static guint
+bucket (gint64 value,
+        guint  shift)
+{
+  const guint64 v = (guint64)MAX (value, 0) >> shift;
+
+  return MIN (v ? g_bit_storage (v) : 0, BUCKETS - 1);
+}
+
+
+/** Start counting a new call's glitches separately */
+void
+wys_stats_begin_call (WysStats *self)
+{
+  guint *counts = (guint *)&self->call;
+  gsize i;
+
+  for (i = 0; i < sizeof (self->call) / sizeof (guint); ++i)
+    {
+      __atomic_store_n (&counts[i], 0, __ATOMIC_RELAXED);
+    }
+  __atomic_store_n (&self->call_end, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&self->startup_us, -1, __ATOMIC_RELAXED);
+  __atomic_store_n (&self->call_begin, g_get_monotonic_time (),
+                    __ATOMIC_RELAXED);
+  add (&self->calls);
+}
+
+
+void
+wys_stats_end_call (WysStats *self)
+{
+  __atomic_store_n (&self->call_end, g_get_monotonic_time (),
+                    __ATOMIC_RELAXED);
+}
+
+
+/** Record the loop's thread waking to move audio */
+void
+wys_stats_wakeup (WysStats *self)
+{
+  add (&self->call.wakeups);
+  add (&self->total.wakeups);
+}
+
+
+void
+wys_stats_xrun (WysStats     *self,
+                WysStatsXrun  xrun)
+{
+  add (&self->call.xruns[xrun]);
+  add (&self->total.xruns[xrun]);
+}
+
+
+/** Record how long it took audio to flow again after an xrun */
+void
+wys_stats_recovered (WysStats *self,
+                     gint64    duration_us)
+{
+  const guint i = bucket (duration_us, RECOVERY_SHIFT);
+
+  add (&self->call.recovery[i]);
+  add (&self->total.recovery[i]);
+}
+
+
+/** Record how much audio was queued for playback */
+void
+wys_stats_depth (WysStats *self,
+                 gint64    depth_us)
+{
+  const guint i = bucket (depth_us, DEPTH_SHIFT);
+
+  add (&self->call.depth[i]);
+  add (&self->total.depth[i]);
+}
+
+
+/** Publish the loop's state for wys_stats_to_string(), counting
+ * changes of the depth target.  Cheap enough for every period, unlike
+ * logging from the loop's thread. */
+void
+wys_stats_target (WysStats *self,
+                  gint64    target_us,
+                  gint64    jitter_us,
+                  gdouble   drift_ppm)
+{
+  if (__atomic_exchange_n (&self->target_us, target_us, __ATOMIC_RELAXED)
+      != target_us)
+    {
+      add (&self->call.retargets);
+      add (&self->total.retargets);
+    }
+  __atomic_store_n (&self->jitter_us, jitter_us, __ATOMIC_RELAXED);
+  __atomic_store_n (&self->drift_mppm, (gint)(drift_ppm * 1000.0),
+                    __ATOMIC_RELAXED);
+}
+
+
+/** Record how long the call's audio took to start flowing */
+void
+wys_stats_flowing (WysStats *self,
+                   gint64    startup_us)
+{
+  __atomic_store_n (&self->startup_us, startup_us, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * wys_stats_failed:
+ * @what: a static description of what failed
+ * @err: the negative error code, or 0
+ *
+ * Note a problem in the loop, for the main thread to log with
+ * wys_stats_take_failure(); logging from the loop's thread could
+ * block it.  Only the latest is kept.
+ */
+void
+wys_stats_failed (WysStats    *self,
+                  const gchar *what,
+                  gint         err)
+{
+  __atomic_store_n (&self->failure_err, err, __ATOMIC_RELAXED);
+  __atomic_store_n (&self->failure, what, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * wys_stats_take_failure:
+ * @err: (out): where to store the error code
+ *
+ * Returns: (nullable): the description passed to wys_stats_failed()
+ * since it was last called, if any
+ */
+const gchar *
+wys_stats_take_failure (WysStats *self,
+                        gint     *err)
+{
+  const gchar *what;
+
+  what = __atomic_exchange_n (&self->failure, NULL, __ATOMIC_ACQUIRE);
+  *err = __atomic_load_n (&self->failure_err, __ATOMIC_RELAXED);
+  return what;
+}
+
+
+/**
+ * wys_stats_get_xruns:
+ * @periods: (out) (optional): where to store the number of periods
+ * moved
+ *
+ * Returns: the number of xruns and errors in the current or last
+ * call
+ */
+guint
+wys_stats_get_xruns (WysStats *self,
+                     guint    *periods)
+{
+  guint xruns = 0;
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (self->call.xruns); ++i)
+    {
+      xruns += get (&self->call.xruns[i]);
+    }
+
+  if (periods)
+    {
+      // Every period's queue depth is recorded
+      *periods = 0;
+      for (i = 0; i < BUCKETS; ++i)
+        {
+          *periods += get (&self->call.depth[i]);
+        }
+    }
+
+  return xruns;
+}
+
+
+/** Append the non-empty buckets as "<BOUND: COUNT" pairs */
+static void
+append_histogram (GString     *str,
+                  const gchar *name,
+                  const guint *counts,
+                  guint        shift)
+{
+  guint i, count;
+
+  g_string_append_printf (str, ", %s (us)", name);
+  for (i = 0; i < BUCKETS; ++i)
+    {
+      count = get (&counts[i]);
+      if (count == 0)
+        {
+          continue;
+        }
+
+      if (i < BUCKETS - 1)
+        {
+          g_string_append_printf (str, " <%u: %u", 1u << (shift + i), count);
+        }
+      else
+        {
+          g_string_append_printf (str, " >=%u: %u",
+                                  1u << (shift + i - 1), count);
+        }
+    }
+}
+
+
+static void
+append_counts (GString             *str,
+               const gchar         *name,
+               const struct counts *counts)
+{
+  gsize i;
+
+  g_string_append_printf (str, "%s: %u wakeups, %u depth target changes,",
+                          name, get (&counts->wakeups),
+                          get (&counts->retargets));
+  for (i = 0; i < G_N_ELEMENTS (XRUN_NAMES); ++i)
+    {
+      g_string_append_printf (str, " %u %s%s", get (&counts->xruns[i]),
+                              XRUN_NAMES[i],
+                              i + 1 < G_N_ELEMENTS (XRUN_NAMES) ? "," : "");
+    }
+  append_histogram (str, "recovery", counts->recovery, RECOVERY_SHIFT);
+  append_histogram (str, "queue depth", counts->depth, DEPTH_SHIFT);
+}
+
+
+/** Describe the counts, for the last call and in total, on one line
+ * each */
+gchar *
+wys_stats_to_string (WysStats *self)
+{
+  GString *str = g_string_new (NULL);
+  const gint64 begin = __atomic_load_n (&self->call_begin, __ATOMIC_RELAXED);
+  gint64 end = __atomic_load_n (&self->call_end, __ATOMIC_RELAXED);
+
+  const gint64 startup = __atomic_load_n (&self->startup_us,
+                                          __ATOMIC_RELAXED);
+
+  append_counts (str, "last call", &self->call);
+  if (startup >= 0 && begin != 0)
+    {
+      g_string_append_printf (str, ", audio after %" G_GINT64_FORMAT " us",
+                              startup);
+    }
+  g_string_append_printf (str, ", target depth %" G_GINT64_FORMAT
+                          " us, jitter %" G_GINT64_FORMAT
+                          " us, drift %.1f ppm",
+                          __atomic_load_n (&self->target_us, __ATOMIC_RELAXED),
+                          __atomic_load_n (&self->jitter_us, __ATOMIC_RELAXED),
+                          __atomic_load_n (&self->drift_mppm, __ATOMIC_RELAXED)
+                          / 1000.0);
+  if (end == 0)
+    {
+      end = g_get_monotonic_time ();
+    }
+  if (begin != 0 && end > begin)
+    {
+      g_string_append_printf (str, ", %.1f wakeups/s",
+                              get (&self->call.wakeups)
+                              * (gdouble)G_USEC_PER_SEC / (end - begin));
+    }
+  g_string_append_c (str, '\n');
+  g_string_append_printf (str, "%u calls, ", get (&self->calls));
+  append_counts (str, "total", &self->total);
+
+  return g_string_free (str, FALSE);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_STATS_H__
+#define WYS_STATS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  WYS_STATS_UNDERRUN = 0,
+  WYS_STATS_OVERRUN,
+  WYS_STATS_ERROR
+} WysStatsXrun;
+
+typedef struct _WysStats WysStats;
+
+WysStats    *wys_stats_new          (void);
+void         wys_stats_free         (WysStats     *self);
+void         wys_stats_begin_call   (WysStats     *self);
+void         wys_stats_end_call     (WysStats     *self);
+void         wys_stats_wakeup       (WysStats     *self);
+void         wys_stats_xrun         (WysStats     *self,
+                                     WysStatsXrun  xrun);
+void         wys_stats_recovered    (WysStats     *self,
+                                     gint64        duration_us);
+void         wys_stats_depth        (WysStats     *self,
+                                     gint64        depth_us);
+void         wys_stats_target       (WysStats     *self,
+                                     gint64        target_us,
+                                     gint64        jitter_us,
+                                     gdouble       drift_ppm);
+void         wys_stats_flowing      (WysStats     *self,
+                                     gint64        startup_us);
+void         wys_stats_failed       (WysStats     *self,
+                                     const gchar  *what,
+                                     gint          err);
+const gchar *wys_stats_take_failure (WysStats     *self,
+                                     gint         *err);
+guint        wys_stats_get_xruns    (WysStats     *self,
+                                     guint        *periods);
+gchar       *wys_stats_to_string    (WysStats     *self);
+
+G_END_DECLS
+
+#endif /* WYS_STATS_H__ */
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-trace.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+
+/** Enough for every phase main() marks */
+#define MAX_MARKS 16
+
+
+struct mark
+{
+  const gchar *phase;
+  /** Monotonic time the phase ended */
+  gint64 time;
+};
+
+
+/* Only the main thread marks phases */
+static gint64 exec_time;
+static gboolean exec_time_known;
+static struct mark marks[MAX_MARKS];
+static guint n_marks;
+
+
+/** The monotonic time the process was exec'd, from its start time in
+ * /proc, which is in clock ticks since boot */
+static gboolean
+read_exec_time (gint64 *time)
+{
+  g_autofree gchar *contents = NULL;
+  const gchar *field;
+  struct timespec boot;
+  guint64 start;
+  long ticks;
+  guint i;
+
+  if (!g_file_get_contents ("/proc/self/stat", &contents, NULL, NULL))
+    {
+      return FALSE;
+    }
+
+  /* The command name may contain anything, so count the fields from
+     the end of it; the start time is the 22nd field and the state,
+     just after the name, the 3rd */
+  field = strrchr (contents, ')');
+  if (!field)
+    {
+      return FALSE;
+    }
+  for (i = 2; i < 22 && field; ++i)
+    {
+      field = strchr (field + 1, ' ');
+    }
+  ticks = sysconf (_SC_CLK_TCK);
+  if (!field || ticks <= 0
+      || clock_gettime (CLOCK_BOOTTIME, &boot) != 0)
+    {
+      return FALSE;
+    }
+  start = g_ascii_strtoull (field + 1, NULL, 10);
+
+  *time = g_get_monotonic_time ()
+    - ((gint64)boot.tv_sec * G_USEC_PER_SEC + boot.tv_nsec / 1000)
+    + (gint64)(start * G_USEC_PER_SEC / ticks);
+  return TRUE;
+}
+
+
+/**
+ * wys_trace_start:
+ *
+ * Begin tracing start-up, as early in main() as possible.  Phases
+ * are timed from when the process was exec'd where that can be
+ * found, which is only to the resolution of the kernel's clock
+ * tick, and otherwise from this call.  The time before this call is
+ * recorded as the "exec" phase.
+ */
+void
+wys_trace_start (void)
+{
+  const gint64 now = g_get_monotonic_time ();
+
+  exec_time_known = read_exec_time (&exec_time);
+  if (!exec_time_known || exec_time > now)
+    {
+      exec_time = now;
+      exec_time_known = FALSE;
+    }
+
+  wys_trace_mark ("exec");
+}
+
+
+/**
+ * wys_trace_mark:
+ * @phase: a static string naming the phase that just ended
+ *
+ * Record the end of a start-up phase.  Phases happening again, such
+ * as ModemManager reappearing, keep the time of their first end.
+ *
+ * Returns: whether this was the first end of @phase
+ */
+gboolean
+wys_trace_mark (const gchar *phase)
+{
+  guint i;
+
+  for (i = 0; i < n_marks; ++i)
+    {
+      if (strcmp (marks[i].phase, phase) == 0)
+        {
+          return FALSE;
+        }
+    }
+
+  if (n_marks == MAX_MARKS)
+    {
+      g_warning ("Too many start-up phases, not tracing `%s'", phase);
+      return FALSE;
+    }
+
+  marks[n_marks].phase = phase;
+  marks[n_marks].time = g_get_monotonic_time ();
+  ++n_marks;
+
+  g_debug ("Start-up phase `%s' done at %.1f ms", phase,
+           (marks[n_marks - 1].time - exec_time) / 1000.0);
+  return TRUE;
+}
+
+
+/** Describe how long each phase took and when it ended, one line
+ * each */
+gchar *
+wys_trace_to_string (void)
+{
+  GString *str = g_string_new (NULL);
+  gint64 last = exec_time;
+  guint i;
+
+  g_string_append_printf (str, "Start-up phases (ms, from %s):",
+                          exec_time_known ? "exec" : "main");
+  for (i = 0; i < n_marks; ++i)
+    {
+      g_string_append_printf (str, "\n%9.1f %9.1f  %s",
+                              (marks[i].time - last) / 1000.0,
+                              (marks[i].time - exec_time) / 1000.0,
+                              marks[i].phase);
+      last = marks[i].time;
+    }
+
+  return g_string_free (str, FALSE);
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-echo.h"
+
+#include <glib.h>
+
+#include <math.h>
+#include <string.h>
+
+#define RATE    48000
+/** Frames per period, as the loops would pass them */
+#define PERIOD  480
+/** Frames between the far end being played and its echo starting */
+#define DELAY   100
+/** A timeline frame well away from 0 and not on a block boundary */
+#define ORIGIN  1000003
+
+
+struct call
+{
+  gint16 *far;
+  gint16 *mic;
+  gsize frames;
+};
+
+
+/** Make far-end audio, low-pass filtered noise swelling and fading
+ * like speech, and the microphone picking up its echo through a
+ * decaying random path @path_ms long */
+static void
+make_call (struct call *call,
+           gsize        frames,
+           guint        path_ms,
+           guint32      seed)
+{
+  GRand *rand = g_rand_new_with_seed (seed);
+  const gsize path_frames = RATE * path_ms / 1000;
+  gfloat *path = g_new (gfloat, path_frames);
+  gdouble lowpass = 0, sum;
+  gsize i, j;
+
+  for (i = 0; i < path_frames; ++i)
+    {
+      path[i] = 0.05 * g_rand_double_range (rand, -1, 1)
+        * exp (-(gdouble)i / (RATE * 0.008));
+    }
+
+  call->far = g_new (gint16, frames);
+  call->mic = g_new (gint16, frames);
+  call->frames = frames;
+
+  for (i = 0; i < frames; ++i)
+    {
+      lowpass += 0.3 * (g_rand_double_range (rand, -1, 1) - lowpass);
+      call->far[i] = lowpass * 20000 * (0.6 + 0.4 * sin (i / 3000.0));
+    }
+
+  for (i = 0; i < frames; ++i)
+    {
+      sum = g_rand_double_range (rand, -20, 20);
+      for (j = 0; j < path_frames && j + DELAY <= i; ++j)
+        {
+          sum += path[j] * call->far[i - DELAY - j];
+        }
+      call->mic[i] = CLAMP (sum, G_MININT16, G_MAXINT16);
+    }
+
+  g_free (path);
+  g_rand_free (rand);
+}
+
+
+static void
+free_call (struct call *call)
+{
+  g_free (call->mic);
+  g_free (call->far);
+}
+
+
+/** Run @call through @echo starting at timeline frame @origin, with
+ * playback a couple of periods ahead of capture as it would be, and
+ * return the echo return loss enhancement over the last second */
+static gdouble
+run_call (WysEcho     *echo,
+          struct call *call,
+          gint64       origin)
+{
+  const gsize lead = 2 * PERIOD;
+  gint16 out[PERIOD];
+  gdouble before = 0, after = 0, erle;
+  gsize i, j;
+
+  wys_echo_write_reference (echo, origin, call->far, lead);
+  for (i = 0; i + PERIOD <= call->frames; i += PERIOD)
+    {
+      if (i + lead + PERIOD <= call->frames)
+        {
+          wys_echo_write_reference (echo, origin + i + lead,
+                                    call->far + i + lead, PERIOD);
+        }
+
+      memcpy (out, call->mic + i, sizeof (out));
+      wys_echo_cancel (echo, origin + i, out, PERIOD);
+
+      if (i + RATE >= call->frames)
+        {
+          for (j = 0; j < PERIOD; ++j)
+            {
+              before += (gdouble)call->mic[i + j] * call->mic[i + j];
+              after += (gdouble)out[j] * out[j];
+            }
+        }
+    }
+
+  erle = 10 * log10 (before / after);
+  g_test_message ("Echo return loss enhancement %.1f dB", erle);
+  return erle;
+}
+
+
+/** The echo of a path within the tail is cancelled once the filter
+ * has converged */
+static void
+test_converges (void)
+{
+  WysEcho *echo = wys_echo_new (RATE, 64);
+  struct call call;
+
+  make_call (&call, 4 * RATE, 40, 0);
+  g_assert_true (run_call (echo, &call, ORIGIN) > 20);
+
+  free_call (&call);
+  wys_echo_free (echo);
+}
+
+
+/** A call long after the last, through another echo path, is
+ * cancelled as well as the first once the canceller is reset */
+static void
+test_calls_apart (void)
+{
+  WysEcho *echo = wys_echo_new (RATE, 64);
+  struct call first, second;
+
+  make_call (&first, 2 * RATE, 40, 0);
+  make_call (&second, 4 * RATE, 40, 1);
+
+  run_call (echo, &first, ORIGIN);
+  wys_echo_reset (echo);
+  // Ten minutes later
+  g_assert_true (run_call (echo, &second, ORIGIN + 600 * RATE) > 20);
+
+  free_call (&second);
+  free_call (&first);
+  wys_echo_free (echo);
+}
+
+
+/** Without any far-end audio the microphone passes through as it
+ * was */
+static void
+test_no_reference (void)
+{
+  WysEcho *echo = wys_echo_new (RATE, 64);
+  struct call call;
+  gint16 out[PERIOD];
+  gsize i;
+
+  make_call (&call, RATE, 40, 0);
+
+  for (i = 0; i + PERIOD <= call.frames; i += PERIOD)
+    {
+      memcpy (out, call.mic + i, sizeof (out));
+      wys_echo_cancel (echo, ORIGIN + i, out, PERIOD);
+      g_assert_true (memcmp (out, call.mic + i, sizeof (out)) == 0);
+    }
+
+  free_call (&call);
+  wys_echo_free (echo);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/echo/converges", test_converges);
+  g_test_add_func ("/echo/calls-apart", test_calls_apart);
+  g_test_add_func ("/echo/no-reference", test_no_reference);
+
+  return g_test_run ();
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+
+#include "wys-kernels.h"
+
+#include <glib.h>
+
+#include <math.h>
+#include <string.h>
+
+/** Longer than any vector loop step, plus room to start unaligned */
+#define MAX_LENGTH 203
+/** Samples in the buffers, enough for interleaved complex numbers and
+ * four channels */
+#define BUFFER_SAMPLES (4 * MAX_LENGTH + 4)
+/** Relative difference allowed from the reference's float output,
+ * as the vector versions may add up in a different order */
+#define FLOAT_TOLERANCE 1e-5f
+
+static gint16 s16_in[BUFFER_SAMPLES];
+static gint16 s16_in2[BUFFER_SAMPLES];
+static gint32 s32_in[BUFFER_SAMPLES];
+static gfloat float_in[BUFFER_SAMPLES];
+static gfloat float_in2[BUFFER_SAMPLES];
+
+static union
+{
+  gint16 s16[BUFFER_SAMPLES];
+  gint32 s32[BUFFER_SAMPLES];
+  gfloat f[BUFFER_SAMPLES];
+} out, ref_out;
+static gfloat out2[BUFFER_SAMPLES], ref_out2[BUFFER_SAMPLES];
+
+
+/** Random samples, including the extremes and values just out of
+ * range for the float conversions */
+static void
+fill_input (void)
+{
+  guint i;
+
+  for (i = 0; i < BUFFER_SAMPLES; ++i)
+    {
+      s16_in[i] = g_test_rand_int_range (G_MININT16, G_MAXINT16 + 1);
+      s16_in2[i] = g_test_rand_int_range (G_MININT16, G_MAXINT16 + 1);
+      s32_in[i] = (gint32)g_test_rand_int ();
+      float_in[i] = g_test_rand_double_range (-1.2, 1.2);
+      float_in2[i] = g_test_rand_double_range (-1.2, 1.2);
+    }
+
+  s16_in[0] = G_MININT16;
+  s16_in[1] = G_MAXINT16;
+  float_in[0] = -1.0f;
+  float_in[1] = 32767.5f / 32768.0f;
+}
+
+
+/** Each length from 0 up, at each offset a vector load might be
+ * misaligned by */
+#define FOR_EACH_CASE(offset, n)                             \
+  for (offset = 0; offset < 4; ++offset)                     \
+    for (n = 0; n <= MAX_LENGTH - offset; n += n < 40 ? 1 : 13)
+
+
+static void
+clear_output (void)
+{
+  memset (&out, 0x55, sizeof (out));
+  memset (&ref_out, 0x55, sizeof (ref_out));
+}
+
+
+static void
+assert_same (gconstpointer a,
+             gconstpointer b,
+             gsize         size)
+{
+  g_assert_cmpmem (a, size, b, size);
+}
+
+
+static void
+assert_close (const gfloat *a,
+              const gfloat *b,
+              gsize         n)
+{
+  gsize i;
+
+  for (i = 0; i < n; ++i)
+    {
+      g_assert_cmpfloat (fabsf (a[i] - b[i]), <=,
+                         FLOAT_TOLERANCE * MAX (1.0f, fabsf (b[i])));
+    }
+}
+
+
+static void
+test_s32_to_s16 (void)
+{
+  guint offset, n;
+
+  FOR_EACH_CASE (offset, n)
+    {
+      clear_output ();
+      wys_kernel_s32_to_s16 (s32_in + offset, out.s16 + offset, n);
+      wys_kernel_s32_to_s16_ref (s32_in + offset, ref_out.s16 + offset, n);
+      assert_same (out.s16, ref_out.s16, sizeof (out.s16));
+    }
+}
+
+
+static void
+test_s16_to_s32 (void)
+{
+  guint offset, n;
+
+  FOR_EACH_CASE (offset, n)
+    {
+      clear_output ();
+      wys_kernel_s16_to_s32 (s16_in + offset, out.s32 + offset, n);
+      wys_kernel_s16_to_s32_ref (s16_in + offset, ref_out.s32 + offset, n);
+      assert_same (out.s32, ref_out.s32, sizeof (out.s32));
+    }
+}
+
+
+static void
+test_float_to_s16 (void)
+{
+  guint offset, n;
+
+  FOR_EACH_CASE (offset, n)
+    {
+      clear_output ();
+      wys_kernel_float_to_s16 (float_in + offset, out.s16 + offset, n);
+      wys_kernel_float_to_s16_ref (float_in + offset, ref_out.s16 + offset, n);
+      assert_same (out.s16, ref_out.s16, sizeof (out.s16));
+    }
+}
+
+
+static void
+test_s16_to_float (void)
+{
+  guint offset, n;
+
+  FOR_EACH_CASE (offset, n)
+    {
+      clear_output ();
+      wys_kernel_s16_to_float (s16_in + offset, out.f + offset, n);
+      wys_kernel_s16_to_float_ref (s16_in + offset, ref_out.f + offset, n);
+      assert_same (out.f, ref_out.f, sizeof (out.f));
+    }
+}
+
+
+static void
+test_downmix_s16 (void)
+{
+  guint offset, n, channels;
+
+  for (channels = 1; channels <= 4; ++channels)
+    {
+      FOR_EACH_CASE (offset, n)
+        {
+          clear_output ();
+          wys_kernel_downmix_s16 (s16_in + offset, channels,
+                                  out.s16 + offset, n);
+          wys_kernel_downmix_s16_ref (s16_in + offset, channels,
+                                      ref_out.s16 + offset, n);
+          assert_same (out.s16, ref_out.s16, sizeof (out.s16));
+        }
+    }
+}
+
+
+static void
+test_upmix_s16 (void)
+{
+  guint offset, n, channels;
+
+  for (channels = 1; channels <= 4; ++channels)
+    {
+      FOR_EACH_CASE (offset, n)
+        {
+          clear_output ();
+          wys_kernel_upmix_s16 (s16_in + offset, out.s16 + offset,
+                                channels, n);
+          wys_kernel_upmix_s16_ref (s16_in + offset, ref_out.s16 + offset,
+                                    channels, n);
+          assert_same (out.s16, ref_out.s16, sizeof (out.s16));
+        }
+    }
+}
+
+
+static void
+test_dot_s16 (void)
+{
+  guint offset, n;
+
+  FOR_EACH_CASE (offset, n)
+    {
+      g_assert_cmpint (wys_kernel_dot_s16 (s16_in + offset, s16_in2, n), ==,
+                       wys_kernel_dot_s16_ref (s16_in + offset, s16_in2, n));
+    }
+}
+
+
+/** Totals beyond 32 bits saturate, but partial sums beyond them
+ * don't, wherever the vector versions split them */
+static void
+test_dot_s16_saturates (void)
+{
+  static gint16 a[BUFFER_SAMPLES], b[BUFFER_SAMPLES];
+  const gsize n = G_N_ELEMENTS (a);
+  const gint64 expected = (gint64)(n / 2) * 32768 * 32768
+    - (gint64)(n / 2 - 1) * 32768 * 32767;
+  gsize i;
+
+  for (i = 0; i < n; ++i)
+    {
+      a[i] = G_MININT16;
+      b[i] = G_MININT16;
+    }
+  g_assert_cmpint (wys_kernel_dot_s16_ref (a, b, n), ==, G_MAXINT32);
+  g_assert_cmpint (wys_kernel_dot_s16 (a, b, n), ==, G_MAXINT32);
+
+  // Half of it cancels the other half out, so intermediate sums
+  // overflow but the total doesn't
+  for (i = n / 2; i < n; ++i)
+    {
+      b[i] = G_MAXINT16;
+    }
+  b[n - 1] = 0;
+  g_assert_cmpint (expected, <, G_MAXINT32);
+  g_assert_cmpint (wys_kernel_dot_s16_ref (a, b, n), ==, expected);
+  g_assert_cmpint (wys_kernel_dot_s16 (a, b, n), ==,
+                   wys_kernel_dot_s16_ref (a, b, n));
+
+  for (i = 0; i < n; ++i)
+    {
+      b[i] = G_MAXINT16;
+    }
+  g_assert_cmpint (wys_kernel_dot_s16_ref (a, b, n), ==, G_MININT32);
+  g_assert_cmpint (wys_kernel_dot_s16 (a, b, n), ==, G_MININT32);
+}
+
+
+/** The complex kernels work on interleaved pairs, so the offsets are
+ * in floats and may split them between vectors */
+static void
+test_cmac_f32 (void)
+{
+  guint offset, n;
+
+  FOR_EACH_CASE (offset, n)
+    {
+      memcpy (out.f, float_in2, sizeof (out.f));
+      memcpy (ref_out.f, float_in2, sizeof (ref_out.f));
+      wys_kernel_cmac_f32 (float_in + offset, float_in2 + 1, out.f + offset, n);
+      wys_kernel_cmac_f32_ref (float_in + offset, float_in2 + 1,
+                               ref_out.f + offset, n);
+      assert_close (out.f, ref_out.f, BUFFER_SAMPLES);
+    }
+}
+
+
+static void
+test_cmac_conj_f32 (void)
+{
+  guint offset, n;
+
+  FOR_EACH_CASE (offset, n)
+    {
+      memcpy (out.f, float_in2, sizeof (out.f));
+      memcpy (ref_out.f, float_in2, sizeof (ref_out.f));
+      wys_kernel_cmac_conj_f32 (float_in + offset, float_in2 + 1,
+                                out.f + offset, n);
+      wys_kernel_cmac_conj_f32_ref (float_in + offset, float_in2 + 1,
+                                    ref_out.f + offset, n);
+      assert_close (out.f, ref_out.f, BUFFER_SAMPLES);
+    }
+}
+
+
+static void
+test_butterfly_f32 (void)
+{
+  guint offset, n;
+
+  FOR_EACH_CASE (offset, n)
+    {
+      memcpy (out.f, float_in, sizeof (out.f));
+      memcpy (ref_out.f, float_in, sizeof (ref_out.f));
+      memcpy (out2, float_in2, sizeof (out2));
+      memcpy (ref_out2, float_in2, sizeof (ref_out2));
+      wys_kernel_butterfly_f32 (out.f + offset, out2 + 1, float_in + 3, n);
+      wys_kernel_butterfly_f32_ref (ref_out.f + offset, ref_out2 + 1,
+                                    float_in + 3, n);
+      assert_close (out.f, ref_out.f, BUFFER_SAMPLES);
+      assert_close (out2, ref_out2, BUFFER_SAMPLES);
+    }
+}
+
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  fill_input ();
+  g_test_message ("Kernels built for %s", wys_kernel_isa ());
+
+  g_test_add_func ("/kernels/s32-to-s16", test_s32_to_s16);
+  g_test_add_func ("/kernels/s16-to-s32", test_s16_to_s32);
+  g_test_add_func ("/kernels/float-to-s16", test_float_to_s16);
+  g_test_add_func ("/kernels/s16-to-float", test_s16_to_float);
+  g_test_add_func ("/kernels/downmix-s16", test_downmix_s16);
+  g_test_add_func ("/kernels/upmix-s16", test_upmix_s16);
+  g_test_add_func ("/kernels/dot-s16", test_dot_s16);
+  g_test_add_func ("/kernels/dot-s16-saturates", test_dot_s16_saturates);
+  g_test_add_func ("/kernels/cmac-f32", test_cmac_f32);
+  g_test_add_func ("/kernels/cmac-conj-f32", test_cmac_conj_f32);
+  g_test_add_func ("/kernels/butterfly-f32", test_butterfly_f32);
+
+  return g_test_run ();
+}
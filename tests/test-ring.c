@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+
+#include "wys-ring.h"
+
+#include <glib.h>
+
+/** Rounded up to 64 by the ring */
+#define RING_FRAMES 61
+/** Enough to go round the ring tens of thousands of times */
+#define TOTAL_FRAMES (1 << 21)
+/** Each frame carries its sequence number in every word, so a torn
+ * copy shows up as well as a misplaced one */
+#define FRAME_WORDS 3
+
+typedef guint32 Frame[FRAME_WORDS];
+
+/** Odd batch sizes, so the copies straddle the end of the ring at
+ * every offset; some are larger than the ring */
+static const gsize WRITE_BATCHES[] = { 1, 7, 13, 31, 63, 97 };
+static const gsize READ_BATCHES[] = { 3, 5, 11, 29, 67 };
+
+typedef struct
+{
+  WysRing *ring;
+  gsize capacity;
+} Stress;
+
+
+static gpointer
+produce (gpointer data)
+{
+  Stress *stress = data;
+  Frame frames[97];
+  guint32 next = 0;
+  guint batch = 0;
+
+  while (next < TOTAL_FRAMES)
+    {
+      const gsize batch_size =
+        WRITE_BATCHES[batch++ % G_N_ELEMENTS (WRITE_BATCHES)];
+      const gsize want = MIN (batch_size, TOTAL_FRAMES - next);
+      gsize space, written, i, w;
+
+      for (i = 0; i < want; ++i)
+        {
+          for (w = 0; w < FRAME_WORDS; ++w)
+            {
+              frames[i][w] = next + i;
+            }
+        }
+
+      // The consumer can only make more room, never less
+      space = wys_ring_get_space (stress->ring);
+      g_assert_cmpuint (space, <=, stress->capacity);
+      written = wys_ring_write (stress->ring, frames, want);
+      g_assert_cmpuint (written, >=, MIN (want, space));
+      g_assert_cmpuint (written, <=, want);
+
+      next += written;
+      if (written < want)
+        {
+          g_thread_yield ();
+        }
+    }
+
+  return NULL;
+}
+
+
+static gpointer
+consume (gpointer data)
+{
+  Stress *stress = data;
+  Frame frames[67];
+  guint32 next = 0;
+  guint batch = 0;
+
+  while (next < TOTAL_FRAMES)
+    {
+      const gsize want =
+        READ_BATCHES[batch++ % G_N_ELEMENTS (READ_BATCHES)];
+      gsize fill, got, i, w;
+
+      // The producer can only add frames, never take them away
+      fill = wys_ring_get_fill (stress->ring);
+      g_assert_cmpuint (fill, <=, stress->capacity);
+      got = wys_ring_read (stress->ring, frames, want);
+      g_assert_cmpuint (got, >=, MIN (want, fill));
+      g_assert_cmpuint (got, <=, want);
+
+      for (i = 0; i < got; ++i)
+        {
+          for (w = 0; w < FRAME_WORDS; ++w)
+            {
+              g_assert_cmpuint (frames[i][w], ==, next + i);
+            }
+        }
+
+      next += got;
+      if (got < want)
+        {
+          g_thread_yield ();
+        }
+    }
+
+  return NULL;
+}
+
+
+/** A producer and a consumer on their own threads get every frame
+ * through, in order and intact */
+static void
+test_threads (void)
+{
+  Stress stress;
+  GThread *producer, *consumer;
+
+  stress.ring = wys_ring_new (sizeof (Frame), RING_FRAMES);
+  stress.capacity = wys_ring_get_space (stress.ring);
+  g_assert_cmpuint (stress.capacity, ==, 64);
+
+  consumer = g_thread_new ("consumer", consume, &stress);
+  producer = g_thread_new ("producer", produce, &stress);
+  g_thread_join (producer);
+  g_thread_join (consumer);
+
+  g_assert_cmpuint (wys_ring_get_fill (stress.ring), ==, 0);
+  wys_ring_free (stress.ring);
+}
+
+
+/** The fill level follows writes, reads and skips across the end of
+ * the ring, and writes stop when it is full */
+static void
+test_fill (void)
+{
+  WysRing *ring = wys_ring_new (sizeof (Frame), RING_FRAMES);
+  Frame frames[64] = { { 0 } };
+  guint round;
+
+  for (round = 0; round < 5; ++round)
+    {
+      g_assert_cmpuint (wys_ring_write (ring, frames, 45), ==, 45);
+      g_assert_cmpuint (wys_ring_get_fill (ring), ==, 45);
+      g_assert_cmpuint (wys_ring_write (ring, frames, 45), ==, 19);
+      g_assert_cmpuint (wys_ring_get_space (ring), ==, 0);
+      g_assert_cmpuint (wys_ring_read (ring, frames, 33), ==, 33);
+      g_assert_cmpuint (wys_ring_skip (ring, 13), ==, 13);
+      g_assert_cmpuint (wys_ring_get_fill (ring), ==, 18);
+      g_assert_cmpuint (wys_ring_read (ring, frames, 64), ==, 18);
+      g_assert_cmpuint (wys_ring_get_fill (ring), ==, 0);
+      g_assert_cmpuint (wys_ring_read (ring, frames, 1), ==, 0);
+      // Leave the positions somewhere else in the ring for the next
+      // round
+      g_assert_cmpuint (wys_ring_write (ring, frames, 7), ==, 7);
+      g_assert_cmpuint (wys_ring_skip (ring, 64), ==, 7);
+    }
+
+  wys_ring_free (ring);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/ring/fill", test_fill);
+  g_test_add_func ("/ring/threads", test_threads);
+
+  return g_test_run ();
+}
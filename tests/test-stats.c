@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 Purism SPC
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-stats.h"
+
+#include <glib.h>
+
+#include <string.h>
+
+
+/** Samples below the first bucket's bound land in it, including 0 */
+static void
+test_first_bucket (void)
+{
+  WysStats *stats = wys_stats_new ();
+  g_autofree gchar *str = NULL;
+
+  wys_stats_begin_call (stats);
+  wys_stats_depth (stats, 0);
+  wys_stats_depth (stats, 127);
+  wys_stats_depth (stats, 128);
+  wys_stats_recovered (stats, 0);
+  wys_stats_recovered (stats, 1023);
+
+  str = wys_stats_to_string (stats);
+  g_test_message ("%s", str);
+  g_assert_nonnull (strstr (str, "queue depth (us) <128: 2 <256: 1"));
+  g_assert_nonnull (strstr (str, "recovery (us) <1024: 2,"));
+
+  wys_stats_free (stats);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/stats/first-bucket", test_first_bucket);
+
+  return g_test_run ();
+}